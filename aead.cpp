@@ -0,0 +1,114 @@
+#include "aead.h"
+
+#include <stdexcept>
+#include <string>
+
+#include <openssl/evp.h>
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+namespace aead {
+
+uint32_t supportedMask() {
+  return (1u << kAes256Gcm) | (1u << kChaCha20Poly1305);
+}
+
+bool hardwareAes() {
+  static const bool have = [] {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+#elif defined(__aarch64__) && defined(__linux__)
+    const unsigned long caps = getauxval(AT_HWCAP);
+    return (caps & HWCAP_AES) && (caps & HWCAP_PMULL);
+#elif defined(__aarch64__) && defined(__APPLE__)
+    return true;  // every Apple arm64 core has the crypto extensions
+#else
+    return false;
+#endif
+  }();
+  return have;
+}
+
+Suite preferred() {
+  return hardwareAes() ? kAes256Gcm : kChaCha20Poly1305;
+}
+
+Suite pick(uint32_t localMask, Suite localPreferred, uint32_t peerMask, Suite peerPreferred) {
+  if (peerMask == 0) return kAes256Gcm;
+  const uint32_t both = localMask & peerMask;
+  if (inMask(both, kAes256Gcm) && localPreferred == kAes256Gcm && peerPreferred == kAes256Gcm)
+    return kAes256Gcm;
+  if (inMask(both, kChaCha20Poly1305)) return kChaCha20Poly1305;
+  return kAes256Gcm;
+}
+
+const char* name(Suite suite) {
+  switch (suite) {
+    case kAes256Gcm: return "aes-256-gcm";
+    case kChaCha20Poly1305: return "chacha20-poly1305";
+    default: return "unknown";
+  }
+}
+
+namespace {
+EVP_CIPHER_CTX* context(Suite suite, int encrypt) {
+  struct Contexts {
+    EVP_CIPHER_CTX* ctx[2][2] = {};  // [ChaCha20-Poly1305?][encrypt]
+    Contexts() {
+      const char* names[2] = {"AES-256-GCM", "ChaCha20-Poly1305"};
+      for (int s = 0; s < 2; ++s) {
+        EVP_CIPHER* cipher = EVP_CIPHER_fetch(nullptr, names[s], nullptr);
+        for (int enc = 0; enc < 2; ++enc) {
+          ctx[s][enc] = EVP_CIPHER_CTX_new();
+          if (ctx[s][enc] && (!cipher || EVP_CipherInit_ex(ctx[s][enc], cipher, nullptr, nullptr, nullptr, enc) != 1)) {
+            EVP_CIPHER_CTX_free(ctx[s][enc]);
+            ctx[s][enc] = nullptr;
+          }
+        }
+        EVP_CIPHER_free(cipher);  // the contexts hold their own reference
+      }
+    }
+    ~Contexts() {
+      for (auto& pair : ctx)
+        for (EVP_CIPHER_CTX* c : pair) EVP_CIPHER_CTX_free(c);
+    }
+  };
+  thread_local Contexts contexts;
+  EVP_CIPHER_CTX* ctx = contexts.ctx[suite == kChaCha20Poly1305][encrypt];
+  if (!ctx) throw std::runtime_error(std::string(name(suite)) + " unavailable");
+  return ctx;
+}
+}  // namespace
+
+void seal(Suite suite, const uint8_t* key, const uint8_t* nonce, const uint8_t* aad, size_t aad_len,
+          const uint8_t* plaintext, size_t len, uint8_t* out) {
+  EVP_CIPHER_CTX* ctx = context(suite, 1);
+  int n = 0, fin = 0;
+  if (EVP_EncryptInit_ex(ctx, nullptr, nullptr, key, nonce) != 1 ||
+      (aad_len && EVP_EncryptUpdate(ctx, nullptr, &n, aad, static_cast<int>(aad_len)) != 1) ||
+      EVP_EncryptUpdate(ctx, out, &n, plaintext, static_cast<int>(len)) != 1 ||
+      EVP_EncryptFinal_ex(ctx, out + n, &fin) != 1 ||
+      EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, static_cast<int>(kTagSize), out + len) != 1)
+    throw std::runtime_error("AEAD encrypt failed");
+}
+
+bool open(Suite suite, const uint8_t* key, const uint8_t* nonce, const uint8_t* aad, size_t aad_len,
+          const uint8_t* ct_tag, size_t len, uint8_t* out) {
+  if (len < kTagSize) return false;
+  EVP_CIPHER_CTX* ctx = context(suite, 0);
+  const size_t ct_len = len - kTagSize;
+  int n = 0, fin = 0;
+  if (EVP_DecryptInit_ex(ctx, nullptr, nullptr, key, nonce) != 1 ||
+      (aad_len && EVP_DecryptUpdate(ctx, nullptr, &n, aad, static_cast<int>(aad_len)) != 1) ||
+      EVP_DecryptUpdate(ctx, out, &n, ct_tag, static_cast<int>(ct_len)) != 1 ||
+      EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, static_cast<int>(kTagSize),
+                          const_cast<uint8_t*>(ct_tag + ct_len)) != 1)
+    throw std::runtime_error("AEAD decrypt failed");
+  return EVP_DecryptFinal_ex(ctx, out + n, &fin) > 0;
+}
+
+} // namespace aead
@@ -0,0 +1,73 @@
+// AEAD suites for session traffic. Suites are negotiated in the handshake like
+// compression codecs (bitmask plus preference in HandshakeHello, choice in
+// HandshakeResponse); both use 32-byte keys, 12-byte nonces and 16-byte tags,
+// so key schedules, nonces and wire layouts do not depend on the choice.
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "crypto.h"
+
+namespace aead {
+
+enum Suite : uint32_t {
+  kAes256Gcm        = 1,  // protocol default; fastest with AES-NI/PCLMULQDQ or ARMv8 AES/PMULL
+  kChaCha20Poly1305 = 2,  // fastest without them (older x86, small ARM boards)
+};
+
+// Bitmask (1u << suite) of suites this build supports.
+uint32_t supportedMask();
+
+// True if suite's bit is set in mask (rejects out-of-range ids from the wire).
+inline bool inMask(uint32_t mask, uint32_t suite) { return suite < 32 && (mask & (1u << suite)); }
+
+// True when this CPU has AES and carry-less multiply instructions (checked once).
+bool hardwareAes();
+
+// The faster suite on this CPU.
+Suite preferred();
+
+// Server side: AES-256-GCM only if both ends prefer it, otherwise
+// ChaCha20-Poly1305 if both support it; one slow end makes AES-GCM the slower
+// choice for the pair. A peer that sent no mask (older build) gets AES-GCM.
+Suite pick(uint32_t localMask, Suite localPreferred, uint32_t peerMask, Suite peerPreferred);
+
+const char* name(Suite suite);
+
+// Keyed cipher for a negotiated suite, with the EvpAeadCrypto interface.
+class AeadCrypto : public EvpAeadCrypto {
+public:
+  AeadCrypto() : AeadCrypto(kAes256Gcm, std::vector<uint8_t>(KEY_SIZE)) {}  // placeholder until keyed
+  AeadCrypto(Suite suite, const std::vector<uint8_t>& key)
+      : EvpAeadCrypto(suite == kChaCha20Poly1305 ? EVP_chacha20_poly1305() : EVP_aes_256_gcm(), key) {}
+};
+
+// Record sizes, the same for every suite.
+constexpr size_t kKeySize = 32;
+constexpr size_t kNonceSize = 12;
+constexpr size_t kTagSize = 16;
+
+// Record nonce: direction (4 bytes) || record counter (8 bytes), big-endian;
+// wire::compactNonce layout.
+inline void counterNonce(uint32_t direction, uint64_t counter, uint8_t out[kNonceSize]) {
+  for (int i = 0; i < 4; ++i) out[i] = static_cast<uint8_t>(direction >> (8 * (3 - i)));
+  for (int i = 0; i < 8; ++i) out[4 + i] = static_cast<uint8_t>(counter >> (8 * (7 - i)));
+}
+
+// One-shot seal/open under a raw key. Each thread keeps an encrypt and a
+// decrypt context per suite with the cipher fetched and set up front, so a
+// record only loads its key and nonce: no context allocation or cipher lookup
+// per call, unlike EvpAeadCrypto. A context holds the last key schedule until
+// the thread's next record under that suite.
+//
+// seal writes len + kTagSize bytes (ciphertext || tag) to out. open reads len
+// bytes of ciphertext || tag and writes len - kTagSize bytes to out; false if
+// the tag does not verify (out then holds garbage).
+void seal(Suite suite, const uint8_t* key, const uint8_t* nonce, const uint8_t* aad, size_t aad_len,
+          const uint8_t* plaintext, size_t len, uint8_t* out);
+bool open(Suite suite, const uint8_t* key, const uint8_t* nonce, const uint8_t* aad, size_t aad_len,
+          const uint8_t* ct_tag, size_t len, uint8_t* out);
+
+} // namespace aead
@@ -1,4 +1,5 @@
 #include "beast_ws_transport.h"
+#include "protocol.h"
 
 #include <boost/asio/connect.hpp>
 #include <boost/asio/ip/tcp.hpp>
@@ -59,6 +60,7 @@ struct BeastWebSocketTransport::Impl {
       boost::beast::get_lowest_layer(*wss).connect(results);
       wss->next_layer().handshake(boost::asio::ssl::stream_base::client);
       wss->set_option(boost::beast::websocket::stream_base::timeout::suggested(boost::beast::role_type::client));
+      wss->read_message_max(protocol::kMaxFrameSize);
       wss->handshake(u.host, u.target);
       open = true;
       return true;
@@ -66,6 +68,7 @@ struct BeastWebSocketTransport::Impl {
       ws = std::make_unique<boost::beast::websocket::stream<boost::beast::tcp_stream>>(ioc);
       boost::beast::get_lowest_layer(*ws).connect(results);
       ws->set_option(boost::beast::websocket::stream_base::timeout::suggested(boost::beast::role_type::client));
+      ws->read_message_max(protocol::kMaxFrameSize);
       ws->handshake(u.host, u.target);
       open = true;
       return true;
@@ -100,6 +103,15 @@ struct BeastWebSocketTransport::Impl {
     return true;
   }
 
+  int reconnect_hint_ms() const {
+    const auto& reason = wss ? wss->reason() : ws ? ws->reason() : boost::beast::websocket::close_reason{};
+    const std::string text(reason.reason.data(), reason.reason.size());
+    if (reason.code != boost::beast::websocket::close_code::service_restart || text.rfind("reconnect ", 0) != 0) {
+      return -1;
+    }
+    return std::atoi(text.c_str() + 10);
+  }
+
   void close() {
     if (!open) return;
     boost::system::error_code ec;
@@ -119,3 +131,4 @@ bool BeastWebSocketTransport::connect_url(const std::string& url) { return impl_
 bool BeastWebSocketTransport::send(const std::vector<uint8_t>& data) { return impl_->send(data); }
 bool BeastWebSocketTransport::recv(std::vector<uint8_t>& out) { return impl_->recv(out); }
 void BeastWebSocketTransport::close() { impl_->close(); }
+int BeastWebSocketTransport::reconnect_hint_ms() const { return impl_->reconnect_hint_ms(); }
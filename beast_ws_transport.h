@@ -15,6 +15,10 @@ public:
   bool recv(std::vector<uint8_t>& out);
   void close();
 
+  // After recv() fails: the delay the relay suggested in a "reconnect <ms>"
+  // Close (sent while it drains for a restart), or -1 if it sent none.
+  int reconnect_hint_ms() const;
+
 private:
   struct Impl;
   Impl* impl_ = nullptr;
@@ -0,0 +1,171 @@
+#include "compression.h"
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace {
+// Preset dictionary: strings that dominate pasted logs, JSON and stack traces.
+// Both sides must use the same bytes, so changing this is a wire change.
+const std::string& chatDictionary() {
+  static const std::string k =
+      "{\"id\":\"\",\"type\":\"\",\"name\":\"\",\"value\":\"\",\"status\":\"\",\"message\":\"\","
+      "\"error\":\"\",\"data\":{\"items\":[{\"timestamp\":\"\",\"created_at\":\"\",\"updated_at\":\"\","
+      "\"user\":\"\",\"url\":\"https://\",\"true\",\"false\",\"null\"}]}"
+      "INFO  WARN  ERROR DEBUG TRACE Exception Traceback (most recent call last):\n"
+      "  File \"\", line , in \n    at java.lang.Thread.run(Thread.java)\n"
+      "std::runtime_error terminate called after throwing an instance of\n"
+      "Segmentation fault (core dumped)\nerror: warning: note: undefined reference to\n"
+      "#include <string>\n#include <vector>\nint main(int argc, char* argv[]) {\n  return 0;\n}\n"
+      "def __init__(self): return None\nfunction() { const let var => }\n"
+      "SELECT * FROM WHERE AND ORDER BY LIMIT\nGET POST HTTP/1.1 200 OK 404 Not Found 500\n"
+      "Content-Type: application/json\r\n"
+      "the and that have for not with you this but from they will would there their what "
+      "about which when make can like time just know take people into year your good some "
+      "could them see other than then now look only come its over think also back after use "
+      "two how our work first well way even new want because any these give day most us "
+      "thanks please hey yes okay sure sorry lol haha ";
+  return k;
+}
+
+#ifdef HAVE_ZSTD
+constexpr int kZstdLevel = 3;
+
+const ZSTD_CDict* zstdCDict() {
+  static ZSTD_CDict* d = ZSTD_createCDict(chatDictionary().data(), chatDictionary().size(), kZstdLevel);
+  return d;
+}
+
+const ZSTD_DDict* zstdDDict() {
+  static ZSTD_DDict* d = ZSTD_createDDict(chatDictionary().data(), chatDictionary().size());
+  return d;
+}
+#endif
+
+bool worthIt(size_t compressed, size_t original) {
+  // Require at least 1/16 saved so incompressible payloads skip the decompress cost.
+  return compressed + original / 16 < original;
+}
+
+bool deflateDict(const uint8_t* in, size_t len, std::vector<uint8_t>& out) {
+  z_stream zs{};
+  // Raw deflate (negative window bits): no zlib header/adler, we have GCM for integrity.
+  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    throw std::runtime_error("deflateInit2 failed");
+  const auto& dict = chatDictionary();
+  deflateSetDictionary(&zs, reinterpret_cast<const Bytef*>(dict.data()), static_cast<uInt>(dict.size()));
+  out.resize(deflateBound(&zs, static_cast<uLong>(len)));
+  zs.next_in = const_cast<Bytef*>(in);
+  zs.avail_in = static_cast<uInt>(len);
+  zs.next_out = out.data();
+  zs.avail_out = static_cast<uInt>(out.size());
+  int rc = deflate(&zs, Z_FINISH);
+  out.resize(zs.total_out);
+  deflateEnd(&zs);
+  if (rc != Z_STREAM_END) throw std::runtime_error("deflate failed");
+  return worthIt(out.size(), len);
+}
+
+void inflateDict(const uint8_t* in, size_t len, std::vector<uint8_t>& out) {
+  z_stream zs{};
+  if (inflateInit2(&zs, -15) != Z_OK) throw std::runtime_error("inflateInit2 failed");
+  const auto& dict = chatDictionary();
+  inflateSetDictionary(&zs, reinterpret_cast<const Bytef*>(dict.data()), static_cast<uInt>(dict.size()));
+  zs.next_in = const_cast<Bytef*>(in);
+  zs.avail_in = static_cast<uInt>(len);
+  // Guess 4x, but never allocate past the cap before any output exists.
+  out.resize(std::min(std::max<size_t>(4096, len * 4), compression::kMaxDecompressedSize));
+  int rc = Z_OK;
+  for (;;) {
+    zs.next_out = out.data() + zs.total_out;
+    zs.avail_out = static_cast<uInt>(out.size() - zs.total_out);
+    rc = inflate(&zs, Z_FINISH);
+    if (rc == Z_STREAM_END) break;
+    // Stalled with output space left means truncated input; otherwise grow and retry.
+    if ((rc != Z_BUF_ERROR && rc != Z_OK) || zs.avail_out != 0 ||
+        out.size() >= compression::kMaxDecompressedSize) {
+      inflateEnd(&zs);
+      throw std::runtime_error("inflate failed");
+    }
+    out.resize(std::min(out.size() * 2, compression::kMaxDecompressedSize));
+  }
+  out.resize(zs.total_out);
+  inflateEnd(&zs);
+}
+}  // namespace
+
+namespace compression {
+
+uint32_t supportedMask() {
+  uint32_t mask = 1u << kDeflate;
+#ifdef HAVE_ZSTD
+  mask |= 1u << kZstd;
+#endif
+  return mask;
+}
+
+Codec pick(uint32_t localMask, uint32_t peerMask) {
+  const uint32_t both = localMask & peerMask;
+  if (inMask(both, kZstd)) return kZstd;
+  if (inMask(both, kDeflate)) return kDeflate;
+  return kNone;
+}
+
+const char* name(Codec codec) {
+  switch (codec) {
+    case kDeflate: return "deflate";
+    case kZstd: return "zstd";
+    default: return "none";
+  }
+}
+
+bool compress(Codec codec, const uint8_t* in, size_t len, std::vector<uint8_t>& out) {
+  switch (codec) {
+    case kDeflate:
+      return deflateDict(in, len, out);
+#ifdef HAVE_ZSTD
+    case kZstd: {
+      thread_local std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx(ZSTD_createCCtx(), &ZSTD_freeCCtx);
+      if (!cctx) throw std::runtime_error("ZSTD_createCCtx failed");
+      out.resize(ZSTD_compressBound(len));
+      size_t n = ZSTD_compress_usingCDict(cctx.get(), out.data(), out.size(), in, len, zstdCDict());
+      if (ZSTD_isError(n)) throw std::runtime_error(ZSTD_getErrorName(n));
+      out.resize(n);
+      return worthIt(n, len);
+    }
+#endif
+    default:
+      return false;
+  }
+}
+
+void decompress(Codec codec, const uint8_t* in, size_t len, std::vector<uint8_t>& out) {
+  switch (codec) {
+    case kDeflate:
+      inflateDict(in, len, out);
+      return;
+#ifdef HAVE_ZSTD
+    case kZstd: {
+      unsigned long long size = ZSTD_getFrameContentSize(in, len);
+      if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN || size > kMaxDecompressedSize)
+        throw std::runtime_error("zstd: bad frame size");
+      thread_local std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx(ZSTD_createDCtx(), &ZSTD_freeDCtx);
+      if (!dctx) throw std::runtime_error("ZSTD_createDCtx failed");
+      out.resize(static_cast<size_t>(size));
+      size_t n = ZSTD_decompress_usingDDict(dctx.get(), out.data(), out.size(), in, len, zstdDDict());
+      if (ZSTD_isError(n) || n != out.size()) throw std::runtime_error("zstd: decompress failed");
+      return;
+    }
+#endif
+    default:
+      throw std::runtime_error("unsupported compression codec");
+  }
+}
+
+} // namespace compression
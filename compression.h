@@ -0,0 +1,44 @@
+// Compress-then-encrypt codecs for large message payloads.
+// Codecs are negotiated in the handshake (bitmask in HandshakeHello, choice in
+// HandshakeResponse); each message then says whether it was compressed.
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace compression {
+
+enum Codec : uint32_t {
+  kNone    = 0,
+  kDeflate = 1,  // zlib raw deflate with the shared chat dictionary
+  kZstd    = 2,  // zstd with the shared chat dictionary (only if built with libzstd)
+};
+
+// Payloads below this size are sent as-is; the saving doesn't cover the CPU.
+constexpr size_t kMinCompressSize = 512;
+
+// Largest plaintext we will inflate a single message to.
+constexpr size_t kMaxDecompressedSize = 16u * 1024 * 1024;
+
+// Bitmask (1u << codec) of codecs this build supports.
+uint32_t supportedMask();
+
+// True if codec's bit is set in mask (rejects out-of-range ids from the wire).
+inline bool inMask(uint32_t mask, uint32_t codec) { return codec < 32 && (mask & (1u << codec)); }
+
+// Best codec present in both masks, or kNone.
+Codec pick(uint32_t localMask, uint32_t peerMask);
+
+const char* name(Codec codec);
+
+// Compresses in[0..len) into out. Returns false when the result would not be
+// meaningfully smaller than the input (the caller then sends it uncompressed).
+// Throws std::runtime_error on codec failure.
+bool compress(Codec codec, const uint8_t* in, size_t len, std::vector<uint8_t>& out);
+
+// Inverse of compress(); throws std::runtime_error on corrupt input or if the
+// output would exceed kMaxDecompressedSize.
+void decompress(Codec codec, const uint8_t* in, size_t len, std::vector<uint8_t>& out);
+
+} // namespace compression
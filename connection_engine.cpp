@@ -1,16 +1,24 @@
 #include "connection_engine.h"
 
+#include <algorithm>
 #include <chrono>
 #include <filesystem>
 #include <string>
 
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
 #include "envelope.pb.h"
 #include "handshake.pb.h"
 #include "hkdf.h"
 #include "kem_kyber.h"
 #include "messages.pb.h"
 #include "crypto.h"
+#include "engine_trace.h"
+#include "handshake_guard.h"
 #include "protocol.h"
+#include "wire_format.h"
+#include "x25519.h"
 
 namespace {
 int64_t nowSeconds() {
@@ -28,6 +36,45 @@ std::vector<uint8_t> concat(const std::string& prefix,
   out.insert(out.end(), b.begin(), b.end());
   return out;
 }
+// Bytes each side signs. With params (v2) the signature also covers the
+// negotiation: the client's offer and, in the host's, what it picked, so a peer
+// in the middle cannot strip stronger KEMs or steer the suite, codec or version
+// unnoticed. Without (v1) it covers the keys only, for peers that predate it.
+std::vector<uint8_t> transcript(const char* role, const std::vector<uint32_t>& params,
+                                const std::vector<uint8_t>& a, const std::vector<uint8_t>& b = {}) {
+  if (params.empty()) return concat(std::string("E2EE-HANDSHAKE-v1|") + role + "|", a, b);
+  std::string prefix = std::string("E2EE-HANDSHAKE-v2|") + role + "|";
+  for (uint32_t v : params)
+    for (int i = 3; i >= 0; --i) prefix.push_back(static_cast<char>(v >> (8 * i)));
+  return concat(prefix, a, b);
+}
+// The hello's offer, as both signatures cover it.
+std::vector<uint32_t> offerParams(const HandshakeHello& hello) {
+  return {hello.kem_algs(), hello.kem_alg(), hello.version(), hello.compression_codecs(),
+          hello.aead_suites(), hello.aead_preferred()};
+}
+// The offer plus the host's choices, as the host's signature covers them.
+std::vector<uint32_t> choiceParams(const HandshakeHello& hello, const HandshakeResponse& resp) {
+  auto params = offerParams(hello);
+  params.insert(params.end(), {resp.version(), resp.compression_codec(), resp.aead_suite()});
+  return params;
+}
+std::vector<uint8_t> cat(const std::vector<uint8_t>& a, const std::vector<uint8_t>& b) {
+  return concat("", a, b);
+}
+
+// HKDF input for a handshake: the KEM secret, followed in hybrid mode by the
+// X25519 one (the order TLS's X25519MLKEM768 uses). x_ss is erased.
+std::vector<uint8_t> hybridSecret(const std::vector<uint8_t>& kem_ss, std::vector<uint8_t>& x_ss) {
+  auto ikm = cat(kem_ss, x_ss);
+  OPENSSL_cleanse(x_ss.data(), x_ss.size());
+  return ikm;
+}
+
+// AAD binding a ChatMessage to its sequence number.
+void sequenceAad(uint64_t sequence, uint8_t out[8]) {
+  for (int i = 0; i < 8; ++i) out[i] = static_cast<uint8_t>(sequence >> (8 * (7 - i)));
+}
 }  // namespace
 
 ConnectionEngine::ConnectionEngine() = default;
@@ -78,36 +125,141 @@ bool ConnectionEngine::encryptAndSerializeMessage(const std::string& plaintext,
     errorOut = "Session key not established";
     return false;
   }
-  try {
-    std::vector<uint8_t> plain(plaintext.begin(), plaintext.end());
-    auto nonce = AESGCMCrypto::random_nonce();
-    auto ct_tag = session_.encrypt(plain, nonce);
+  if (wireVersion_ >= protocol::kVersionCompact) {
+    outBytes.clear();
+    return appendCompactRecord(plaintext, 0, outBytes, errorOut);
+  }
 
-    ChatMessage inner;
-    inner.set_sender_id(senderId);
-    inner.set_timestamp_unix(nowSeconds());
-    inner.set_nonce(reinterpret_cast<const char*>(nonce.data()), nonce.size());
-    inner.set_encrypted_content(reinterpret_cast<const char*>(ct_tag.data()), ct_tag.size());
+  std::string inner_bytes;
+  if (!encryptChatMessage(plaintext, senderId, inner_bytes, errorOut)) return false;
 
-    std::string inner_bytes;
-    if (!inner.SerializeToString(&inner_bytes)) {
-      errorOut = "Failed to serialize ChatMessage";
+  Envelope env;
+  env.set_version(protocol::kVersion);
+  env.set_to_username(toUsername);
+  env.set_client_timestamp(nowSeconds());
+  env.set_payload_e2e(std::move(inner_bytes));
+
+  std::string env_bytes;
+  if (!trace::timed(tracer(), trace::kSerialize, [&]{ return env.SerializeToString(&env_bytes); })) {
+    errorOut = "Failed to serialize Envelope";
+    return false;
+  }
+
+  outBytes.assign(env_bytes.begin(), env_bytes.end());
+  return true;
+}
+
+bool ConnectionEngine::encryptAndSerializeBundle(const std::vector<std::string>& plaintexts,
+                                                 const std::string& senderId,
+                                                 const std::string& toUsername,
+                                                 std::vector<uint8_t>& outBytes,
+                                                 std::string& errorOut) const {
+  if (!sessionReady_) {
+    errorOut = "Session key not established";
+    return false;
+  }
+  if (plaintexts.empty() || plaintexts.size() > protocol::kMaxBundleMessages) {
+    errorOut = "Bundle size out of range";
+    return false;
+  }
+  if (plaintexts.size() == 1) {
+    return encryptAndSerializeMessage(plaintexts.front(), senderId, toUsername, outBytes, errorOut);
+  }
+  if (wireVersion_ >= protocol::kVersionCompact) {
+    outBytes.clear();
+    for (const auto& plaintext : plaintexts) {
+      if (!appendCompactRecord(plaintext, 0, outBytes, errorOut)) return false;
+    }
+    return true;
+  }
+
+  Envelope env;
+  env.set_version(protocol::kVersion);
+  env.set_to_username(toUsername);
+  env.set_client_timestamp(nowSeconds());
+  for (const auto& plaintext : plaintexts) {
+    if (!encryptChatMessage(plaintext, senderId, *env.add_payload_bundle(), errorOut)) return false;
+  }
+
+  std::string env_bytes;
+  if (!trace::timed(tracer(), trace::kSerialize, [&]{ return env.SerializeToString(&env_bytes); })) {
+    errorOut = "Failed to serialize Envelope";
+    return false;
+  }
+
+  outBytes.assign(env_bytes.begin(), env_bytes.end());
+  return true;
+}
+
+bool ConnectionEngine::encryptForRecipients(const std::vector<const ConnectionEngine*>& sessions,
+                                            const std::string& plaintext,
+                                            const std::string& senderId,
+                                            std::vector<uint8_t>& outBytes,
+                                            std::string& errorOut) {
+  if (sessions.empty()) {
+    errorOut = "No recipients";
+    return false;
+  }
+  for (const auto* s : sessions) {
+    if (!s->sessionReady_) {
+      errorOut = "Session key not established";
       return false;
     }
+  }
+  const ConnectionEngine& first = *sessions.front();
+  try {
+    std::vector<uint8_t> packed;
+    const bool sameCodec = std::all_of(sessions.begin(), sessions.end(),
+                                       [&](const ConnectionEngine* s){ return s->codec_ == first.codec_; });
+    const bool compressed = sameCodec && first.maybeCompress(plaintext, packed);
+    const uint8_t* body = compressed ? packed.data() : reinterpret_cast<const uint8_t*>(plaintext.data());
+    const size_t bodyLen = compressed ? packed.size() : plaintext.size();
+
+    uint8_t contentKey[AESGCMCrypto::KEY_SIZE];
+    if (RAND_bytes(contentKey, sizeof(contentKey)) != 1) throw std::runtime_error("RAND_bytes failed");
+    const auto nonce = AESGCMCrypto::random_nonce();
 
     Envelope env;
     env.set_version(protocol::kVersion);
-    env.set_to_username(toUsername);
     env.set_client_timestamp(nowSeconds());
-    env.set_payload_e2e(inner_bytes);
+    MultiRecipientPayload& multi = *env.mutable_multi_recipient();
+    multi.set_sender_id(senderId);
+    multi.set_nonce(reinterpret_cast<const char*>(nonce.data()), nonce.size());
+    if (compressed) multi.set_compression(first.codec_);
+    std::string& ct = *multi.mutable_ciphertext();
+    ct.resize(bodyLen + AESGCMCrypto::TAG_SIZE);
+    trace::timed(first.tracer(), trace::kEncrypt, [&]{
+      AESGCMCrypto(std::vector<uint8_t>(contentKey, contentKey + sizeof(contentKey)))
+          .encrypt_into(body, bodyLen, nonce.data(), nullptr, 0, reinterpret_cast<uint8_t*>(&ct[0]));
+    });
+
+    // Each key is sealed under that session's key with the session's next
+    // sequence number as the nonce; compact records use ratchet keys and
+    // ChatMessages random nonces, so nothing else uses this key with it.
+    std::vector<uint8_t> aad = wrappedKeyAad(multi, first.sendKeyId_);
+    for (const auto* s : sessions) {
+      WrappedKey& wk = *multi.add_keys();
+      const uint64_t counter = s->sendCounter_.fetch_add(1);
+      uint8_t keyNonce[AESGCMCrypto::NONCE_SIZE];
+      wire::compactNonce(s->initiator_ ? protocol::kDirectionClientToServer
+                                       : protocol::kDirectionServerToClient,
+                         counter, keyNonce);
+      std::copy(s->sendKeyId_.begin(), s->sendKeyId_.end(), aad.begin());
+      wk.set_key_id(s->sendKeyId_);
+      wk.set_counter(counter);
+      std::string& sealed = *wk.mutable_sealed();
+      sealed.resize(sizeof(contentKey) + AESGCMCrypto::TAG_SIZE);
+      s->session_.encrypt_into(contentKey, sizeof(contentKey), keyNonce, aad.data(), aad.size(),
+                               reinterpret_cast<uint8_t*>(&sealed[0]));
+    }
+    OPENSSL_cleanse(contentKey, sizeof(contentKey));
 
-    std::string env_bytes;
-    if (!env.SerializeToString(&env_bytes)) {
+    std::string envBytes;
+    if (!trace::timed(first.tracer(), trace::kSerialize, [&]{ return env.SerializeToString(&envBytes); })) {
       errorOut = "Failed to serialize Envelope";
       return false;
     }
-
-    outBytes.assign(env_bytes.begin(), env_bytes.end());
+    outBytes.assign(envBytes.begin(), envBytes.end());
     return true;
   } catch (const std::exception& ex) {
     errorOut = ex.what();
@@ -115,27 +267,192 @@ bool ConnectionEngine::encryptAndSerializeMessage(const std::string& plaintext,
   }
 }
 
+std::vector<uint8_t> ConnectionEngine::wrappedKeyAad(const MultiRecipientPayload& multi, const std::string& keyId) {
+  uint8_t digest[EVP_MAX_MD_SIZE];
+  unsigned int len = 0;
+  if (EVP_Digest(multi.ciphertext().data(), multi.ciphertext().size(), digest, &len, EVP_sha256(), nullptr) != 1)
+    throw std::runtime_error("EVP_Digest failed");
+  std::vector<uint8_t> aad(keyId.begin(), keyId.end());
+  aad.insert(aad.end(), multi.nonce().begin(), multi.nonce().end());
+  aad.insert(aad.end(), digest, digest + len);
+  aad.push_back(static_cast<uint8_t>(multi.compression()));
+  aad.insert(aad.end(), multi.sender_id().begin(), multi.sender_id().end());
+  return aad;
+}
+
 bool ConnectionEngine::parseAndDecryptMessage(const std::vector<uint8_t>& frame,
                                               std::string& plaintextOut,
                                               std::string& errorOut) const {
+  std::vector<std::string> plaintexts;
+  if (!parseAndDecryptMessages(frame, plaintexts, errorOut)) return false;
+  if (plaintexts.size() != 1) {
+    errorOut = "Envelope carries a bundle of " + std::to_string(plaintexts.size()) + " messages";
+    return false;
+  }
+  plaintextOut = std::move(plaintexts.front());
+  return true;
+}
+
+bool ConnectionEngine::parseAndDecryptMessages(const std::vector<uint8_t>& frame,
+                                               std::vector<std::string>& plaintextsOut,
+                                               std::string& errorOut) const {
+  plaintextsOut.clear();
   if (!sessionReady_) {
     errorOut = "Session key not established";
     return false;
   }
+  if (wire::isCompactFrame(frame.data(), frame.size())) {
+    return decryptCompactFrame(frame, false, plaintextsOut, errorOut);
+  }
   Envelope env;
-  if (!env.ParseFromArray(frame.data(), static_cast<int>(frame.size()))) {
+  if (!trace::timed(tracer(), trace::kParse, [&]{
+        return env.ParseFromArray(frame.data(), static_cast<int>(frame.size()));
+      })) {
     errorOut = "Malformed Envelope";
     return false;
   }
+  if (env.has_multi_recipient()) {
+    plaintextsOut.emplace_back();
+    if (decryptMultiRecipient(env.multi_recipient(), plaintextsOut.back(), errorOut)) return true;
+    plaintextsOut.clear();
+    return false;
+  }
+  if (env.payload_bundle_size() == 0) {
+    plaintextsOut.emplace_back();
+    return decryptChatMessage(env.payload_e2e(), plaintextsOut.back(), errorOut);
+  }
+  if (static_cast<size_t>(env.payload_bundle_size()) > protocol::kMaxBundleMessages) {
+    errorOut = "Bundle too large";
+    return false;
+  }
+  plaintextsOut.resize(env.payload_bundle_size());
+  for (int i = 0; i < env.payload_bundle_size(); ++i) {
+    if (!decryptChatMessage(env.payload_bundle(i), plaintextsOut[i], errorOut)) {
+      plaintextsOut.clear();
+      return false;
+    }
+  }
+  return true;
+}
+
+ConnectionEngine::FrameKind ConnectionEngine::frameKind(const std::vector<uint8_t>& frame) {
+  if (wire::isFileChunkFrame(frame.data(), frame.size())) return FrameKind::FileChunk;
+  if (wire::isCompactFrame(frame.data(), frame.size()) && (frame[1] & wire::kFlagFileControl))
+    return FrameKind::FileControl;
+  return FrameKind::Message;
+}
+
+bool ConnectionEngine::encryptAndSerializeControl(const std::string& body,
+                                                  std::vector<uint8_t>& outBytes,
+                                                  std::string& errorOut) const {
+  if (!sessionReady_) {
+    errorOut = "Session key not established";
+    return false;
+  }
+  if (wireVersion_ < protocol::kVersionCompact) {
+    errorOut = "Peer does not support file transfer (protocol v1)";
+    return false;
+  }
+  outBytes.clear();
+  return appendCompactRecord(body, wire::kFlagFileControl, outBytes, errorOut);
+}
+
+bool ConnectionEngine::parseAndDecryptControl(const std::vector<uint8_t>& frame,
+                                              std::string& bodyOut,
+                                              std::string& errorOut) const {
+  if (!sessionReady_) {
+    errorOut = "Session key not established";
+    return false;
+  }
+  std::vector<std::string> bodies;
+  if (!decryptCompactFrame(frame, true, bodies, errorOut)) return false;
+  if (bodies.size() != 1) {
+    errorOut = "Malformed control frame";
+    return false;
+  }
+  bodyOut = std::move(bodies.front());
+  return true;
+}
+
+bool ConnectionEngine::encryptChatMessage(const std::string& plaintext,
+                                          const std::string& senderId,
+                                          std::string& innerBytesOut,
+                                          std::string& errorOut) const {
+  try {
+    std::vector<uint8_t> plain;
+    const bool compressed = maybeCompress(plaintext, plain);
+    if (!compressed) plain.assign(plaintext.begin(), plaintext.end());
+    auto nonce = AESGCMCrypto::random_nonce();
+    const uint64_t sequence = sendCounter_.fetch_add(1);
+    uint8_t aad[8];
+    sequenceAad(sequence, aad);
+    std::vector<uint8_t> ct_tag(plain.size() + AESGCMCrypto::TAG_SIZE);
+    trace::timed(tracer(), trace::kEncrypt, [&]{
+      session_.encrypt_into(plain.data(), plain.size(), nonce.data(), aad, sizeof(aad), ct_tag.data());
+    });
+
+    ChatMessage inner;
+    if (compressed) inner.set_compression(codec_);
+    inner.set_sequence(sequence);
+    inner.set_sender_id(senderId);
+    inner.set_timestamp_unix(nowSeconds());
+    inner.set_nonce(reinterpret_cast<const char*>(nonce.data()), nonce.size());
+    inner.set_encrypted_content(reinterpret_cast<const char*>(ct_tag.data()), ct_tag.size());
+
+    if (!trace::timed(tracer(), trace::kSerialize, [&]{ return inner.SerializeToString(&innerBytesOut); })) {
+      errorOut = "Failed to serialize ChatMessage";
+      return false;
+    }
+    return true;
+  } catch (const std::exception& ex) {
+    errorOut = ex.what();
+    return false;
+  }
+}
+
+bool ConnectionEngine::decryptChatMessage(const std::string& innerBytes,
+                                          std::string& plaintextOut,
+                                          std::string& errorOut) const {
   ChatMessage inner;
-  if (!inner.ParseFromArray(env.payload_e2e().data(), static_cast<int>(env.payload_e2e().size()))) {
+  if (!trace::timed(tracer(), trace::kParse, [&]{
+        return inner.ParseFromArray(innerBytes.data(), static_cast<int>(innerBytes.size()));
+      })) {
     errorOut = "Malformed ChatMessage";
     return false;
   }
-  std::vector<uint8_t> nonce(inner.nonce().begin(), inner.nonce().end());
-  std::vector<uint8_t> ct_tag(inner.encrypted_content().begin(), inner.encrypted_content().end());
+  if (inner.nonce().size() != AESGCMCrypto::NONCE_SIZE ||
+      inner.encrypted_content().size() < AESGCMCrypto::TAG_SIZE) {
+    errorOut = "Malformed ChatMessage";
+    return false;
+  }
+  if (!session_.check_sequence(inner.sequence())) {
+    errorOut = "Message replayed or too old";
+    return false;
+  }
+  uint8_t aad[8];
+  sequenceAad(inner.sequence(), aad);
+  const auto& ct_tag = inner.encrypted_content();
   try {
-    auto plain = session_.decrypt(ct_tag, nonce);
+    std::vector<uint8_t> plain(ct_tag.size() - AESGCMCrypto::TAG_SIZE);
+    trace::timed(tracer(), trace::kDecrypt, [&]{
+      session_.decrypt_into(reinterpret_cast<const uint8_t*>(ct_tag.data()), ct_tag.size(),
+                            reinterpret_cast<const uint8_t*>(inner.nonce().data()), aad, sizeof(aad), plain.data());
+    });
+    if (!session_.accept_sequence(inner.sequence())) {
+      errorOut = "Message replayed or too old";
+      return false;
+    }
+    if (inner.compression() != compression::kNone) {
+      if (!compression::inMask(compression::supportedMask(), inner.compression())) {
+        errorOut = "Unsupported compression codec";
+        return false;
+      }
+      std::vector<uint8_t> inflated;
+      trace::ScopedStage st(tracer(), trace::kDecompress);
+      compression::decompress(static_cast<compression::Codec>(inner.compression()),
+                              plain.data(), plain.size(), inflated);
+      plain.swap(inflated);
+    }
     plaintextOut.assign(plain.begin(), plain.end());
     return true;
   } catch (const std::exception& ex) {
@@ -144,65 +461,345 @@ bool ConnectionEngine::parseAndDecryptMessage(const std::vector<uint8_t>& frame,
   }
 }
 
-bool ConnectionEngine::clientHandshakeInternal(const SendFrameFn& send,
-                                               const RecvFrameFn& recv,
-                                               std::string& peerFingerprintOut,
-                                               std::string& errorOut) {
-  if (!identity_.is_loaded()) {
-    errorOut = "Identity not loaded";
+bool ConnectionEngine::decryptMultiRecipient(const MultiRecipientPayload& multi,
+                                             std::string& plaintextOut,
+                                             std::string& errorOut) const {
+  const WrappedKey* mine = nullptr;
+  for (const auto& wk : multi.keys()) {
+    if (wk.key_id() == recvKeyId_) { mine = &wk; break; }
+  }
+  if (!mine) {
+    errorOut = "Message is not addressed to this session";
+    return false;
+  }
+  if (multi.nonce().size() != AESGCMCrypto::NONCE_SIZE ||
+      mine->sealed().size() != AESGCMCrypto::KEY_SIZE + AESGCMCrypto::TAG_SIZE ||
+      multi.ciphertext().size() < AESGCMCrypto::TAG_SIZE) {
+    errorOut = "Malformed multi-recipient payload";
+    return false;
+  }
+  if (!session_.check_sequence(mine->counter())) {
+    errorOut = "Message replayed or too old";
+    return false;
+  }
+  if (multi.compression() != compression::kNone &&
+      !compression::inMask(compression::supportedMask(), multi.compression())) {
+    errorOut = "Unsupported compression codec";
     return false;
   }
+  uint8_t keyNonce[AESGCMCrypto::NONCE_SIZE];
+  wire::compactNonce(initiator_ ? protocol::kDirectionServerToClient : protocol::kDirectionClientToServer,
+                     mine->counter(), keyNonce);
+  std::vector<uint8_t> contentKey(AESGCMCrypto::KEY_SIZE);
   try {
-    KyberKEM kem;
-    kem.init();
-    std::vector<uint8_t> pk, sk;
-    kem.keypair(pk, sk);
+    const std::vector<uint8_t> aad = wrappedKeyAad(multi, recvKeyId_);
+    session_.decrypt_into(reinterpret_cast<const uint8_t*>(mine->sealed().data()), mine->sealed().size(),
+                          keyNonce, aad.data(), aad.size(), contentKey.data());
+    const AESGCMCrypto content(contentKey);
+    OPENSSL_cleanse(contentKey.data(), contentKey.size());
+    const auto& ct = multi.ciphertext();
+    std::vector<uint8_t> plain(ct.size() - AESGCMCrypto::TAG_SIZE);
+    trace::timed(tracer(), trace::kDecrypt, [&]{
+      content.decrypt_into(reinterpret_cast<const uint8_t*>(ct.data()), ct.size(),
+                           reinterpret_cast<const uint8_t*>(multi.nonce().data()), nullptr, 0, plain.data());
+    });
+    if (!session_.accept_sequence(mine->counter())) {
+      errorOut = "Message replayed or too old";
+      return false;
+    }
+    if (multi.compression() != compression::kNone) {
+      std::vector<uint8_t> inflated;
+      trace::ScopedStage st(tracer(), trace::kDecompress);
+      compression::decompress(static_cast<compression::Codec>(multi.compression()),
+                              plain.data(), plain.size(), inflated);
+      plain.swap(inflated);
+    }
+    plaintextOut.assign(plain.begin(), plain.end());
+    return true;
+  } catch (const std::exception& ex) {
+    OPENSSL_cleanse(contentKey.data(), contentKey.size());
+    errorOut = ex.what();
+    return false;
+  }
+}
+
+bool ConnectionEngine::appendCompactRecord(const std::string& plaintext,
+                                           uint8_t flags,
+                                           std::vector<uint8_t>& out,
+                                           std::string& errorOut) const {
+  if (plaintext.size() > UINT32_MAX - aead::kTagSize) {
+    errorOut = "Message too large";
+    return false;
+  }
+  thread_local std::vector<uint8_t> packed;
+  const uint8_t* body = reinterpret_cast<const uint8_t*>(plaintext.data());
+  size_t body_len = plaintext.size();
+  wire::CompactHeader h;
+  h.version = protocol::kVersionCompact;
+  h.flags = flags;
+  try {
+    if (maybeCompress(plaintext, packed)) {
+      h.flags |= wire::kFlagCompressed;
+      body = packed.data();
+      body_len = packed.size();
+    }
+  } catch (const std::exception& ex) {
+    errorOut = ex.what();
+    return false;
+  }
+  h.length = static_cast<uint32_t>(body_len + aead::kTagSize);
+  Session::SendKey key;
+  try {
+    key = session_.next_send_key();
+    h.counter = key.index;
+    if (key.phase) h.flags |= wire::kFlagKeyPhase;
+  } catch (const std::exception& ex) {
+    errorOut = ex.what();
+    return false;
+  }
 
-    auto sig_msg = concat("E2EE-HANDSHAKE-v1|client|", pk);
-    auto sig = IdentityStore::sign(identity_.priv, sig_msg);
+  const size_t at = out.size();
+  uint8_t* rec = nullptr;
+  {
+    trace::ScopedStage st(tracer(), trace::kSerialize);
+    out.resize(at + wire::kCompactHeaderSize + h.length);
+    rec = out.data() + at;
+    wire::encodeCompactHeader(h, rec);
+  }
+  try {
+    trace::ScopedStage st(tracer(), trace::kEncrypt);
+    session_.seal_record(key, initiator_ ? protocol::kDirectionClientToServer
+                                         : protocol::kDirectionServerToClient,
+                         body, body_len, rec, wire::kCompactHeaderSize, rec + wire::kCompactHeaderSize);
+    return true;
+  } catch (const std::exception& ex) {
+    OPENSSL_cleanse(key.key.data(), key.key.size());
+    out.resize(at);
+    errorOut = ex.what();
+    return false;
+  }
+}
 
-    HandshakeHello hello;
-    hello.set_version(protocol::kVersion);
-    hello.set_kem_public_key(std::string(reinterpret_cast<const char*>(pk.data()), pk.size()));
-    hello.set_identity_pub(std::string(reinterpret_cast<const char*>(identity_.pub.data()), identity_.pub.size()));
-    hello.set_identity_sig(std::string(reinterpret_cast<const char*>(sig.data()), sig.size()));
-
-    std::string hello_bytes;
-    if (!hello.SerializeToString(&hello_bytes)) {
-      errorOut = "Failed to serialize HandshakeHello";
+bool ConnectionEngine::decryptCompactFrame(const std::vector<uint8_t>& frame,
+                                           bool control,
+                                           std::vector<std::string>& plaintextsOut,
+                                           std::string& errorOut) const {
+  const uint32_t direction = initiator_ ? protocol::kDirectionServerToClient
+                                        : protocol::kDirectionClientToServer;
+  size_t pos = 0;
+  while (pos < frame.size()) {
+    if (plaintextsOut.size() == protocol::kMaxBundleMessages) {
+      errorOut = "Bundle too large";
+      plaintextsOut.clear();
       return false;
     }
-    if (!send(std::vector<uint8_t>(hello_bytes.begin(), hello_bytes.end()))) {
-      errorOut = "Failed to send HandshakeHello";
+    wire::CompactHeader h;
+    const uint8_t* body = nullptr;
+    size_t consumed = 0;
+    if (!trace::timed(tracer(), trace::kParse, [&]{
+          return wire::decodeCompactRecord(frame.data() + pos, frame.size() - pos, h, body, consumed);
+        })) {
+      errorOut = "Malformed compact frame";
+      plaintextsOut.clear();
       return false;
     }
-
-    std::vector<uint8_t> resp_frame;
-    if (!recv(resp_frame)) {
-      errorOut = "Failed to receive HandshakeResponse";
+    if (((h.flags & wire::kFlagFileControl) != 0) != control) {
+      errorOut = control ? "Not a file-transfer control frame" : "Unexpected file-transfer control frame";
+      plaintextsOut.clear();
       return false;
     }
+    if ((h.flags & wire::kFlagCompressed) && codec_ == compression::kNone) {
+      errorOut = "Compressed message without a negotiated codec";
+      plaintextsOut.clear();
+      return false;
+    }
+    plaintextsOut.emplace_back(h.length - aead::kTagSize, '\0');
+    try {
+      trace::timed(tracer(), trace::kDecrypt, [&]{
+        session_.decrypt_record(h.counter, (h.flags & wire::kFlagKeyPhase) != 0, direction, body, h.length,
+                                frame.data() + pos, wire::kCompactHeaderSize,
+                                reinterpret_cast<uint8_t*>(&plaintextsOut.back()[0]));
+      });
+      if (h.flags & wire::kFlagCompressed) {
+        trace::ScopedStage st(tracer(), trace::kDecompress);
+        thread_local std::vector<uint8_t> inflated;
+        const auto& packed = plaintextsOut.back();
+        compression::decompress(codec_, reinterpret_cast<const uint8_t*>(packed.data()),
+                                packed.size(), inflated);
+        plaintextsOut.back().assign(inflated.begin(), inflated.end());
+      }
+    } catch (const std::exception& ex) {
+      errorOut = ex.what();
+      plaintextsOut.clear();
+      return false;
+    }
+    pos += consumed;
+  }
+  return true;
+}
 
+bool ConnectionEngine::maybeCompress(const std::string& plaintext, std::vector<uint8_t>& out) const {
+  if (codec_ == compression::kNone || plaintext.size() < compression::kMinCompressSize) return false;
+  trace::ScopedStage st(tracer(), trace::kCompress);
+  return compression::compress(codec_, reinterpret_cast<const uint8_t*>(plaintext.data()),
+                               plaintext.size(), out);
+}
+
+void ConnectionEngine::onHandshakeComplete(bool initiator, uint32_t peerVersion,
+                                           compression::Codec codec) {
+  initiator_ = initiator;
+  codec_ = codec;
+  wireVersion_ = std::max(protocol::kVersionProtobuf, std::min(peerVersion, protocol::kVersion));
+  sendCounter_ = 0;
+  // One id per direction, so a recipient only ever matches keys its peer sealed.
+  auto keyId = [&](uint32_t direction) {
+    auto info = protocol::key_id_hkdf_info();
+    for (int i = 3; i >= 0; --i) info.push_back(static_cast<uint8_t>(direction >> (8 * i)));
+    const auto id = hkdf_sha256(session_.key(), protocol::hkdf_salt(), info, protocol::kKeyIdSize);
+    return std::string(id.begin(), id.end());
+  };
+  session_.start_traffic(initiator ? protocol::kDirectionClientToServer : protocol::kDirectionServerToClient,
+                         initiator ? protocol::kDirectionServerToClient : protocol::kDirectionClientToServer);
+  sendKeyId_ = keyId(initiator ? protocol::kDirectionClientToServer : protocol::kDirectionServerToClient);
+  recvKeyId_ = keyId(initiator ? protocol::kDirectionServerToClient : protocol::kDirectionClientToServer);
+  sessionReady_ = true;
+}
+
+bool ConnectionEngine::clientHandshakeInternal(const SendFrameFn& send,
+                                               const RecvFrameFn& recv,
+                                               std::string& peerFingerprintOut,
+                                               std::string& errorOut) {
+  if (!identity_.is_loaded()) {
+    errorOut = "Identity not loaded";
+    return false;
+  }
+  try {
+    // One hello, plus one more if the host asks for another KEM (hello retry).
+    // Offering Kyber-512 alone sends the hello hosts without negotiation expect.
+    const uint32_t offer = localKems_ == (1u << kem::kKyber512) ? 0 : localKems_;
+    kem::Alg alg = kem::preferred(localKems_);
+    KyberKEM kem;
+    std::vector<uint8_t> pk, sk, x_pub, x_priv;
+    HandshakeHello hello;
     HandshakeResponse resp;
-    if (!resp.ParseFromArray(resp_frame.data(), static_cast<int>(resp_frame.size()))) {
-      errorOut = "Failed to parse HandshakeResponse";
-      return false;
+    for (int attempt = 0;; ++attempt) {
+      // Hybrid: an X25519 keypair next to the KEM's. It takes microseconds, so it
+      // runs inline; a thread per handshake would cost more than it overlaps.
+      trace::timed(tracer(), trace::kKeygen, [&]{
+        kem.init(alg);
+        kem.keypair(pk, sk);
+        if (localHybrid_) x25519::keypair(x_pub, x_priv);
+      });
+
+      hello.Clear();
+      hello.set_version(protocol::kVersion);
+      hello.set_kem_public_key(std::string(reinterpret_cast<const char*>(pk.data()), pk.size()));
+      hello.set_identity_pub(std::string(reinterpret_cast<const char*>(identity_.pub.data()), identity_.pub.size()));
+      hello.set_compression_codecs(localCodecs_);
+      hello.set_aead_suites(localSuites_);
+      hello.set_aead_preferred(aead::preferred());
+      hello.set_kem_algs(offer);
+      hello.set_kem_alg(alg);
+      hello.set_x25519_public_key(std::string(reinterpret_cast<const char*>(x_pub.data()), x_pub.size()));
+
+      // The legacy hello signs v1, which is all a host without negotiation checks.
+      auto sig_msg = transcript("client", offer ? offerParams(hello) : std::vector<uint32_t>{}, cat(pk, x_pub));
+      auto sig = trace::timed(tracer(), trace::kSign, [&]{ return IdentityStore::sign(identity_.priv, sig_msg); });
+      hello.set_identity_sig(std::string(reinterpret_cast<const char*>(sig.data()), sig.size()));
+
+      // A host under load may answer with a cookie challenge instead; the same
+      // hello goes again with the cookie and a puzzle solution, once.
+      for (bool challenged = false;;) {
+        std::string hello_bytes;
+        if (!trace::timed(tracer(), trace::kSerialize, [&]{ return hello.SerializeToString(&hello_bytes); })) {
+          errorOut = "Failed to serialize HandshakeHello";
+          return false;
+        }
+        if (!trace::timed(tracer(), trace::kSend, [&]{
+              return send(std::vector<uint8_t>(hello_bytes.begin(), hello_bytes.end()));
+            })) {
+          errorOut = "Failed to send HandshakeHello";
+          return false;
+        }
+
+        std::vector<uint8_t> resp_frame;
+        if (!trace::timed(tracer(), trace::kRecv, [&]{ return recv(resp_frame); })) {
+          errorOut = "Failed to receive HandshakeResponse";
+          return false;
+        }
+
+        if (!trace::timed(tracer(), trace::kParse, [&]{
+              return resp.ParseFromArray(resp_frame.data(), static_cast<int>(resp_frame.size()));
+            })) {
+          errorOut = "Failed to parse HandshakeResponse";
+          return false;
+        }
+        if (resp.cookie().empty()) break;
+        if (challenged) {
+          errorOut = "Host repeated its cookie challenge";
+          return false;
+        }
+        challenged = true;
+        hello.set_cookie(resp.cookie());
+        hello.set_puzzle_solution(HandshakeGuard::solve(resp.cookie(), resp.puzzle_bits()));
+      }
+      if (!resp.retry_kem_alg()) break;
+      // The retry is unsigned; the host's final signature covers our full offer,
+      // so a forged one can only make the handshake fail, not pick a weaker set.
+      if (attempt > 0 || resp.retry_kem_alg() == alg || !kem::inMask(localKems_, resp.retry_kem_alg())) {
+        errorOut = "Peer asked for an unsupported key exchange";
+        return false;
+      }
+      alg = static_cast<kem::Alg>(resp.retry_kem_alg());
     }
 
     std::vector<uint8_t> server_pub(resp.identity_pub().begin(), resp.identity_pub().end());
     std::vector<uint8_t> server_sig(resp.identity_sig().begin(), resp.identity_sig().end());
     std::vector<uint8_t> ct(resp.kem_ciphertext().begin(), resp.kem_ciphertext().end());
-
-    auto server_sig_msg = concat("E2EE-HANDSHAKE-v1|server|", ct, pk);
-    if (!IdentityStore::verify(server_pub, server_sig_msg, server_sig)) {
+    std::vector<uint8_t> server_x_pub(resp.x25519_public_key().begin(), resp.x25519_public_key().end());
+
+    // A host that negotiates always answers with a suite and signs v2; one
+    // that predates negotiation sends none. Stripping the suite to pass as the
+    // latter breaks the host's v2 signature.
+    const bool negotiated = offer || resp.aead_suite();
+    auto server_sig_msg = transcript("server", negotiated ? choiceParams(hello, resp) : std::vector<uint32_t>{},
+                                     cat(ct, server_x_pub), cat(pk, x_pub));
+    if (!trace::timed(tracer(), trace::kVerify, [&]{
+          return IdentityStore::verify(server_pub, server_sig_msg, server_sig);
+        })) {
       errorOut = "Server signature verification failed";
       return false;
     }
 
-    std::vector<uint8_t> ss;
-    kem.decapsulate(ct, sk, ss);
-    session_.set_key(hkdf_sha256(ss, protocol::hkdf_salt(), protocol::hkdf_info(), 32));
-    sessionReady_ = true;
+    // An older host sends no suite and means AES-256-GCM; anything else must be one we offered.
+    const auto suite = resp.aead_suite() ? static_cast<aead::Suite>(resp.aead_suite()) : aead::kAes256Gcm;
+    if (resp.aead_suite() && !aead::inMask(localSuites_, suite)) {
+      errorOut = "Peer chose an unsupported cipher suite";
+      return false;
+    }
+
+    // A host that declined hybrid mode answers without a key (and signed that).
+    const bool hybrid = !server_x_pub.empty();
+    if (hybrid && !localHybrid_) {
+      errorOut = "Peer answered with an unrequested X25519 key";
+      return false;
+    }
+
+    std::vector<uint8_t> ss, x_ss;
+    trace::timed(tracer(), trace::kDecaps, [&]{
+      kem.decapsulate(ct, sk, ss);
+      if (hybrid) x_ss = x25519::derive(x_priv, server_x_pub);
+    });
+    session_.set_key(trace::timed(tracer(), trace::kHkdf, [&]{
+      return hkdf_sha256(hybridSecret(ss, x_ss), protocol::hkdf_salt(), protocol::hkdf_info(), 32);
+    }), suite);
+    kemAlg_ = alg;
+    hybrid_ = hybrid;
+    OPENSSL_cleanse(x_priv.data(), x_priv.size());
+    // Only accept a codec we offered; anything else means no compression.
+    auto codec = static_cast<compression::Codec>(resp.compression_codec());
+    if (!compression::inMask(localCodecs_, codec)) codec = compression::kNone;
+    onHandshakeComplete(true, resp.version(), codec);
 
     peerFingerprintOut = IdentityStore::fingerprint_hex(server_pub);
     return true;
@@ -221,53 +818,144 @@ bool ConnectionEngine::serverHandshakeInternal(const SendFrameFn& send,
     return false;
   }
   try {
-    std::vector<uint8_t> frame;
-    if (!recv(frame)) {
-      errorOut = "Failed to receive HandshakeHello";
-      return false;
-    }
+    // The KEM is settled before any signature work: a hello carrying a key for
+    // another set than ours gets one retry request. Then, with a guard set, a
+    // hello over its budget gets one cookie challenge, and a hello bringing a
+    // cookie is checked with a MAC and a hash before any public-key work.
     HandshakeHello hello;
-    if (!hello.ParseFromArray(frame.data(), static_cast<int>(frame.size()))) {
-      errorOut = "Failed to parse HandshakeHello";
-      return false;
+    uint32_t alg = 0;
+    bool retried = false, challenged = false;
+    for (;;) {
+      std::vector<uint8_t> frame;
+      if (!trace::timed(tracer(), trace::kRecv, [&]{ return recv(frame); })) {
+        errorOut = "Failed to receive HandshakeHello";
+        return false;
+      }
+      if (!trace::timed(tracer(), trace::kParse, [&]{
+            return hello.ParseFromArray(frame.data(), static_cast<int>(frame.size()));
+          })) {
+        errorOut = "Failed to parse HandshakeHello";
+        return false;
+      }
+      alg = kem::pick(localKems_, hello.kem_algs());
+      if (!alg) {
+        errorOut = "No common key exchange";
+        return false;
+      }
+      HandshakeResponse challenge;
+      challenge.set_version(std::max(protocol::kVersionProtobuf, std::min(hello.version(), protocol::kVersion)));
+      const uint32_t offered = hello.kem_algs() ? hello.kem_alg() : kem::kKyber512;
+      if (offered != alg) {
+        if (retried) {
+          errorOut = "Client ignored the hello retry";
+          return false;
+        }
+        retried = true;
+        challenge.set_retry_kem_alg(alg);
+      } else {
+        if (!guard_) break;
+        std::string cookie;
+        uint32_t bits = 0;
+        const auto binding = HandshakeGuard::binding(
+            {hello.kem_public_key(), hello.identity_pub(), hello.x25519_public_key()});
+        const auto verdict = guard_->check(binding, hello.cookie(), hello.puzzle_solution(), cookie, bits);
+        if (verdict == HandshakeGuard::kAdmit) break;
+        if (verdict == HandshakeGuard::kReject) {
+          errorOut = "Invalid handshake cookie";
+          return false;
+        }
+        if (challenged) {
+          errorOut = "Client ignored the cookie challenge";
+          return false;
+        }
+        challenged = true;
+        challenge.set_cookie(cookie);
+        challenge.set_puzzle_bits(bits);
+      }
+      const std::string challenge_bytes = challenge.SerializeAsString();
+      if (!trace::timed(tracer(), trace::kSend, [&]{
+            return send(std::vector<uint8_t>(challenge_bytes.begin(), challenge_bytes.end()));
+          })) {
+        errorOut = "Failed to send hello challenge";
+        return false;
+      }
     }
 
     std::vector<uint8_t> client_pk(hello.kem_public_key().begin(), hello.kem_public_key().end());
     std::vector<uint8_t> client_pub(hello.identity_pub().begin(), hello.identity_pub().end());
     std::vector<uint8_t> client_sig(hello.identity_sig().begin(), hello.identity_sig().end());
+    std::vector<uint8_t> client_x_pub(hello.x25519_public_key().begin(), hello.x25519_public_key().end());
+    if (!client_x_pub.empty() && client_x_pub.size() != x25519::kKeySize) {
+      errorOut = "Malformed X25519 key";
+      return false;
+    }
+    const bool hybrid = localHybrid_ && !client_x_pub.empty();
 
-    auto client_sig_msg = concat("E2EE-HANDSHAKE-v1|client|", client_pk);
-    if (!IdentityStore::verify(client_pub, client_sig_msg, client_sig)) {
+    auto client_sig_msg = transcript("client", hello.kem_algs() ? offerParams(hello) : std::vector<uint32_t>{},
+                                     cat(client_pk, client_x_pub));
+    if (!trace::timed(tracer(), trace::kVerify, [&]{
+          return IdentityStore::verify(client_pub, client_sig_msg, client_sig);
+        })) {
       errorOut = "Client signature verification failed";
       return false;
     }
 
+    // Hybrid: X25519 keygen and derive right after the KEM encapsulates.
     KyberKEM kem;
-    kem.init();
-    std::vector<uint8_t> ct, ss;
-    kem.encapsulate(client_pk, ct, ss);
-
-    auto server_sig_msg = concat("E2EE-HANDSHAKE-v1|server|", ct, client_pk);
-    auto sig = IdentityStore::sign(identity_.priv, server_sig_msg);
-
+    std::vector<uint8_t> ct, ss, x_pub, x_ss;
+    trace::timed(tracer(), trace::kEncaps, [&]{
+      kem.init(static_cast<kem::Alg>(alg));
+      kem.encapsulate(client_pk, ct, ss);
+      if (hybrid) {
+        std::vector<uint8_t> x_priv;
+        x25519::keypair(x_pub, x_priv);
+        x_ss = x25519::derive(x_priv, client_x_pub);
+        OPENSSL_cleanse(x_priv.data(), x_priv.size());
+      }
+    });
+
+    // Answer with the highest version both sides speak; the client adopts it.
+    const uint32_t version = std::max(protocol::kVersionProtobuf,
+                                      std::min(hello.version(), protocol::kVersion));
+    const compression::Codec codec = compression::pick(localCodecs_, hello.compression_codecs());
     HandshakeResponse resp;
-    resp.set_version(protocol::kVersion);
+    resp.set_version(version);
+    resp.set_compression_codec(codec);
+    const aead::Suite suite = aead::pick(localSuites_, aead::preferred(), hello.aead_suites(),
+                                         static_cast<aead::Suite>(hello.aead_preferred()));
+    resp.set_aead_suite(suite);
     resp.set_kem_ciphertext(std::string(reinterpret_cast<const char*>(ct.data()), ct.size()));
+    resp.set_x25519_public_key(std::string(reinterpret_cast<const char*>(x_pub.data()), x_pub.size()));
     resp.set_identity_pub(std::string(reinterpret_cast<const char*>(identity_.pub.data()), identity_.pub.size()));
+
+    // A client that lists suites checks the v2 signature even when its hello
+    // is the legacy one; only clients that predate negotiation get v1.
+    const bool negotiated = hello.kem_algs() || hello.aead_suites();
+    auto server_sig_msg = transcript("server", negotiated ? choiceParams(hello, resp) : std::vector<uint32_t>{},
+                                     cat(ct, x_pub), cat(client_pk, client_x_pub));
+    auto sig = trace::timed(tracer(), trace::kSign, [&]{
+      return IdentityStore::sign(identity_.priv, server_sig_msg);
+    });
     resp.set_identity_sig(std::string(reinterpret_cast<const char*>(sig.data()), sig.size()));
 
     std::string resp_bytes;
-    if (!resp.SerializeToString(&resp_bytes)) {
+    if (!trace::timed(tracer(), trace::kSerialize, [&]{ return resp.SerializeToString(&resp_bytes); })) {
       errorOut = "Failed to serialize HandshakeResponse";
       return false;
     }
-    if (!send(std::vector<uint8_t>(resp_bytes.begin(), resp_bytes.end()))) {
+    if (!trace::timed(tracer(), trace::kSend, [&]{
+          return send(std::vector<uint8_t>(resp_bytes.begin(), resp_bytes.end()));
+        })) {
       errorOut = "Failed to send HandshakeResponse";
       return false;
     }
 
-    session_.set_key(hkdf_sha256(ss, protocol::hkdf_salt(), protocol::hkdf_info(), 32));
-    sessionReady_ = true;
+    session_.set_key(trace::timed(tracer(), trace::kHkdf, [&]{
+      return hkdf_sha256(hybridSecret(ss, x_ss), protocol::hkdf_salt(), protocol::hkdf_info(), 32);
+    }), suite);
+    kemAlg_ = static_cast<kem::Alg>(alg);
+    hybrid_ = hybrid;
+    onHandshakeComplete(false, version, codec);
 
     peerFingerprintOut = IdentityStore::fingerprint_hex(client_pub);
     return true;
@@ -1,12 +1,22 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <string>
 #include <vector>
 
+#include "aead.h"
+#include "compression.h"
 #include "identity.h"
+#include "kem_kyber.h"
+#include "protocol.h"
 #include "session.h"
 
+namespace trace { class EngineTrace; }
+class HandshakeGuard;
+class MultiRecipientPayload;
+
 class ConnectionEngine {
 public:
   using SendFrameFn = std::function<bool(const std::vector<uint8_t>&)>;
@@ -22,6 +32,9 @@ public:
                             bool* created = nullptr);
 
   const Identity& identity() const { return identity_; }
+  // Uses an identity that is already unlocked, so many engines (benchmarks, a
+  // host serving many sessions) don't each pay the PBKDF2 unlock.
+  void setIdentity(const Identity& identity) { identity_ = identity; }
 
   // Client role: send HandshakeHello, receive HandshakeResponse.
   bool runClientHandshake(const SendFrameFn& send,
@@ -38,6 +51,60 @@ public:
   bool hasSession() const { return sessionReady_; }
   const Session& session() const { return session_; }
 
+  // Wire version negotiated by the last handshake (protocol::kVersionProtobuf or
+  // kVersionCompact). Outgoing messages use it; incoming frames of either kind are accepted.
+  uint32_t wireVersion() const { return wireVersion_; }
+  // Overrides the negotiated version (tests and benchmarks compare both paths).
+  void setWireVersion(uint32_t version) { wireVersion_ = version; }
+
+  // Codecs offered in the next handshake (compression::supportedMask() by default, 0 disables).
+  void setCompressionCodecs(uint32_t mask) { localCodecs_ = mask & compression::supportedMask(); }
+  // Codec negotiated by the last handshake; messages of at least
+  // compression::kMinCompressSize bytes are compressed with it before encryption.
+  compression::Codec compressionCodec() const { return codec_; }
+  void setCompressionCodec(compression::Codec codec) { codec_ = codec; }
+
+  // AEAD suites offered in the next handshake (aead::supportedMask() by default).
+  // The host picks ChaCha20-Poly1305 unless both CPUs have AES instructions.
+  void setAeadSuites(uint32_t mask) { localSuites_ = mask & aead::supportedMask(); }
+  // Suite negotiated by the last handshake; session traffic is sealed with it.
+  aead::Suite aeadSuite() const { return session_.suite(); }
+
+  // KEM parameter sets offered (client) or accepted (host) in the next
+  // handshake; kem::supportedMask() by default, and 0 restores it. The client
+  // sends a key for kem::preferred(mask); a host that picks another set costs
+  // one hello retry.
+  void setKemAlgorithms(uint32_t mask) {
+    localKems_ = (mask & kem::supportedMask()) ? mask & kem::supportedMask() : kem::supportedMask();
+  }
+  // Set used by the last handshake.
+  kem::Alg kemAlgorithm() const { return kemAlg_; }
+
+  // Hybrid key exchange (on by default): an X25519 exchange runs next to the
+  // KEM, and both secrets feed the session key, so breaking either one alone
+  // is not enough. A host with it off, or a client that sent no X25519 key,
+  // gives a KEM-only session.
+  void setHybrid(bool enabled) { localHybrid_ = enabled; }
+  // Whether the last handshake was hybrid.
+  bool hybrid() const { return hybrid_; }
+
+  // Host side: flood protection shared by all of a host's engines (see
+  // handshake_guard.h). Not owned; it must outlive the handshake. Clients
+  // answer a host's cookie challenge whether or not this is set.
+  void setHandshakeGuard(HandshakeGuard* guard) { guard_ = guard; }
+
+  // When this side updates its compact-path send key (Session::start_traffic):
+  // after maxRecords records or maxAge, whichever comes first; 0 restores the default.
+  void setKeyUpdatePolicy(uint64_t maxRecords, std::chrono::seconds maxAge) {
+    session_.set_key_update_policy(maxRecords, maxAge);
+  }
+
+  // Opt-in per-stage timing (engine_trace.h) for handshakes and messages. The trace
+  // must outlive the engine or be cleared with setTrace(nullptr); while unset each
+  // stage costs a null check.
+  void setTrace(trace::EngineTrace* t) { trace_.store(t, std::memory_order_relaxed); }
+  trace::EngineTrace* tracer() const { return trace_.load(std::memory_order_relaxed); }
+
   // Encrypts plaintext and produces a serialized Envelope ready for transport.
   bool encryptAndSerializeMessage(const std::string& plaintext,
                                   const std::string& senderId,
@@ -45,12 +112,76 @@ public:
                                   std::vector<uint8_t>& outBytes,
                                   std::string& errorOut) const;
 
+  // Encrypts a burst of plaintexts into one Envelope bundle (one relay frame).
+  bool encryptAndSerializeBundle(const std::vector<std::string>& plaintexts,
+                                 const std::string& senderId,
+                                 const std::string& toUsername,
+                                 std::vector<uint8_t>& outBytes,
+                                 std::string& errorOut) const;
+
+  // Encrypts plaintext once under a fresh content key and seals only that key
+  // for each session, so N recipients cost one bulk encryption plus N tiny
+  // ones. The frame is the same for every recipient: each finds its key by
+  // session key id, so it can go once into a shared room or to each peer.
+  // Compresses only if every session negotiated the same codec.
+  static bool encryptForRecipients(const std::vector<const ConnectionEngine*>& sessions,
+                                   const std::string& plaintext,
+                                   const std::string& senderId,
+                                   std::vector<uint8_t>& outBytes,
+                                   std::string& errorOut);
+  // AAD sealing the content key for the session with keyId:
+  //   key_id || nonce || SHA-256(ciphertext) || compression || sender_id
+  // Binding the ciphertext means a recipient, who can unwrap the content key,
+  // still cannot swap in other content that the rest will accept.
+  static std::vector<uint8_t> wrappedKeyAad(const MultiRecipientPayload& multi, const std::string& keyId);
+
   // Parses an incoming frame and decrypts the inner ChatMessage, returning plaintext.
+  // Fails on bundles with more than one message; use parseAndDecryptMessages for those.
   bool parseAndDecryptMessage(const std::vector<uint8_t>& frame,
                               std::string& plaintextOut,
                               std::string& errorOut) const;
 
+  // Parses a single-message or bundled frame, returning every plaintext in send order.
+  bool parseAndDecryptMessages(const std::vector<uint8_t>& frame,
+                               std::vector<std::string>& plaintextsOut,
+                               std::string& errorOut) const;
+
+  // Frames on a session are chat messages, file-transfer control records or file
+  // chunks (see file_transfer.h). Receive loops use this to route each frame.
+  enum class FrameKind { Message, FileControl, FileChunk };
+  static FrameKind frameKind(const std::vector<uint8_t>& frame);
+
+  // Encrypts/decrypts a file-transfer control body as a compact record flagged
+  // wire::kFlagFileControl. Requires protocol v2 on both sides.
+  bool encryptAndSerializeControl(const std::string& body,
+                                  std::vector<uint8_t>& outBytes,
+                                  std::string& errorOut) const;
+  bool parseAndDecryptControl(const std::vector<uint8_t>& frame,
+                              std::string& bodyOut,
+                              std::string& errorOut) const;
+
 private:
+  bool encryptChatMessage(const std::string& plaintext,
+                          const std::string& senderId,
+                          std::string& innerBytesOut,
+                          std::string& errorOut) const;
+  bool decryptChatMessage(const std::string& innerBytes,
+                          std::string& plaintextOut,
+                          std::string& errorOut) const;
+  bool decryptMultiRecipient(const MultiRecipientPayload& multi,
+                             std::string& plaintextOut,
+                             std::string& errorOut) const;
+  bool appendCompactRecord(const std::string& plaintext,
+                           uint8_t flags,
+                           std::vector<uint8_t>& out,
+                           std::string& errorOut) const;
+  bool decryptCompactFrame(const std::vector<uint8_t>& frame,
+                           bool control,
+                           std::vector<std::string>& plaintextsOut,
+                           std::string& errorOut) const;
+  void onHandshakeComplete(bool initiator, uint32_t peerVersion, compression::Codec codec);
+  bool maybeCompress(const std::string& plaintext, std::vector<uint8_t>& out) const;
+
   bool clientHandshakeInternal(const SendFrameFn& send,
                                const RecvFrameFn& recv,
                                std::string& peerFingerprintOut,
@@ -63,4 +194,20 @@ private:
   Identity identity_;
   Session session_;
   bool sessionReady_ = false;
+  bool initiator_ = false;
+  uint32_t wireVersion_ = protocol::kVersionProtobuf;
+  uint32_t localCodecs_ = compression::supportedMask();
+  compression::Codec codec_ = compression::kNone;
+  uint32_t localSuites_ = aead::supportedMask();
+  uint32_t localKems_ = kem::supportedMask();
+  kem::Alg kemAlg_ = kem::kKyber512;
+  bool localHybrid_ = true;
+  bool hybrid_ = false;
+  HandshakeGuard* guard_ = nullptr;
+  std::string sendKeyId_;  // protocol::kKeyIdSize bytes per direction, set with the session key
+  std::string recvKeyId_;
+  // Sequence numbers for records under the session key itself (ChatMessages and
+  // keys sealed by encryptForRecipients); the peer's Session replay window checks them.
+  mutable std::atomic<uint64_t> sendCounter_{0};
+  std::atomic<trace::EngineTrace*> trace_{nullptr};  // may be toggled while receiving
 };
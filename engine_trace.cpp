@@ -0,0 +1,92 @@
+#include "engine_trace.h"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace trace {
+
+const char* stageName(Stage stage) {
+  static const char* const kNames[kStageCount] = {
+    "keygen", "sign", "send", "recv", "verify", "encaps", "decaps", "hkdf",
+    "compress", "encrypt", "serialize", "parse", "decrypt", "decompress",
+  };
+  return stage < kStageCount ? kNames[stage] : "?";
+}
+
+// Values below 2^(kSubBits+1) get a bucket each; above that, bucket = exponent
+// * 16 + the top kSubBits+1 bits of the value.
+size_t LatencyHistogram::bucketFor(uint64_t ns) {
+  constexpr uint64_t kLinear = uint64_t(2) << kSubBits;
+  constexpr uint64_t kClamp = (uint64_t(1) << kMaxBits) - 1;
+  if (ns > kClamp) ns = kClamp;
+  if (ns < kLinear) return static_cast<size_t>(ns);
+  int msb = 63;
+  while (!(ns >> msb)) --msb;
+  const int shift = msb - kSubBits;
+  return (size_t(shift) << kSubBits) + static_cast<size_t>(ns >> shift);
+}
+
+uint64_t LatencyHistogram::bucketUpper(size_t index) {
+  constexpr size_t kSub = size_t(1) << kSubBits;
+  if (index < 2 * kSub) return index;
+  const int shift = static_cast<int>(index >> kSubBits) - 1;
+  const uint64_t mantissa = (index & (kSub - 1)) + kSub;
+  return ((mantissa + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+  buckets_[bucketFor(ns)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(ns, std::memory_order_relaxed);
+  uint64_t prev = max_.load(std::memory_order_relaxed);
+  while (ns > prev && !max_.compare_exchange_weak(prev, ns, std::memory_order_relaxed)) {
+  }
+}
+
+void LatencyHistogram::reset() {
+  for (auto& b : buckets_) b.store(0, std::memory_order_relaxed);
+  count_.store(0, std::memory_order_relaxed);
+  sum_.store(0, std::memory_order_relaxed);
+  max_.store(0, std::memory_order_relaxed);
+}
+
+double LatencyHistogram::mean() const {
+  const uint64_t n = count();
+  return n ? static_cast<double>(sum_.load(std::memory_order_relaxed)) / n : 0.0;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const {
+  const uint64_t n = count();
+  if (n == 0) return 0;
+  const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(p / 100.0 * n + 0.5));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kBucketCount; ++i) {
+    seen += buckets_[i].load(std::memory_order_relaxed);
+    if (seen >= rank) return std::min(bucketUpper(i), max());
+  }
+  return max();
+}
+
+void EngineTrace::reset() {
+  for (auto& s : stages_) s.reset();
+}
+
+std::string EngineTrace::dump() const {
+  std::string out;
+  char line[160];
+  std::snprintf(line, sizeof(line), "%-11s %9s %10s %10s %10s %10s %10s\n",
+                "stage", "count", "p50(us)", "p90(us)", "p99(us)", "max(us)", "mean(us)");
+  out += line;
+  for (size_t i = 0; i < kStageCount; ++i) {
+    const auto& h = stages_[i];
+    if (h.count() == 0) continue;
+    std::snprintf(line, sizeof(line), "%-11s %9llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                  stageName(static_cast<Stage>(i)), static_cast<unsigned long long>(h.count()),
+                  h.percentile(50) / 1e3, h.percentile(90) / 1e3, h.percentile(99) / 1e3,
+                  h.max() / 1e3, h.mean() / 1e3);
+    out += line;
+  }
+  return out;
+}
+
+}  // namespace trace
@@ -0,0 +1,104 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Opt-in latency tracing for ConnectionEngine (see ConnectionEngine::setTrace).
+//
+// Each stage of the handshake and message paths records its duration into a
+// log-linear histogram (HDR-style: 16 sub-buckets per power of two, so any
+// reported percentile is within ~6% of the true value). Recording is a few
+// relaxed atomic adds, so the send and receive threads can share one trace.
+namespace trace {
+
+enum Stage : size_t {
+  // handshake
+  kKeygen,
+  kSign,
+  kSend,
+  kRecv,
+  kVerify,
+  kEncaps,
+  kDecaps,
+  kHkdf,
+  // messages
+  kCompress,
+  kEncrypt,
+  kSerialize,
+  kParse,
+  kDecrypt,
+  kDecompress,
+  kStageCount
+};
+
+const char* stageName(Stage stage);
+
+class LatencyHistogram {
+public:
+  static constexpr int kSubBits = 4;
+  static constexpr int kMaxBits = 36;  // values clamp at 2^36 ns (~68 s)
+  static constexpr size_t kBucketCount = size_t(kMaxBits - kSubBits + 1) << kSubBits;
+
+  void record(uint64_t ns);
+  void reset();
+
+  uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+  uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+  double mean() const;
+  // Upper bound of the bucket holding the p-th percentile (0 < p <= 100), in ns.
+  uint64_t percentile(double p) const;
+
+private:
+  static size_t bucketFor(uint64_t ns);
+  static uint64_t bucketUpper(size_t index);
+
+  std::atomic<uint64_t> buckets_[kBucketCount] = {};
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_{0};
+  std::atomic<uint64_t> max_{0};
+};
+
+class EngineTrace {
+public:
+  void record(Stage stage, uint64_t ns) { stages_[stage].record(ns); }
+  const LatencyHistogram& stage(Stage stage) const { return stages_[stage]; }
+  void reset();
+
+  // One line per stage that has samples: count, p50/p90/p99/max and mean in microseconds.
+  std::string dump() const;
+
+private:
+  LatencyHistogram stages_[kStageCount];
+};
+
+// Times its scope into trace; does nothing (not even read the clock) when trace is null.
+class ScopedStage {
+public:
+  ScopedStage(EngineTrace* trace, Stage stage) : trace_(trace), stage_(stage) {
+    if (trace_) start_ = std::chrono::steady_clock::now();
+  }
+  ~ScopedStage() {
+    if (trace_) {
+      trace_->record(stage_, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                 std::chrono::steady_clock::now() - start_).count()));
+    }
+  }
+  ScopedStage(const ScopedStage&) = delete;
+  ScopedStage& operator=(const ScopedStage&) = delete;
+
+private:
+  EngineTrace* trace_;
+  Stage stage_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Runs fn() as one timed stage and returns its result.
+template <typename Fn>
+auto timed(EngineTrace* trace, Stage stage, Fn&& fn) {
+  ScopedStage scope(trace, stage);
+  return fn();
+}
+
+}  // namespace trace
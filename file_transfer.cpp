@@ -0,0 +1,567 @@
+#include "file_transfer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "hkdf.h"
+#include "mapped_file.h"
+#include "messages.pb.h"
+#include "protocol.h"
+#include "wire_format.h"
+
+namespace fs = std::filesystem;
+
+struct FileTransfer::Outgoing {
+  bool accepted = false;
+  bool done = false;
+  bool cancelled = false;
+  uint32_t received = 0;      // chunks the peer has confirmed on disk this transfer
+  std::string have;           // ACCEPT bitmap: chunks the peer kept from an earlier attempt
+  std::string reason;
+};
+
+struct FileTransfer::Incoming {
+  fs::path partPath;
+  fs::path finalPath;
+  fs::path mapPath;
+  MappedFile dest;
+  aead::AeadCrypto key;
+  std::string token;
+  uint64_t size = 0;
+  uint32_t chunkSize = 0;
+  uint32_t chunkCount = 0;
+  std::vector<uint8_t> have;     // chunk bitmap; persisted once the chunks are synced
+  std::vector<uint32_t> unsynced;  // written since the last sync
+  uint32_t missing = 0;          // chunks not yet written
+  uint32_t received = 0;         // chunks received in this transfer (drives ACKs)
+
+  bool saveBitmap() const;
+  void removePartial() const;
+};
+
+namespace {
+// Chunks never exceed this, so a chunk frame always fits protocol::kMaxFrameSize.
+constexpr uint32_t kMaxChunkSize = 1024 * 1024;
+constexpr size_t kMaxPooledFrames = 8;
+constexpr size_t kResumeTokenSize = 16;
+constexpr char kMapMagic[8] = {'E', '2', 'E', 'P', 'A', 'R', 'T', '1'};
+
+uint64_t randomTransferId() {
+  uint64_t id = 0;
+  if (RAND_bytes(reinterpret_cast<unsigned char*>(&id), sizeof(id)) != 1)
+    throw std::runtime_error("RAND_bytes failed");
+  return id;
+}
+
+uint32_t chunkCountFor(uint64_t size, uint32_t chunkSize) {
+  // An empty file still sends one (empty) last chunk.
+  return size == 0 ? 1 : static_cast<uint32_t>((size + chunkSize - 1) / chunkSize);
+}
+
+bool testBit(const uint8_t* bits, uint32_t i) { return (bits[i / 8] >> (i % 8)) & 1; }
+
+std::string serialize(const FileControl& ctl) {
+  std::string out;
+  ctl.SerializeToString(&out);
+  return out;
+}
+
+FileControl control(FileControl::Type type, uint64_t transferId) {
+  FileControl ctl;
+  ctl.set_type(type);
+  ctl.set_transfer_id(transferId);
+  return ctl;
+}
+
+// Identifies the same source file across sessions: SHA-256 of its absolute path,
+// size and mtime, truncated. Any edit to the file changes the token.
+std::string resumeToken(const fs::path& path, uint64_t size) {
+  std::error_code ec;
+  const std::string abs = fs::absolute(path, ec).string();
+  const auto mtime = fs::last_write_time(path, ec).time_since_epoch().count();
+  std::string material = abs + '\0' + std::to_string(size) + '\0' + std::to_string(mtime);
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int len = 0;
+  if (EVP_Digest(material.data(), material.size(), digest, &len, EVP_sha256(), nullptr) != 1)
+    throw std::runtime_error("EVP_Digest failed");
+  return std::string(reinterpret_cast<char*>(digest), kResumeTokenSize);
+}
+
+// Loads the bitmap if the sidecar describes exactly this offer.
+bool loadBitmap(const fs::path& mapPath, const std::string& token, uint64_t size,
+                uint32_t chunkSize, uint32_t chunkCount, std::vector<uint8_t>& have) {
+  std::ifstream in(mapPath, std::ios::binary);
+  char magic[sizeof(kMapMagic)];
+  uint64_t s = 0;
+  uint32_t cs = 0, cc = 0;
+  std::string t(kResumeTokenSize, '\0');
+  in.read(magic, sizeof(magic));
+  in.read(reinterpret_cast<char*>(&s), sizeof(s));
+  in.read(reinterpret_cast<char*>(&cs), sizeof(cs));
+  in.read(reinterpret_cast<char*>(&cc), sizeof(cc));
+  in.read(t.data(), static_cast<std::streamsize>(t.size()));
+  if (!in || std::memcmp(magic, kMapMagic, sizeof(magic)) != 0 || t != token || s != size ||
+      cs != chunkSize || cc != chunkCount) {
+    return false;
+  }
+  have.assign((chunkCount + 7) / 8, 0);
+  in.read(reinterpret_cast<char*>(have.data()), static_cast<std::streamsize>(have.size()));
+  return static_cast<bool>(in);
+}
+
+// "report.pdf" -> "report (1).pdf", ... until the name is free.
+fs::path uniquePath(const fs::path& dir, const fs::path& name) {
+  fs::path p = dir / name;
+  for (int i = 1; fs::exists(p) || fs::exists(fs::path(p).concat(".part")); ++i) {
+    p = dir / (name.stem().string() + " (" + std::to_string(i) + ")" + name.extension().string());
+  }
+  return p;
+}
+}  // namespace
+
+// <name>.part.map: magic, size, chunk size, chunk count, token, bitmap.
+// Written to a temp file and renamed so a crash never leaves a torn bitmap.
+bool FileTransfer::Incoming::saveBitmap() const {
+  fs::path tmp = fs::path(mapPath).concat(".tmp");
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    out.write(kMapMagic, sizeof(kMapMagic));
+    out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    out.write(reinterpret_cast<const char*>(&chunkSize), sizeof(chunkSize));
+    out.write(reinterpret_cast<const char*>(&chunkCount), sizeof(chunkCount));
+    out.write(token.data(), static_cast<std::streamsize>(token.size()));
+    out.write(reinterpret_cast<const char*>(have.data()), static_cast<std::streamsize>(have.size()));
+    if (!out) return false;
+  }
+  std::error_code ec;
+  fs::rename(tmp, mapPath, ec);
+  return !ec;
+}
+
+void FileTransfer::Incoming::removePartial() const {
+  std::error_code ec;
+  fs::remove(partPath, ec);
+  fs::remove(mapPath, ec);
+}
+
+FileTransfer::FileTransfer(const ConnectionEngine& engine,
+                           ConnectionEngine::SendFrameFn send,
+                           std::string downloadDir,
+                           EventFn onEvent)
+    : engine_(engine),
+      send_(std::move(send)),
+      downloadDir_(std::move(downloadDir)),
+      onEvent_(std::move(onEvent)) {}
+
+FileTransfer::~FileTransfer() { cancelAll(); }
+
+aead::AeadCrypto FileTransfer::fileKey(uint64_t transferId) const {
+  std::vector<uint8_t> info(8);
+  for (int i = 0; i < 8; ++i) info[i] = static_cast<uint8_t>(transferId >> (56 - 8 * i));
+  return aead::AeadCrypto(engine_.session().suite(),
+                          hkdf_sha256(engine_.session().key(), protocol::file_hkdf_salt(), info,
+                                      AESGCMCrypto::KEY_SIZE));
+}
+
+bool FileTransfer::sendControl(const std::string& body) {
+  std::vector<uint8_t> frame;
+  std::string err;
+  return engine_.encryptAndSerializeControl(body, frame, err) && send_(frame);
+}
+
+void FileTransfer::flushControls() {
+  std::vector<std::string> bodies;
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    bodies.swap(outbox_);
+  }
+  for (const auto& body : bodies) sendControl(body);
+}
+
+void FileTransfer::emitEvent(const std::string& line) {
+  if (onEvent_) onEvent_(line);
+}
+
+std::vector<uint8_t> FileTransfer::acquireFrame() {
+  std::lock_guard<std::mutex> lk(poolMtx_);
+  if (framePool_.empty()) {
+    std::vector<uint8_t> frame;
+    frame.reserve(wire::kFileChunkHeaderSize + kChunkSize + AESGCMCrypto::TAG_SIZE);
+    return frame;
+  }
+  std::vector<uint8_t> frame = std::move(framePool_.back());
+  framePool_.pop_back();
+  return frame;
+}
+
+void FileTransfer::releaseFrame(std::vector<uint8_t> frame) {
+  std::lock_guard<std::mutex> lk(poolMtx_);
+  if (framePool_.size() < kMaxPooledFrames) framePool_.push_back(std::move(frame));
+}
+
+bool FileTransfer::sendFile(const std::string& path, std::string& errorOut) {
+  MappedFile src;
+  std::string token;
+  try {
+    src = MappedFile::openRead(path);
+    token = resumeToken(path, src.size());
+  } catch (const std::exception& ex) {
+    errorOut = std::string("Cannot open ") + path + ": " + ex.what();
+    return false;
+  }
+  const uint64_t size = src.size();
+  const uint32_t count = chunkCountFor(size, kChunkSize);
+  const std::string name = fs::path(path).filename().string();
+
+  uint64_t id = 0;
+  aead::AeadCrypto key;
+  try {
+    id = randomTransferId();
+    key = fileKey(id);
+  } catch (const std::exception& ex) {
+    errorOut = ex.what();
+    return false;
+  }
+
+  auto state = std::make_shared<Outgoing>();
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    outgoing_[id] = state;
+  }
+  auto finish = [&](bool ok, const std::string& err) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    outgoing_.erase(id);
+    if (!ok) errorOut = err;
+    return ok;
+  };
+  auto abort = [&](const std::string& reason) {
+    auto ctl = control(FileControl::CANCEL, id);
+    ctl.set_reason(reason);
+    sendControl(serialize(ctl));
+    return finish(false, reason);
+  };
+  // Waits for pred (or a cancel); false on timeout.
+  auto waitFor = [&](const auto& pred) {
+    std::unique_lock<std::mutex> lk(mtx_);
+    return cv_.wait_for(lk, std::chrono::seconds(kPeerTimeoutSeconds),
+                        [&]{ return state->cancelled || pred(); });
+  };
+
+  auto offer = control(FileControl::OFFER, id);
+  offer.set_name(name);
+  offer.set_size(size);
+  offer.set_chunk_size(kChunkSize);
+  offer.set_chunk_count(count);
+  offer.set_resume_token(token);
+  if (!sendControl(serialize(offer))) return finish(false, "Failed to send file offer");
+
+  if (!waitFor([&]{ return state->accepted; })) return abort("Peer did not accept the file");
+  if (state->cancelled) return finish(false, "Transfer cancelled: " + state->reason);
+
+  // Written only by handleControl before accepted is set, so safe to read unlocked now.
+  const uint8_t* have = state->have.size() == (count + 7) / 8
+                            ? reinterpret_cast<const uint8_t*>(state->have.data())
+                            : nullptr;
+  uint32_t sent = 0, skipped = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    if (have && testBit(have, i)) {
+      ++skipped;
+      continue;
+    }
+    if (!waitFor([&]{ return sent < state->received + kWindowChunks; })) {
+      return abort("Peer stopped acknowledging chunks");
+    }
+    if (state->cancelled) return finish(false, "Transfer cancelled: " + state->reason);
+
+    const bool last = i + 1 == count;
+    const uint64_t offset = uint64_t(i) * kChunkSize;
+    const size_t n = last ? static_cast<size_t>(size - offset) : kChunkSize;
+    static const uint8_t kEmpty = 0;
+    const uint8_t* plain = n ? src.data() + offset : &kEmpty;
+
+    wire::FileChunkHeader h;
+    h.flags = last ? wire::kFlagLastChunk : 0;
+    h.transfer_id = id;
+    h.index = i;
+    h.length = static_cast<uint32_t>(n + AESGCMCrypto::TAG_SIZE);
+    std::vector<uint8_t> frame = acquireFrame();
+    frame.resize(wire::kFileChunkHeaderSize + h.length);
+    wire::encodeFileChunkHeader(h, frame.data());
+    uint8_t nonce[AESGCMCrypto::NONCE_SIZE];
+    wire::fileChunkNonce(i, nonce);
+    try {
+      key.encrypt_into(plain, n, nonce, frame.data(), wire::kFileChunkHeaderSize,
+                       frame.data() + wire::kFileChunkHeaderSize);
+    } catch (const std::exception& ex) {
+      return abort(ex.what());
+    }
+    const bool ok = send_(frame);
+    releaseFrame(std::move(frame));
+    if (!ok) return finish(false, "Send failed");
+    src.release(offset, n);  // sent once; don't let a big file crowd the page cache
+    ++sent;
+  }
+
+  if (!waitFor([&]{ return state->done; })) return abort("Peer did not confirm the file");
+  if (state->cancelled) return finish(false, "Transfer cancelled: " + state->reason);
+  emitEvent("[file] sent " + name + " (" + std::to_string(size) + " bytes" +
+            (skipped ? ", resumed after " + std::to_string(skipped) + " chunks" : "") + ")");
+  return finish(true, {});
+}
+
+bool FileTransfer::handleFrame(const std::vector<uint8_t>& frame) {
+  switch (ConnectionEngine::frameKind(frame)) {
+    case ConnectionEngine::FrameKind::FileControl:
+      handleControl(frame);
+      flushControls();
+      return true;
+    case ConnectionEngine::FrameKind::FileChunk:
+      handleChunk(frame);
+      flushControls();
+      return true;
+    default:
+      return false;
+  }
+}
+
+void FileTransfer::handleControl(const std::vector<uint8_t>& frame) {
+  std::string body, err;
+  if (!engine_.parseAndDecryptControl(frame, body, err)) {
+    emitEvent("[file] dropping control frame: " + err);
+    return;
+  }
+  FileControl ctl;
+  if (!ctl.ParseFromString(body)) {
+    emitEvent("[file] dropping malformed control frame");
+    return;
+  }
+  const uint64_t id = ctl.transfer_id();
+
+  std::lock_guard<std::mutex> lk(mtx_);
+  switch (ctl.type()) {
+    case FileControl::ACCEPT:
+    case FileControl::ACK:
+    case FileControl::DONE: {
+      auto it = outgoing_.find(id);
+      if (it == outgoing_.end()) return;
+      auto& st = *it->second;
+      if (ctl.type() == FileControl::ACCEPT && !st.accepted) {
+        st.have = ctl.have();
+        st.accepted = true;
+      }
+      if (ctl.type() == FileControl::ACK) st.received = std::max(st.received, ctl.received());
+      if (ctl.type() == FileControl::DONE) st.done = true;
+      cv_.notify_all();
+      return;
+    }
+    case FileControl::CANCEL: {
+      auto it = outgoing_.find(id);
+      if (it != outgoing_.end()) {
+        it->second->cancelled = true;
+        it->second->reason = ctl.reason();
+        cv_.notify_all();
+      }
+      abortIncoming(id, "peer cancelled: " + ctl.reason(), false);
+      return;
+    }
+    case FileControl::OFFER:
+      break;
+    default:
+      return;
+  }
+
+  // OFFER: validate, map <name>.part (resuming a matching one) and accept.
+  auto refuse = [&](const std::string& reason) {
+    auto cancel = control(FileControl::CANCEL, id);
+    cancel.set_reason(reason);
+    queueControl(serialize(cancel));
+    emitEvent("[file] refused " + ctl.name() + ": " + reason);
+  };
+  if (incoming_.count(id)) return;
+  if (incoming_.size() >= kMaxIncoming) return refuse("too many transfers in progress");
+  if (ctl.chunk_size() == 0 || ctl.chunk_size() > kMaxChunkSize ||
+      ctl.size() > uint64_t(UINT32_MAX) * ctl.chunk_size() ||
+      ctl.chunk_count() != chunkCountFor(ctl.size(), ctl.chunk_size())) {
+    return refuse("bad chunk layout");
+  }
+  if (ctl.size() > maxIncomingSize_) {
+    return refuse("file too large (limit " + std::to_string(maxIncomingSize_) + " bytes)");
+  }
+  const fs::path name = fs::path(ctl.name()).filename();
+  if (name.empty() || name == "." || name == "..") return refuse("bad file name");
+
+  auto in = std::make_unique<Incoming>();
+  in->token = ctl.resume_token();
+  in->size = ctl.size();
+  in->chunkSize = ctl.chunk_size();
+  in->chunkCount = ctl.chunk_count();
+  std::error_code ec;
+  fs::create_directories(downloadDir_, ec);
+
+  // Look for a partial download of the same source under any of the candidate names.
+  bool resumed = false;
+  if (in->token.size() == kResumeTokenSize) {
+    fs::path p = fs::path(downloadDir_) / name;
+    for (int i = 1; fs::exists(p) || fs::exists(fs::path(p).concat(".part")); ++i) {
+      fs::path part = fs::path(p).concat(".part");
+      bool busy = std::any_of(incoming_.begin(), incoming_.end(),
+                              [&](const auto& kv) { return kv.second->partPath == part; });
+      if (!busy && !fs::exists(p) &&
+          loadBitmap(fs::path(part).concat(".map"), in->token, in->size, in->chunkSize,
+                     in->chunkCount, in->have)) {
+        in->finalPath = p;
+        resumed = true;
+        break;
+      }
+      p = fs::path(downloadDir_) /
+          (name.stem().string() + " (" + std::to_string(i) + ")" + name.extension().string());
+    }
+  }
+  if (!resumed) {
+    in->finalPath = uniquePath(downloadDir_, name);
+    in->have.assign((in->chunkCount + 7) / 8, 0);
+  }
+  in->partPath = fs::path(in->finalPath).concat(".part");
+  in->mapPath = fs::path(in->partPath).concat(".map");
+  try {
+    in->dest = MappedFile::openWrite(in->partPath.string(), in->size);
+    in->key = fileKey(id);
+  } catch (const std::exception& ex) {
+    // Out of disk space lands here too (openWrite allocates every block).
+    if (!resumed) fs::remove(in->partPath, ec);
+    return refuse(ex.what());
+  }
+  for (uint32_t i = 0; i < in->chunkCount; ++i) {
+    if (!testBit(in->have.data(), i)) ++in->missing;
+  }
+  if (!resumed && !in->saveBitmap()) return refuse("cannot write " + in->mapPath.string());
+
+  auto accept = control(FileControl::ACCEPT, id);
+  if (resumed) accept.set_have(in->have.data(), in->have.size());
+  const uint32_t kept = in->chunkCount - in->missing;
+  const bool complete = in->missing == 0;  // crashed between the last sync and the rename
+  incoming_[id] = std::move(in);
+  queueControl(serialize(accept));
+  emitEvent("[file] receiving " + name.string() + " (" + std::to_string(ctl.size()) + " bytes" +
+            (resumed ? ", resuming with " + std::to_string(kept) + " chunks" : "") + ")");
+  if (complete) completeIncoming(id);
+}
+
+void FileTransfer::handleChunk(const std::vector<uint8_t>& frame) {
+  wire::FileChunkHeader h;
+  const uint8_t* body = nullptr;
+  if (!wire::decodeFileChunk(frame.data(), frame.size(), h, body)) {
+    emitEvent("[file] dropping malformed chunk");
+    return;
+  }
+
+  std::lock_guard<std::mutex> lk(mtx_);
+  auto it = incoming_.find(h.transfer_id);
+  if (it == incoming_.end()) return;  // cancelled or unknown transfer
+  Incoming& in = *it->second;
+
+  const bool last = h.index + 1 == in.chunkCount;
+  const uint64_t offset = uint64_t(h.index) * in.chunkSize;
+  const size_t expect = h.index < in.chunkCount
+                            ? (last ? static_cast<size_t>(in.size - offset) : in.chunkSize)
+                            : 0;
+  if (h.index >= in.chunkCount || testBit(in.have.data(), h.index) ||
+      h.length != expect + AESGCMCrypto::TAG_SIZE ||
+      ((h.flags & wire::kFlagLastChunk) != 0) != last) {
+    return abortIncoming(h.transfer_id, "unexpected chunk " + std::to_string(h.index), true);
+  }
+
+  // Decrypt straight into the mapped destination; a bad tag leaves garbage in a
+  // range whose bit is never set, and the transfer is dropped anyway.
+  uint8_t nonce[AESGCMCrypto::NONCE_SIZE];
+  wire::fileChunkNonce(h.index, nonce);
+  uint8_t empty = 0;
+  try {
+    in.key.decrypt_into(body, h.length, nonce, frame.data(), wire::kFileChunkHeaderSize,
+                        expect ? in.dest.data() + offset : &empty);
+  } catch (const std::exception& ex) {
+    return abortIncoming(h.transfer_id, ex.what(), true);
+  }
+  in.have[h.index / 8] |= static_cast<uint8_t>(1u << (h.index % 8));
+  in.unsynced.push_back(h.index);
+  --in.missing;
+  ++in.received;
+
+  const bool complete = in.missing == 0;
+  if (!complete && in.received % (kWindowChunks / 2) != 0) return;
+
+  // Sync what was written before acknowledging it (and before the bitmap says so).
+  try {
+    for (uint32_t idx : in.unsynced) {
+      const uint64_t off = uint64_t(idx) * in.chunkSize;
+      in.dest.sync(off, in.chunkSize);
+      in.dest.release(off, in.chunkSize);
+    }
+  } catch (const std::exception& ex) {
+    return abortIncoming(h.transfer_id, ex.what(), true);
+  }
+  in.unsynced.clear();
+
+  if (complete) return completeIncoming(h.transfer_id);
+  if (!in.saveBitmap()) return abortIncoming(h.transfer_id, "cannot write " + in.mapPath.string(), true);
+  auto ack = control(FileControl::ACK, h.transfer_id);
+  ack.set_received(in.received);
+  queueControl(serialize(ack));
+}
+
+// Caller holds mtx_; every chunk is written and synced.
+void FileTransfer::completeIncoming(uint64_t transferId) {
+  auto it = incoming_.find(transferId);
+  Incoming& in = *it->second;
+  in.dest.close();
+  std::error_code ec;
+  fs::rename(in.partPath, in.finalPath, ec);
+  if (ec) return abortIncoming(transferId, "rename failed: " + ec.message(), true);
+  fs::remove(in.mapPath, ec);
+  queueControl(serialize(control(FileControl::DONE, transferId)));
+  emitEvent("[file] saved " + in.finalPath.string());
+  incoming_.erase(it);
+}
+
+// Caller holds mtx_.
+void FileTransfer::abortIncoming(uint64_t transferId, const std::string& reason, bool notifyPeer) {
+  auto it = incoming_.find(transferId);
+  if (it == incoming_.end()) return;
+  it->second->dest.close();
+  it->second->removePartial();
+  emitEvent("[file] aborted " + it->second->finalPath.filename().string() + ": " + reason);
+  incoming_.erase(it);
+  if (notifyPeer) {
+    auto cancel = control(FileControl::CANCEL, transferId);
+    cancel.set_reason(reason);
+    queueControl(serialize(cancel));
+  }
+}
+
+void FileTransfer::cancelAll() {
+  std::lock_guard<std::mutex> lk(mtx_);
+  for (auto& [id, st] : outgoing_) {
+    st->cancelled = true;
+    st->reason = "cancelled locally";
+  }
+  // Keep partial downloads: sync what arrived and record it so a later offer of
+  // the same file resumes instead of starting over.
+  for (auto& [id, in] : incoming_) {
+    try {
+      for (uint32_t idx : in->unsynced) in->dest.sync(uint64_t(idx) * in->chunkSize, in->chunkSize);
+      in->dest.close();
+      if (!in->saveBitmap()) in->removePartial();
+    } catch (const std::exception&) {
+      in->dest.close();
+      in->removePartial();
+    }
+  }
+  incoming_.clear();
+  cv_.notify_all();
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "connection_engine.h"
+#include "aead.h"
+
+// Streams files over an established session with bounded memory on both ends.
+//
+// The sender offers the file (FileControl OFFER), waits for ACCEPT, then sends
+// kChunkSize chunks encrypted under a per-transfer key (HKDF of the session key
+// and transfer id) with the chunk index in the nonce and the chunk header as AAD.
+// Chunks are encrypted straight out of a read-only mapping of the source into
+// pooled frame buffers. At most kWindowChunks may be unacknowledged; the receiver
+// decrypts each chunk into a mapping of the preallocated <downloadDir>/<name>.part,
+// syncs and ACKs every half window, and renames the file into place once every
+// chunk is present. Needs protocol v2 on both peers.
+//
+// Resume: the receiver keeps a bitmap of synced chunks in <name>.part.map. If a
+// later OFFER carries the same resume token (source path, size and mtime), the
+// ACCEPT returns that bitmap and the sender only sends the missing chunks.
+//
+// No protobuf in header.
+class FileTransfer {
+public:
+  static constexpr size_t kChunkSize = 64 * 1024;
+  static constexpr uint32_t kWindowChunks = 16;      // 1 MiB in flight per transfer
+  static constexpr size_t kMaxIncoming = 4;          // concurrent receives
+  static constexpr int kPeerTimeoutSeconds = 30;
+  static constexpr uint64_t kDefaultMaxIncomingSize = 4ull << 30;  // 4 GiB
+
+  using EventFn = std::function<void(const std::string&)>;
+
+  // send must be safe to call from several threads (the caller's send mutex).
+  FileTransfer(const ConnectionEngine& engine,
+               ConnectionEngine::SendFrameFn send,
+               std::string downloadDir,
+               EventFn onEvent = {});
+  ~FileTransfer();
+
+  // Blocks until the peer confirms the file, cancels, or times out. Call from a
+  // thread other than the receive loop, which has to keep feeding handleFrame().
+  bool sendFile(const std::string& path, std::string& errorOut);
+
+  // Receive-loop hook: consumes file-transfer frames and returns true, or returns
+  // false for anything else (chat messages).
+  bool handleFrame(const std::vector<uint8_t>& frame);
+
+  // Largest file this side accepts; bigger offers are refused. 0 restores the
+  // default. Call before frames arrive.
+  void setMaxIncomingSize(uint64_t bytes) { maxIncomingSize_ = bytes ? bytes : kDefaultMaxIncomingSize; }
+
+  // Aborts every transfer (call on disconnect so blocked senders return).
+  void cancelAll();
+
+private:
+  struct Outgoing;
+  struct Incoming;
+
+  bool sendControl(const std::string& body);
+  // Paths holding mtx_ queue their control frames here; handleFrame sends them
+  // once the lock is released, since send_ can block on the network.
+  void queueControl(const std::string& body) { outbox_.push_back(body); }
+  void flushControls();
+  void handleControl(const std::vector<uint8_t>& frame);
+  void handleChunk(const std::vector<uint8_t>& frame);
+  void completeIncoming(uint64_t transferId);
+  void abortIncoming(uint64_t transferId, const std::string& reason, bool notifyPeer);
+  aead::AeadCrypto fileKey(uint64_t transferId) const;
+  void emitEvent(const std::string& line);
+  std::vector<uint8_t> acquireFrame();
+  void releaseFrame(std::vector<uint8_t> frame);
+
+  const ConnectionEngine& engine_;
+  ConnectionEngine::SendFrameFn send_;
+  std::string downloadDir_;
+  uint64_t maxIncomingSize_ = kDefaultMaxIncomingSize;
+  EventFn onEvent_;
+
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  std::map<uint64_t, std::shared_ptr<Outgoing>> outgoing_;
+  std::map<uint64_t, std::unique_ptr<Incoming>> incoming_;
+  std::vector<std::string> outbox_;  // control bodies queued under mtx_
+  std::mutex poolMtx_;
+  std::vector<std::vector<uint8_t>> framePool_;  // chunk-sized send buffers
+};
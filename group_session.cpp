@@ -0,0 +1,215 @@
+#include "group_session.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include "messages.pb.h"
+
+namespace {
+constexpr size_t kFixedHeaderSize = 11;  // tag, flags, epoch, iteration, sender length
+
+void put_be32(uint8_t* out, uint32_t v) {
+  for (int i = 0; i < 4; ++i) out[i] = static_cast<uint8_t>(v >> (8 * (3 - i)));
+}
+
+uint32_t get_be32(const uint8_t* in) {
+  return (uint32_t(in[0]) << 24) | (uint32_t(in[1]) << 16) | (uint32_t(in[2]) << 8) | in[3];
+}
+
+void hmac_byte(const uint8_t* key, size_t keyLen, uint8_t input, uint8_t out[32]) {
+  unsigned int len = 32;
+  if (!HMAC(EVP_sha256(), key, static_cast<int>(keyLen), &input, 1, out, &len) || len != 32)
+    throw std::runtime_error("HMAC-SHA256 failed");
+}
+
+void nonce_for(uint32_t iteration, uint8_t out[AESGCMCrypto::NONCE_SIZE]) {
+  std::fill(out, out + 8, 0);
+  put_be32(out + 8, iteration);
+}
+}  // namespace
+
+GroupSession::GroupSession(std::string groupId, std::string selfId)
+    : groupId_(std::move(groupId)), selfId_(std::move(selfId)) {
+  if (selfId_.empty() || selfId_.size() > 255) throw std::invalid_argument("GroupSession: bad member id");
+  rekey();  // epoch 1
+}
+
+void GroupSession::rekey() {
+  std::lock_guard<std::mutex> lk(mtx_);
+  if (RAND_bytes(own_.key.data(), static_cast<int>(own_.key.size())) != 1)
+    throw std::runtime_error("RAND_bytes failed");
+  ++own_.epoch;
+  own_.iteration = 0;
+}
+
+void GroupSession::removeMember(const std::string& member) {
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    auto it = members_.find(member);
+    if (it != members_.end()) {
+      OPENSSL_cleanse(it->second.key.data(), it->second.key.size());
+      members_.erase(it);
+    }
+  }
+  rekey();
+}
+
+std::string GroupSession::senderKey() const {
+  SenderKey sk;
+  std::lock_guard<std::mutex> lk(mtx_);
+  sk.set_group_id(groupId_);
+  sk.set_sender_id(selfId_);
+  sk.set_epoch(own_.epoch);
+  sk.set_iteration(own_.iteration);
+  sk.set_chain_key(reinterpret_cast<const char*>(own_.key.data()), own_.key.size());
+  return sk.SerializeAsString();
+}
+
+bool GroupSession::addSenderKey(const std::string& fromMember, const std::string& senderKeyBytes,
+                                std::string& errorOut) {
+  SenderKey sk;
+  if (!sk.ParseFromString(senderKeyBytes) || sk.chain_key().size() != AESGCMCrypto::KEY_SIZE) {
+    errorOut = "Malformed SenderKey";
+    return false;
+  }
+  if (sk.group_id() != groupId_) {
+    errorOut = "SenderKey is for another group";
+    return false;
+  }
+  if (sk.sender_id() != fromMember || fromMember == selfId_) {
+    errorOut = "SenderKey does not belong to the member that sent it";
+    return false;
+  }
+  std::lock_guard<std::mutex> lk(mtx_);
+  auto it = members_.find(fromMember);
+  if (it != members_.end() && sk.epoch() <= it->second.epoch) return true;  // stale or repeated
+  Chain& c = members_[fromMember];
+  c.epoch = sk.epoch();
+  c.iteration = sk.iteration();
+  std::copy(sk.chain_key().begin(), sk.chain_key().end(), c.key.begin());
+  return true;
+}
+
+std::vector<uint8_t> GroupSession::step(Chain& chain) {
+  std::vector<uint8_t> messageKey(AESGCMCrypto::KEY_SIZE);
+  uint8_t next[32];
+  hmac_byte(chain.key.data(), chain.key.size(), 0x01, messageKey.data());
+  hmac_byte(chain.key.data(), chain.key.size(), 0x02, next);
+  std::copy(next, next + 32, chain.key.begin());
+  OPENSSL_cleanse(next, sizeof(next));
+  ++chain.iteration;
+  return messageKey;
+}
+
+bool GroupSession::encrypt(const std::string& plaintext, std::vector<uint8_t>& frameOut, std::string& errorOut) {
+  try {
+    uint32_t epoch = 0, iteration = 0;
+    std::vector<uint8_t> messageKey;
+    {
+      std::lock_guard<std::mutex> lk(mtx_);
+      epoch = own_.epoch;
+      iteration = own_.iteration;
+      messageKey = step(own_);
+    }
+    const size_t headerSize = kFixedHeaderSize + selfId_.size();
+    frameOut.resize(headerSize + plaintext.size() + AESGCMCrypto::TAG_SIZE);
+    uint8_t* h = frameOut.data();
+    h[0] = kGroupTag;
+    h[1] = 0;
+    put_be32(h + 2, epoch);
+    put_be32(h + 6, iteration);
+    h[10] = static_cast<uint8_t>(selfId_.size());
+    std::copy(selfId_.begin(), selfId_.end(), h + kFixedHeaderSize);
+
+    std::vector<uint8_t> aad(h, h + headerSize);
+    aad.insert(aad.end(), groupId_.begin(), groupId_.end());
+    uint8_t nonce[AESGCMCrypto::NONCE_SIZE];
+    nonce_for(iteration, nonce);
+    AESGCMCrypto(messageKey).encrypt_into(reinterpret_cast<const uint8_t*>(plaintext.data()), plaintext.size(),
+                                          nonce, aad.data(), aad.size(), h + headerSize);
+    OPENSSL_cleanse(messageKey.data(), messageKey.size());
+    return true;
+  } catch (const std::exception& ex) {
+    errorOut = ex.what();
+    return false;
+  }
+}
+
+bool GroupSession::decrypt(const std::vector<uint8_t>& frame, std::string& senderOut, std::string& plaintextOut,
+                           std::string& errorOut) {
+  if (!isGroupFrame(frame.data(), frame.size())) {
+    errorOut = "Not a group frame";
+    return false;
+  }
+  const uint32_t epoch = get_be32(frame.data() + 2);
+  const uint32_t iteration = get_be32(frame.data() + 6);
+  const size_t senderLen = frame[10];
+  const size_t headerSize = kFixedHeaderSize + senderLen;
+  if (frame.size() < headerSize + AESGCMCrypto::TAG_SIZE) {
+    errorOut = "Malformed group frame";
+    return false;
+  }
+  const std::string sender(reinterpret_cast<const char*>(frame.data() + kFixedHeaderSize), senderLen);
+
+  // Ratchet a copy so a forged or corrupt frame cannot move the chain.
+  Chain chain;
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    auto it = members_.find(sender);
+    if (it == members_.end()) {
+      errorOut = "No sender key for " + sender;
+      return false;
+    }
+    chain = it->second;
+  }
+  if (epoch != chain.epoch) {
+    errorOut = "Sender key epoch mismatch (rekeyed?)";
+    return false;
+  }
+  if (iteration < chain.iteration) {
+    errorOut = "Group message replayed or too old";
+    return false;
+  }
+  if (iteration - chain.iteration > kMaxForwardSteps) {
+    errorOut = "Group message too far ahead";
+    return false;
+  }
+  try {
+    while (chain.iteration < iteration) {
+      auto skipped = step(chain);
+      OPENSSL_cleanse(skipped.data(), skipped.size());
+    }
+    auto messageKey = step(chain);
+    std::vector<uint8_t> aad(frame.begin(), frame.begin() + headerSize);
+    aad.insert(aad.end(), groupId_.begin(), groupId_.end());
+    uint8_t nonce[AESGCMCrypto::NONCE_SIZE];
+    nonce_for(iteration, nonce);
+    std::string plain(frame.size() - headerSize - AESGCMCrypto::TAG_SIZE, '\0');
+    AESGCMCrypto(messageKey).decrypt_into(frame.data() + headerSize, frame.size() - headerSize, nonce,
+                                          aad.data(), aad.size(), reinterpret_cast<uint8_t*>(&plain[0]));
+    OPENSSL_cleanse(messageKey.data(), messageKey.size());
+
+    std::lock_guard<std::mutex> lk(mtx_);
+    auto it = members_.find(sender);
+    // Another thread may have advanced or replaced the chain meanwhile.
+    if (it == members_.end() || it->second.epoch != epoch || it->second.iteration > iteration) {
+      errorOut = "Group message replayed or too old";
+      return false;
+    }
+    it->second = chain;
+    senderOut = sender;
+    plaintextOut = std::move(plain);
+    return true;
+  } catch (const std::exception& ex) {
+    errorOut = ex.what();
+    return false;
+  }
+}
+
+bool GroupSession::isGroupFrame(const uint8_t* data, size_t size) {
+  return size >= kFixedHeaderSize && data[0] == kGroupTag;
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "crypto.h"
+
+// Group chat over a relay room with sender keys: each member keeps one
+// symmetric chain for its own messages and hands it to every other member once,
+// over the pairwise ConnectionEngine sessions (senderKey() as the plaintext of
+// an ordinary encrypted message). After that a group message is encrypted once
+// and the relay's room broadcast delivers the same frame to everyone.
+//
+// Chain step (HMAC-SHA256): message key = HMAC(chain, 0x01), next chain =
+// HMAC(chain, 0x02). The old chain is overwritten, so a leaked chain key does
+// not expose earlier messages; a member who joins late is given the current
+// chain and cannot read what came before either.
+//
+// Removing a member rekeys: every remaining member starts a fresh chain under a
+// new epoch and sends it pairwise to the others (rekey()), so the removed
+// member's copies of their chains go stale. Adding one needs no rekey.
+//
+// Frame layout (big-endian):
+//   u8  tag = kGroupTag
+//   u8  flags        reserved (0)
+//   u32 epoch        sender's chain generation
+//   u32 iteration    position in that chain; forms the nonce
+//   u8  sender length | sender id
+//   ... ciphertext || 16-byte tag   (header plus group id authenticated as AAD)
+//
+// Anyone holding a sender's chain can forge that sender's messages, so the
+// sender id is only as trustworthy as the group's members.
+class GroupSession {
+public:
+  // Below 0x08 like the other frame tags, so it cannot start a protobuf message.
+  static constexpr uint8_t kGroupTag = 0x05;
+  // Further ahead than this a frame is rejected rather than ratcheting for it.
+  static constexpr uint32_t kMaxForwardSteps = 2000;
+
+  GroupSession(std::string groupId, std::string selfId);
+
+  const std::string& groupId() const { return groupId_; }
+  const std::string& selfId() const { return selfId_; }
+
+  // Our current chain as a serialized SenderKey (messages.proto), to send to
+  // each member over its pairwise session.
+  std::string senderKey() const;
+
+  // Installs a chain received from the pairwise session with fromMember; it
+  // must be that member's own key for this group. A newer epoch replaces the
+  // stored chain; an older one is ignored.
+  bool addSenderKey(const std::string& fromMember, const std::string& senderKeyBytes, std::string& errorOut);
+
+  // Forgets member's chain and starts our own new one; send senderKey() to the
+  // remaining members afterwards.
+  void removeMember(const std::string& member);
+  void rekey();
+
+  bool encrypt(const std::string& plaintext, std::vector<uint8_t>& frameOut, std::string& errorOut);
+  bool decrypt(const std::vector<uint8_t>& frame, std::string& senderOut, std::string& plaintextOut,
+               std::string& errorOut);
+
+  static bool isGroupFrame(const uint8_t* data, size_t size);
+
+private:
+  struct Chain {
+    uint32_t epoch = 0;
+    uint32_t iteration = 0;
+    std::array<uint8_t, AESGCMCrypto::KEY_SIZE> key{};
+  };
+
+  // Derives the message key for chain's current iteration and advances it.
+  static std::vector<uint8_t> step(Chain& chain);
+
+  const std::string groupId_;
+  const std::string selfId_;
+  mutable std::mutex mtx_;
+  Chain own_;
+  std::unordered_map<std::string, Chain> members_;  // by member id
+};
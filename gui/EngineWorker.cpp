@@ -5,6 +5,7 @@
 #include <QUrl>
 #include <QUrlQuery>
 
+#include "file_transfer.h"
 #include "ws_transport.h"
 
 namespace {
@@ -70,6 +71,7 @@ void EngineWorker::startConnect(const QString& endpoint, const QString& password
     emit status(QString("Peer fingerprint: ") + shortenFingerprint(peerFingerprint));
   }
   emit connected();
+  startFileTransfer();
   rxThread_ = std::thread([this]{ this->recvLoop(); });
 }
 
@@ -110,6 +112,7 @@ void EngineWorker::startHost(quint16 port, const QString& password) {
     emit status(QString("Peer fingerprint: ") + shortenFingerprint(peerFingerprint));
   }
   emit connected();
+  startFileTransfer();
   rxThread_ = std::thread([this]{ this->recvLoop(); });
 }
 
@@ -170,6 +173,7 @@ void EngineWorker::startRelayConnect(const QString& relayUrl, const QString& pee
     emit status(QString("Peer fingerprint: ") + shortenFingerprint(peerFingerprint));
   }
   emit connected();
+  startFileTransfer();
   rxThread_ = std::thread([this]{ this->recvLoop(); });
 }
 
@@ -219,6 +223,7 @@ void EngineWorker::startRelayHost(const QString& relayUrl, const QString& myUser
     emit status(QString("Peer fingerprint: ") + shortenFingerprint(peerFingerprint));
   }
   emit connected();
+  startFileTransfer();
   rxThread_ = std::thread([this]{ this->recvLoop(); });
 }
 
@@ -226,9 +231,13 @@ void EngineWorker::startRelayHost(const QString& relayUrl, const QString& myUser
 
 void EngineWorker::disconnectFromPeer() {
   running_ = false;
+  if (files_) files_->cancelAll();
+  for (auto& t : fileThreads_) t.join();
+  fileThreads_.clear();
   if (mode_ == Mode::TCP) tcp_.close();
   if (mode_ == Mode::WS && ws_) ws_->close();
   if (rxThread_.joinable()) rxThread_.join();
+  files_.reset();
   if (isConnected_) { isConnected_ = false; emit disconnected(); }
   mode_ = Mode::None;
 }
@@ -243,15 +252,50 @@ void EngineWorker::sendMessage(const QString& text) {
     return;
   }
 
-  std::lock_guard<std::mutex> lk(sendMtx_);
-  bool ok = false;
-  if (mode_ == Mode::TCP) ok = tcp_.send(frame);
-  else if (mode_ == Mode::WS && ws_) ok = ws_->send(frame);
-  if (!ok) {
+  if (!sendFrame(frame)) {
     emit error("Send failed");
   }
 }
 
+void EngineWorker::sendFile(const QString& path) {
+  if (!isConnected_ || !files_) { emit error("Not connected."); return; }
+  // sendFile blocks on peer ACKs, which arrive via recvLoop; keep it off this thread.
+  fileThreads_.emplace_back([this, p = path.toStdString()]{
+    std::string err;
+    if (!files_->sendFile(p, err)) emit error(QString("File send error: ") + err.c_str());
+  });
+}
+
+void EngineWorker::setTracing(bool enabled) {
+  engine_.setTrace(enabled ? &trace_ : nullptr);
+  emit status(enabled ? "Engine timing enabled." : "Engine timing disabled.");
+}
+
+void EngineWorker::reportTrace() {
+  emit traceReport(engine_.tracer() ? QString::fromStdString(trace_.dump())
+                                    : QString("Timing is off (Debug > Record Engine Timings)."));
+}
+
+void EngineWorker::resetTrace() {
+  trace_.reset();
+  reportTrace();
+}
+
+bool EngineWorker::sendFrame(const std::vector<uint8_t>& frame) {
+  std::lock_guard<std::mutex> lk(sendMtx_);
+  if (mode_ == Mode::TCP) return tcp_.send(frame);
+  if (mode_ == Mode::WS && ws_) return ws_->send(frame);
+  return false;
+}
+
+void EngineWorker::startFileTransfer() {
+  files_ = std::make_unique<FileTransfer>(
+      engine_,
+      [this](const std::vector<uint8_t>& frame) { return sendFrame(frame); },
+      "downloads",
+      [this](const std::string& event) { emit status(QString::fromStdString(event)); });
+}
+
 void EngineWorker::recvLoop() {
   for (;;) {
     std::vector<uint8_t> frame;
@@ -259,16 +303,20 @@ void EngineWorker::recvLoop() {
     if (mode_ == Mode::TCP) ok = tcp_.recv(frame);
     else if (mode_ == Mode::WS && ws_) ok = ws_->recv(frame);
     if (!ok) break;
+    if (files_ && files_->handleFrame(frame)) continue;
 
-    std::string plaintext;
+    std::vector<std::string> plaintexts;
     std::string err;
-    if (!engine_.parseAndDecryptMessage(frame, plaintext, err)) {
+    if (!engine_.parseAndDecryptMessages(frame, plaintexts, err)) {
       emit status(QString("Dropping message: ") + err.c_str());
       continue;
     }
-    emit messageReceived(QString::fromStdString(plaintext));
+    for (const auto& plaintext : plaintexts) {
+      emit messageReceived(QString::fromStdString(plaintext));
+    }
   }
   isConnected_ = false;
   running_ = false;
+  if (files_) files_->cancelAll();
   emit disconnected();
 }
@@ -10,6 +10,7 @@
 
 #include "tcp_transport.h"
 #include "connection_engine.h"
+#include "engine_trace.h"
 
 // No protobuf in header
 class EngineWorker : public QObject {
@@ -30,6 +31,12 @@ public slots:
 
   void disconnectFromPeer();
   void sendMessage(const QString& text);
+  void sendFile(const QString& path);
+
+  // Debug panel: per-stage engine timings (engine_trace.h).
+  void setTracing(bool enabled);
+  void reportTrace();
+  void resetTrace();
 
 signals:
   void status(const QString& line);
@@ -38,16 +45,20 @@ signals:
   void disconnected();
   void identityReady(const QString& fingerprintHex);
   void messageReceived(const QString& text);
+  void traceReport(const QString& table);
 
 private:
   bool parseEndpoint(const QString& endpoint, std::string& host, uint16_t& port);
   void recvLoop();
+  bool sendFrame(const std::vector<uint8_t>& frame);
+  void startFileTransfer();
 
   // transport selection
   enum class Mode { None, TCP, WS };
   Mode mode_{Mode::None};
 
-  // crypto/session/identity
+  // crypto/session/identity (trace_ first so it outlives the engine pointing at it)
+  trace::EngineTrace trace_;
   ConnectionEngine engine_;
 
   // transports
@@ -59,4 +70,8 @@ private:
   std::atomic<bool> isConnected_{false};
   std::thread rxThread_;
   std::mutex sendMtx_;
+
+  // file sharing (received files land in ./downloads)
+  std::unique_ptr<class FileTransfer> files_; // defined in file_transfer.h
+  std::vector<std::thread> fileThreads_;
 };
@@ -11,8 +11,12 @@
 #include <QMenuBar>
 #include <QStatusBar>
 #include <QInputDialog>
+#include <QFileDialog>
 #include <QDateTime>
 #include <QThread>
+#include <QDialog>
+#include <QPlainTextEdit>
+#include <QFontDatabase>
 
 MainWindow::MainWindow(QWidget* parent) : QMainWindow(parent),
   chatView_(new QTextEdit(this)),
@@ -48,8 +52,14 @@ MainWindow::MainWindow(QWidget* parent) : QMainWindow(parent),
   auto* actRelayHost    = relayMenu->addAction(tr("Go Online (Relay)..."));
   auto* actRelayConnect = relayMenu->addAction(tr("Connect by Username (Relay)..."));
 
+  auto* actSendFile   = menuBar()->addAction(tr("Send File..."));
   auto* actDisconnect = menuBar()->addAction(tr("Disconnect"));
 
+  auto* debugMenu = menuBar()->addMenu(tr("&Debug"));
+  auto* actTracing = debugMenu->addAction(tr("Record Engine Timings"));
+  actTracing->setCheckable(true);
+  auto* actShowTrace = debugMenu->addAction(tr("Engine Timings..."));
+
   auto* helpMenu = menuBar()->addMenu(tr("&Help"));
   helpMenu->addAction(tr("About"), [this]{
     appendSystem("Relay mode: both clients connect to the same ws room name (username), "
@@ -72,6 +82,10 @@ MainWindow::MainWindow(QWidget* parent) : QMainWindow(parent),
   connect(this, &MainWindow::requestRelayConnect, worker_, &EngineWorker::startRelayConnect, Qt::QueuedConnection);
   connect(this, &MainWindow::requestDisconnect, worker_, &EngineWorker::disconnectFromPeer, Qt::QueuedConnection);
   connect(this, &MainWindow::requestSend,    worker_, &EngineWorker::sendMessage,  Qt::QueuedConnection);
+  connect(this, &MainWindow::requestSendFile, worker_, &EngineWorker::sendFile,    Qt::QueuedConnection);
+  connect(this, &MainWindow::requestTracing, worker_, &EngineWorker::setTracing,   Qt::QueuedConnection);
+  connect(this, &MainWindow::requestTraceReport, worker_, &EngineWorker::reportTrace, Qt::QueuedConnection);
+  connect(this, &MainWindow::requestTraceReset, worker_, &EngineWorker::resetTrace, Qt::QueuedConnection);
 
   // Worker -> UI
   connect(worker_, &EngineWorker::connected,        this, &MainWindow::onWorkerConnected);
@@ -80,13 +94,17 @@ MainWindow::MainWindow(QWidget* parent) : QMainWindow(parent),
   connect(worker_, &EngineWorker::status,           this, &MainWindow::onWorkerStatus);
   connect(worker_, &EngineWorker::error,            this, &MainWindow::onWorkerError);
   connect(worker_, &EngineWorker::identityReady,    this, &MainWindow::onIdentityReady);
+  connect(worker_, &EngineWorker::traceReport,      this, &MainWindow::onTraceReport);
 
   // Menu actions
   connect(actConnect, &QAction::triggered, this, &MainWindow::onConnect);
   connect(actHost,    &QAction::triggered, this, &MainWindow::onHost);
   connect(actRelayHost,    &QAction::triggered, this, &MainWindow::onRelayHost);
   connect(actRelayConnect, &QAction::triggered, this, &MainWindow::onRelayConnect);
+  connect(actSendFile,   &QAction::triggered, this, &MainWindow::onSendFile);
   connect(actDisconnect, &QAction::triggered, this, &MainWindow::onDisconnect);
+  connect(actTracing,    &QAction::toggled,   this, &MainWindow::requestTracing);
+  connect(actShowTrace,  &QAction::triggered, this, &MainWindow::onShowTrace);
 
   connect(sendBtn_,      &QPushButton::clicked, this, &MainWindow::onSend);
   connect(input_,        &QLineEdit::returnPressed, this, &MainWindow::onSend);
@@ -166,6 +184,43 @@ void MainWindow::onSend() {
   emit requestSend(text);
 }
 
+void MainWindow::onSendFile() {
+  const QString path = QFileDialog::getOpenFileName(this, tr("Send File"));
+  if (path.isEmpty()) return;
+  appendSystem("Sending " + path + " ...");
+  emit requestSendFile(path);
+}
+
+// Non-modal panel showing the worker's per-stage timing table.
+void MainWindow::onShowTrace() {
+  if (!traceDialog_) {
+    traceDialog_ = new QDialog(this);
+    traceDialog_->setWindowTitle(tr("Engine Timings"));
+    traceDialog_->resize(640, 360);
+    traceView_ = new QPlainTextEdit(traceDialog_);
+    traceView_->setReadOnly(true);
+    traceView_->setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
+    auto* refresh = new QPushButton(tr("Refresh"), traceDialog_);
+    auto* reset = new QPushButton(tr("Reset"), traceDialog_);
+    auto* v = new QVBoxLayout(traceDialog_);
+    v->addWidget(traceView_, 1);
+    auto* row = new QHBoxLayout();
+    row->addStretch(1);
+    row->addWidget(reset);
+    row->addWidget(refresh);
+    v->addLayout(row);
+    connect(refresh, &QPushButton::clicked, this, &MainWindow::requestTraceReport);
+    connect(reset,   &QPushButton::clicked, this, &MainWindow::requestTraceReset);
+  }
+  traceDialog_->show();
+  traceDialog_->raise();
+  emit requestTraceReport();
+}
+
+void MainWindow::onTraceReport(const QString& table) {
+  if (traceView_) traceView_->setPlainText(table);
+}
+
 void MainWindow::onWorkerConnected() { statusLabel_->setText(tr("Connected")); appendSystem("Connected."); }
 void MainWindow::onWorkerDisconnected() { statusLabel_->setText(tr("Disconnected")); appendSystem("Disconnected."); }
 void MainWindow::onWorkerMessage(const QString& text) {
@@ -6,6 +6,8 @@ class QLineEdit;
 class QPushButton;
 class QLabel;
 class QThread;
+class QDialog;
+class QPlainTextEdit;
 class EngineWorker;
 
 class MainWindow : public QMainWindow {
@@ -24,6 +26,11 @@ signals:
   // Common
   void requestDisconnect();
   void requestSend(const QString& text);
+  void requestSendFile(const QString& path);
+  // Debug panel
+  void requestTracing(bool enabled);
+  void requestTraceReport();
+  void requestTraceReset();
 
 private slots:
   // TCP actions
@@ -35,6 +42,8 @@ private slots:
 
   void onDisconnect();
   void onSend();
+  void onSendFile();
+  void onShowTrace();
 
   // Worker callbacks
   void onWorkerConnected();
@@ -43,6 +52,7 @@ private slots:
   void onWorkerStatus(const QString& line);
   void onWorkerError(const QString& msg);
   void onIdentityReady(const QString& fp);
+  void onTraceReport(const QString& table);
 
 private:
   void appendSystem(const QString& line);
@@ -54,6 +64,9 @@ private:
   QLabel* statusLabel_;
   QLabel* identityLabel_;
 
+  QDialog* traceDialog_ = nullptr;  // created on first use
+  QPlainTextEdit* traceView_ = nullptr;
+
   QThread* workerThread_;
   EngineWorker* worker_;
 };
@@ -0,0 +1,154 @@
+#include "handshake_guard.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+namespace {
+constexpr size_t kMacSize = 16;
+
+void put_be64(uint8_t* out, uint64_t v) {
+  for (int i = 0; i < 8; ++i) out[i] = static_cast<uint8_t>(v >> (8 * (7 - i)));
+}
+
+uint64_t get_be64(const uint8_t* in) {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; ++i) v = (v << 8) | in[i];
+  return v;
+}
+
+uint64_t nowSeconds() {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch())
+          .count());
+}
+
+bool leadingZeroBits(const uint8_t* digest, uint32_t bits) {
+  for (uint32_t i = 0; i < bits / 8; ++i)
+    if (digest[i]) return false;
+  return !(bits % 8) || !(digest[bits / 8] >> (8 - bits % 8));
+}
+}  // namespace
+
+HandshakeGuard::HandshakeGuard(const Config& config)
+    : config_(config),
+      puzzleBits_(std::min(config.puzzleBits, kMaxPuzzleBits)),
+      tokens_(config.freeHellosPerSecond),
+      refilled_(Clock::now()) {
+  if (RAND_bytes(secret_, sizeof(secret_)) != 1) throw std::runtime_error("RAND_bytes failed");
+}
+
+void HandshakeGuard::setPuzzleBits(uint32_t bits) { puzzleBits_ = std::min(bits, kMaxPuzzleBits); }
+
+bool HandshakeGuard::withinBudget() {
+  if (config_.freeHellosPerSecond <= 0) return false;
+  std::lock_guard<std::mutex> lk(budgetMtx_);
+  const auto now = Clock::now();
+  tokens_ = std::min(config_.freeHellosPerSecond,
+                     tokens_ + std::chrono::duration<double>(now - refilled_).count() * config_.freeHellosPerSecond);
+  refilled_ = now;
+  if (tokens_ < 1) return false;
+  tokens_ -= 1;
+  return true;
+}
+
+std::string HandshakeGuard::mac(uint64_t timestamp, uint32_t bits, const std::string& binding) const {
+  uint8_t head[9];
+  put_be64(head, timestamp);
+  head[8] = static_cast<uint8_t>(bits);
+  std::string cookie(reinterpret_cast<const char*>(head), sizeof(head));
+  const std::string input = cookie + binding;
+  uint8_t out[EVP_MAX_MD_SIZE];
+  unsigned int len = 0;
+  const bool ok = HMAC(EVP_sha256(), secret_, sizeof(secret_), reinterpret_cast<const uint8_t*>(input.data()),
+                       input.size(), out, &len);
+  if (!ok || len < kMacSize) throw std::runtime_error("HMAC-SHA256 failed");
+  cookie.append(reinterpret_cast<const char*>(out), kMacSize);
+  return cookie;
+}
+
+std::string HandshakeGuard::binding(std::initializer_list<std::string_view> fields) {
+  std::string out;
+  for (const auto field : fields) {
+    for (int i = 3; i >= 0; --i) out.push_back(static_cast<char>(field.size() >> (8 * i)));
+    out.append(field.data(), field.size());
+  }
+  return out;
+}
+
+bool HandshakeGuard::spend(const std::string& cookie, uint64_t expires, uint64_t now) {
+  std::lock_guard<std::mutex> lk(spentMtx_);
+  // Spending order tracks issue order to within a lifetime, so expired entries
+  // collect at the front.
+  while (!spentOrder_.empty() && spentOrder_.front().first < now) {
+    spent_.erase(spentOrder_.front().second);
+    spentOrder_.pop_front();
+  }
+  if (spent_.size() >= kSpentCookies || !spent_.insert(cookie).second) return false;
+  spentOrder_.emplace_back(expires, cookie);
+  return true;
+}
+
+HandshakeGuard::Verdict HandshakeGuard::check(const std::string& binding, const std::string& cookie,
+                                              uint64_t solution, std::string& challengeOut, uint32_t& bitsOut) {
+  if (cookie.empty()) {
+    if (withinBudget()) return kAdmit;
+    bitsOut = puzzleBits_;
+    challengeOut = mac(nowSeconds(), bitsOut, binding);
+    ++challenged_;
+    return kChallenge;
+  }
+  const auto* c = reinterpret_cast<const uint8_t*>(cookie.data());
+  const uint64_t issued = cookie.size() == kCookieSize ? get_be64(c) : 0;
+  const uint64_t now = nowSeconds();
+  const uint32_t bits = cookie.size() == kCookieSize ? c[8] : 0;
+  const uint64_t lifetime = static_cast<uint64_t>(config_.cookieLifetime.count());
+  const bool ok = cookie.size() == kCookieSize && issued <= now && now - issued <= lifetime &&
+                  CRYPTO_memcmp(mac(issued, bits, binding).data(), cookie.data(), kCookieSize) == 0 &&
+                  solved(cookie, solution, bits) && spend(cookie, issued + lifetime, now);
+  if (ok) return kAdmit;
+  ++rejected_;
+  return kReject;
+}
+
+bool HandshakeGuard::solved(const std::string& cookie, uint64_t solution, uint32_t bits) {
+  if (!bits) return true;
+  uint8_t tail[8];
+  put_be64(tail, solution);
+  uint8_t digest[EVP_MAX_MD_SIZE];
+  unsigned int len = 0;
+  EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+  const bool ok = ctx && EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr) &&
+                  EVP_DigestUpdate(ctx, cookie.data(), cookie.size()) && EVP_DigestUpdate(ctx, tail, sizeof(tail)) &&
+                  EVP_DigestFinal_ex(ctx, digest, &len);
+  EVP_MD_CTX_free(ctx);
+  if (!ok) throw std::runtime_error("SHA-256 failed");
+  return leadingZeroBits(digest, bits);
+}
+
+uint64_t HandshakeGuard::solve(const std::string& cookie, uint32_t bits) {
+  if (bits > kMaxPuzzleBits) throw std::runtime_error("Host puzzle too hard");
+  if (!bits) return 0;
+  // Hash the cookie once and clone the state for each candidate.
+  EVP_MD_CTX* base = EVP_MD_CTX_new();
+  EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+  bool ok = base && ctx && EVP_DigestInit_ex(base, EVP_sha256(), nullptr) &&
+            EVP_DigestUpdate(base, cookie.data(), cookie.size());
+  uint64_t solution = 0;
+  for (; ok; ++solution) {
+    uint8_t tail[8], digest[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    put_be64(tail, solution);
+    ok = EVP_MD_CTX_copy_ex(ctx, base) && EVP_DigestUpdate(ctx, tail, sizeof(tail)) &&
+         EVP_DigestFinal_ex(ctx, digest, &len);
+    if (ok && leadingZeroBits(digest, bits)) break;
+  }
+  EVP_MD_CTX_free(ctx);
+  EVP_MD_CTX_free(base);
+  if (!ok) throw std::runtime_error("SHA-256 failed");
+  return solution;
+}
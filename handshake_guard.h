@@ -0,0 +1,93 @@
+// Host-side defence against handshake floods, shared by every engine a host
+// runs (ConnectionEngine::setHandshakeGuard). Hellos within a rate budget go
+// straight through. Above it, a hello must echo a cookie the host issued:
+//   cookie = timestamp (8) || puzzle bits (1) || HMAC-SHA256(secret, ts || bits || binding)[0..16)
+// where binding is the hello's public keys (see binding()), so nothing is
+// stored per client but the cookies already spent.
+// With puzzle bits set, the client must also find a solution s such that
+// SHA-256(cookie || s) starts with that many zero bits. Checking a cookie costs
+// one HMAC and one hash, far less than the Ed25519 verify, KEM encapsulation
+// and Ed25519 sign that a hello otherwise triggers, so a flood is answered
+// with cheap challenges instead of public-key work.
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <initializer_list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <unordered_set>
+
+class HandshakeGuard {
+public:
+  struct Config {
+    // Hellos per second admitted without a cookie (burst of one second's
+    // worth); 0 demands a cookie from every hello.
+    double freeHellosPerSecond = 200;
+    // Proof-of-work difficulty sent with each cookie; 0 only proves that the
+    // client receives the host's frames. Each bit doubles the client's work.
+    uint32_t puzzleBits = 12;
+    std::chrono::seconds cookieLifetime{10};
+  };
+  static constexpr size_t kCookieSize = 25;
+  static constexpr uint32_t kMaxPuzzleBits = 28;  // clients refuse harder puzzles
+  // Replay filter capacity: spent cookies are kept until they expire, so this
+  // bounds the rate of accepted cookies to kSpentCookies per cookieLifetime.
+  // Beyond it new cookies are rejected rather than live ones forgotten.
+  static constexpr size_t kSpentCookies = 65536;
+
+  HandshakeGuard() : HandshakeGuard(Config{}) {}
+  explicit HandshakeGuard(const Config& config);
+
+  enum Verdict { kAdmit, kChallenge, kReject };
+
+  // Length-prefixed (BE32) concatenation of fields, so no two lists of keys
+  // give the same binding.
+  static std::string binding(std::initializer_list<std::string_view> fields);
+
+  // Called for each hello before any public-key work. binding is the hello's
+  // public keys, from binding(). kChallenge fills challengeOut (a cookie) and
+  // bitsOut; the client should resend the hello with them. kReject means a
+  // forged, expired, replayed or unsolved cookie, or a full replay filter.
+  Verdict check(const std::string& binding, const std::string& cookie, uint64_t solution,
+                std::string& challengeOut, uint32_t& bitsOut);
+
+  // Difficulty for cookies issued from now on (capped at kMaxPuzzleBits).
+  void setPuzzleBits(uint32_t bits);
+  uint32_t puzzleBits() const { return puzzleBits_; }
+
+  // Client side: the solution for a cookie; throws if bits > kMaxPuzzleBits.
+  static uint64_t solve(const std::string& cookie, uint32_t bits);
+  static bool solved(const std::string& cookie, uint64_t solution, uint32_t bits);
+
+  uint64_t challenged() const { return challenged_; }
+  uint64_t rejected() const { return rejected_; }
+
+private:
+  bool withinBudget();
+  std::string mac(uint64_t timestamp, uint32_t bits, const std::string& binding) const;
+  // False if the cookie was already spent, or the filter is full of live ones.
+  bool spend(const std::string& cookie, uint64_t expires, uint64_t now);
+
+  using Clock = std::chrono::steady_clock;
+  const Config config_;
+  uint8_t secret_[32];
+  std::atomic<uint32_t> puzzleBits_;
+
+  std::mutex budgetMtx_;
+  double tokens_;
+  Clock::time_point refilled_;
+
+  // Cookies already used, in spending order with the second each expires; a
+  // cookie is good for one handshake.
+  std::mutex spentMtx_;
+  std::unordered_set<std::string> spent_;
+  std::deque<std::pair<uint64_t, std::string>> spentOrder_;
+
+  std::atomic<uint64_t> challenged_{0};
+  std::atomic<uint64_t> rejected_{0};
+};
@@ -16,7 +16,6 @@
 #endif
 
 static constexpr uint32_t FILE_VERSION = 1;
-static constexpr uint32_t PBKDF2_ITERS = 200000;  // tweak as desired
 
 void IdentityStore::random_bytes(std::vector<uint8_t>& buf) {
   if (RAND_bytes(buf.data(), (int)buf.size()) != 1) {
@@ -62,7 +61,7 @@ void IdentityStore::create_profile(const std::string& path, const std::string& p
   gen_ed25519(out);
 
   std::vector<uint8_t> salt(16); random_bytes(salt);
-  std::vector<uint8_t> aes_key = pbkdf2_sha256(password, salt, PBKDF2_ITERS, 32);
+  std::vector<uint8_t> aes_key = pbkdf2_sha256(password, salt, kPbkdf2Iterations, 32);
 
   std::vector<uint8_t> nonce(AESGCMCrypto::NONCE_SIZE); random_bytes(nonce);
   AESGCMCrypto crypto(aes_key);
@@ -76,7 +75,7 @@ void IdentityStore::create_profile(const std::string& path, const std::string& p
   uint32_t v = htonl(FILE_VERSION);
   f.write(reinterpret_cast<const char*>(&v), 4);
 
-  uint32_t it = htonl(PBKDF2_ITERS);
+  uint32_t it = htonl(kPbkdf2Iterations);
   f.write(reinterpret_cast<const char*>(&it), 4);
 
   uint32_t sl = htonl((uint32_t)salt.size());
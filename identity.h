@@ -32,11 +32,15 @@ public:
   // Utility: SHA-256 fingerprint (hex, first 16 bytes shown typically)
   static std::string fingerprint_hex(const std::vector<uint8_t>& pub32);
 
-private:
-  static void gen_ed25519(Identity& out);
-  static void random_bytes(std::vector<uint8_t>& buf);
+  // Password -> profile key derivation (public so crypto_bench can time it).
+  // New profiles use kPbkdf2Iterations; the count is stored in each file.
+  static constexpr uint32_t kPbkdf2Iterations = 200000;
   static std::vector<uint8_t> pbkdf2_sha256(const std::string& password,
                                             const std::vector<uint8_t>& salt,
                                             uint32_t iters,
                                             size_t out_len);
+
+private:
+  static void gen_ed25519(Identity& out);
+  static void random_bytes(std::vector<uint8_t>& buf);
 };
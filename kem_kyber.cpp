@@ -1,6 +1,10 @@
 #include "kem_kyber.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
 #include <stdexcept>
 #include <cstring>
+#include <string>
 #include <vector>
 
 extern "C" {
@@ -14,10 +18,21 @@ KyberKEM::~KyberKEM() {
 
 void KyberKEM::init() {
   // Classic name used by liboqs; if your version prefers ML-KEM names, adjust here.
-  kem_ = OQS_KEM_new(OQS_KEM_alg_kyber_512);
-  if (!kem_) throw std::runtime_error("OQS_KEM_new kyber_512 failed");
+  init(OQS_KEM_alg_kyber_512);
 }
 
+void KyberKEM::init(kem::Alg alg) {
+  init(kem::oqsName(alg));
+}
+
+void KyberKEM::init(const char* alg) {
+  if (kem_) { OQS_KEM_free(kem_); kem_ = nullptr; }
+  kem_ = OQS_KEM_new(alg);
+  if (!kem_) throw std::runtime_error(std::string("OQS_KEM_new ") + alg + " failed");
+}
+
+const char* KyberKEM::name() const { return kem_ ? kem_->method_name : ""; }
+
 size_t KyberKEM::pk_len() const { return kem_->length_public_key; }
 size_t KyberKEM::sk_len() const { return kem_->length_secret_key; }
 size_t KyberKEM::ct_len() const { return kem_->length_ciphertext; }
@@ -51,3 +66,95 @@ void KyberKEM::decapsulate(const std::vector<uint8_t>& ct,
   if (OQS_KEM_decaps(kem_, ss.data(), ct.data(), sk.data()) != OQS_SUCCESS)
     throw std::runtime_error("OQS_KEM_decaps failed");
 }
+
+namespace kem {
+
+const char* name(Alg alg) {
+  switch (alg) {
+    case kKyber512: return "kyber-512";
+    case kMlKem512: return "ml-kem-512";
+    case kMlKem768: return "ml-kem-768";
+    case kMlKem1024: return "ml-kem-1024";
+    default: return "unknown";
+  }
+}
+
+const char* oqsName(Alg alg) {
+  switch (alg) {
+    case kKyber512: return OQS_KEM_alg_kyber_512;
+    case kMlKem512: return "ML-KEM-512";  // string names: older liboqs headers lack the macros
+    case kMlKem768: return "ML-KEM-768";
+    case kMlKem1024: return "ML-KEM-1024";
+    default: return "";
+  }
+}
+
+bool parse(const std::string& text, Alg& out) {
+  auto lower = [](std::string v) {
+    std::transform(v.begin(), v.end(), v.begin(), [](unsigned char c) { return std::tolower(c); });
+    return v;
+  };
+  for (Alg alg : kPreference) {
+    if (lower(text) == name(alg) || lower(text) == lower(oqsName(alg))) {
+      out = alg;
+      return true;
+    }
+  }
+  return false;
+}
+
+uint32_t supportedMask() {
+  static const uint32_t mask = [] {
+    uint32_t m = 0;
+    for (Alg alg : kPreference)
+      if (OQS_KEM_alg_is_enabled(oqsName(alg))) m |= 1u << alg;
+    return m;
+  }();
+  return mask;
+}
+
+Alg preferred(uint32_t mask) {
+  for (Alg alg : kPreference)
+    if (inMask(mask, alg)) return alg;
+  return kKyber512;
+}
+
+uint32_t pick(uint32_t localMask, uint32_t peerMask) {
+  if (peerMask == 0) return inMask(localMask, kKyber512) ? static_cast<uint32_t>(kKyber512) : 0;
+  for (Alg alg : kPreference)
+    if (inMask(localMask & peerMask, alg)) return alg;
+  return 0;
+}
+
+std::vector<Cost> measure(uint32_t mask, int iterations) {
+  using Clock = std::chrono::steady_clock;
+  auto median = [](std::vector<double>& v) {
+    std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+    return v[v.size() / 2];
+  };
+  std::vector<Cost> out;
+  iterations = std::max(iterations, 1);
+  for (Alg alg : kPreference) {
+    if (!inMask(mask, alg)) continue;
+    KyberKEM k;
+    k.init(alg);
+    std::vector<uint8_t> pk, sk, ct, ss;
+    std::vector<double> keypair, encaps, decaps;
+    for (int i = 0; i < iterations; ++i) {
+      auto t0 = Clock::now();
+      k.keypair(pk, sk);
+      auto t1 = Clock::now();
+      k.encapsulate(pk, ct, ss);
+      auto t2 = Clock::now();
+      k.decapsulate(ct, sk, ss);
+      auto t3 = Clock::now();
+      keypair.push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+      encaps.push_back(std::chrono::duration<double, std::micro>(t2 - t1).count());
+      decaps.push_back(std::chrono::duration<double, std::micro>(t3 - t2).count());
+    }
+    out.push_back({alg, median(keypair), median(encaps), median(decaps), k.pk_len(), k.ct_len()});
+  }
+  return out;
+}
+
+} // namespace kem
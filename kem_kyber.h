@@ -1,10 +1,53 @@
 #pragma once
 #include <vector>
+#include <cstddef>
 #include <cstdint>
+#include <string>
 
 // Forward-declare OQS type to avoid leaking headers here
 struct OQS_KEM;
 
+// KEM parameter sets the handshake can negotiate. The hello lists a bitmask
+// (1u << alg) and carries a public key for one of them; the host answers with
+// a ciphertext for that one, or asks for a retry with its own pick.
+namespace kem {
+
+enum Alg : uint32_t {
+  kKyber512  = 1,  // round-3 Kyber; what hosts without negotiation expect
+  kMlKem512  = 2,  // FIPS 203
+  kMlKem768  = 3,
+  kMlKem1024 = 4,
+};
+
+// Order in which a host picks among common sets: NIST's recommended level
+// first, then the others, then pre-standard Kyber.
+constexpr Alg kPreference[] = {kMlKem768, kMlKem1024, kMlKem512, kKyber512};
+
+const char* name(Alg alg);     // "ml-kem-768"
+const char* oqsName(Alg alg);  // liboqs method name
+// Accepts name() spellings and liboqs names, case-insensitively.
+bool parse(const std::string& text, Alg& out);
+
+// Bitmask of sets this liboqs build enables (probed once).
+uint32_t supportedMask();
+inline bool inMask(uint32_t mask, uint32_t alg) { return alg < 32 && (mask & (1u << alg)); }
+
+// First set of kPreference in mask (Kyber-512 if none).
+Alg preferred(uint32_t mask);
+// Host side: the set for this handshake. A peer that sent no mask gets
+// Kyber-512; 0 if nothing is common.
+uint32_t pick(uint32_t localMask, uint32_t peerMask);
+
+// Cost of one handshake's KEM work on this machine, per set (--kem-bench).
+struct Cost {
+  Alg alg;
+  double keypairUs, encapsUs, decapsUs;  // medians
+  size_t publicKeyBytes, ciphertextBytes;  // the KEM's share of the hello and the response
+};
+std::vector<Cost> measure(uint32_t mask, int iterations = 200);
+
+} // namespace kem
+
 class KyberKEM {
 public:
   KyberKEM();
@@ -12,6 +55,12 @@ public:
 
   // create a Kyber-512 KEM instance
   void init();
+  // create an instance of a negotiable parameter set
+  void init(kem::Alg alg);
+  // create an instance of any liboqs KEM by name (e.g. "Kyber768", "ML-KEM-768");
+  // throws if this liboqs build doesn't enable it
+  void init(const char* alg);
+  const char* name() const;
 
   // sizes
   size_t pk_len() const;
@@ -0,0 +1,122 @@
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+[[noreturn]] void fail(const std::string& what, const std::string& path, int err = errno) {
+  throw std::runtime_error(what + " " + path + ": " + std::strerror(err));
+}
+
+// msync/madvise want page-aligned ranges; widen [offset, offset+len) to pages.
+void pageRange(uint64_t offset, uint64_t len, uint64_t size, uint64_t& start, uint64_t& bytes) {
+  static const uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+  start = offset / page * page;
+  const uint64_t end = std::min(offset + len, size);
+  bytes = end > start ? end - start : 0;
+}
+
+// Allocates the first size bytes of fd's file. macOS has no posix_fallocate;
+// F_PREALLOCATE reserves space past the current end without changing the
+// size, so the caller's ftruncate still follows.
+void preallocate(int fd, uint64_t size, const std::string& path) {
+#ifdef __APPLE__
+  struct stat st {};
+  if (fstat(fd, &st) != 0) fail("stat", path);
+  if (static_cast<uint64_t>(st.st_size) >= size) return;
+  fstore_t store{};
+  store.fst_flags = F_ALLOCATECONTIG | F_ALLOCATEALL;
+  store.fst_posmode = F_PEOFPOSMODE;
+  store.fst_offset = 0;
+  store.fst_length = static_cast<off_t>(size - static_cast<uint64_t>(st.st_size));
+  if (fcntl(fd, F_PREALLOCATE, &store) == -1) {
+    store.fst_flags = F_ALLOCATEALL;
+    if (fcntl(fd, F_PREALLOCATE, &store) == -1) fail("allocate", path);
+  }
+#else
+  if (const int err = posix_fallocate(fd, 0, static_cast<off_t>(size))) fail("allocate", path, err);
+#endif
+}
+}  // namespace
+
+MappedFile::~MappedFile() { close(); }
+
+MappedFile::MappedFile(MappedFile&& other) noexcept { *this = std::move(other); }
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+  if (this != &other) {
+    close();
+    std::swap(fd_, other.fd_);
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+  }
+  return *this;
+}
+
+MappedFile MappedFile::openRead(const std::string& path) {
+  MappedFile f;
+  f.fd_ = ::open(path.c_str(), O_RDONLY);
+  if (f.fd_ < 0) fail("open", path);
+  struct stat st {};
+  if (fstat(f.fd_, &st) != 0) fail("stat", path);
+  f.size_ = static_cast<uint64_t>(st.st_size);
+  if (f.size_ == 0) return f;  // nothing to map
+  void* p = mmap(nullptr, f.size_, PROT_READ, MAP_SHARED, f.fd_, 0);
+  if (p == MAP_FAILED) fail("mmap", path);
+  f.data_ = static_cast<uint8_t*>(p);
+  madvise(p, f.size_, MADV_SEQUENTIAL);
+  return f;
+}
+
+MappedFile MappedFile::openWrite(const std::string& path, uint64_t size) {
+  MappedFile f;
+  f.fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0600);
+  if (f.fd_ < 0) fail("open", path);
+  // Reserve the blocks now: a write into a hole on a full disk would
+  // otherwise raise SIGBUS through the mapping instead of failing here.
+  if (size) preallocate(f.fd_, size, path);
+  if (ftruncate(f.fd_, static_cast<off_t>(size)) != 0) fail("ftruncate", path);
+  f.size_ = size;
+  if (size == 0) return f;
+  void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, f.fd_, 0);
+  if (p == MAP_FAILED) fail("mmap", path);
+  f.data_ = static_cast<uint8_t*>(p);
+  return f;
+}
+
+void MappedFile::sync(uint64_t offset, uint64_t len) {
+  if (!data_) return;
+  uint64_t start = 0, bytes = 0;
+  pageRange(offset, len, size_, start, bytes);
+  if (bytes && msync(data_ + start, bytes, MS_SYNC) != 0) {
+    throw std::runtime_error(std::string("msync: ") + std::strerror(errno));
+  }
+}
+
+void MappedFile::release(uint64_t offset, uint64_t len) {
+  if (!data_) return;
+  uint64_t start = 0, bytes = 0;
+  pageRange(offset, len, size_, start, bytes);
+  if (!bytes) return;
+  // Clean pages only: callers sync() written ranges first.
+  madvise(data_ + start, bytes, MADV_DONTNEED);
+#ifdef POSIX_FADV_DONTNEED
+  posix_fadvise(fd_, static_cast<off_t>(start), static_cast<off_t>(bytes), POSIX_FADV_DONTNEED);
+#endif
+}
+
+void MappedFile::close() {
+  if (data_) munmap(data_, size_);
+  if (fd_ >= 0) ::close(fd_);
+  data_ = nullptr;
+  fd_ = -1;
+  size_ = 0;
+}
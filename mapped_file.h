@@ -0,0 +1,42 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// RAII wrapper over an mmap file mapping, used by FileTransfer so chunks are
+// encrypted straight out of (and decrypted straight into) the page cache
+// instead of going through read()/write() copies.
+class MappedFile {
+public:
+  MappedFile() = default;
+  ~MappedFile();
+  MappedFile(MappedFile&& other) noexcept;
+  MappedFile& operator=(MappedFile&& other) noexcept;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  // Read-only, sequential-access mapping of an existing file. Throws std::runtime_error.
+  static MappedFile openRead(const std::string& path);
+  // Read-write shared mapping; the file is created if missing and sized to size
+  // bytes (existing contents are kept, so partial downloads can resume). The
+  // blocks are allocated up front, so a full disk throws here rather than
+  // faulting on a later write.
+  static MappedFile openWrite(const std::string& path, uint64_t size);
+
+  uint8_t* data() { return data_; }
+  const uint8_t* data() const { return data_; }
+  uint64_t size() const { return size_; }
+
+  // Flushes [offset, offset+len) to disk (msync, blocking).
+  void sync(uint64_t offset, uint64_t len);
+  // Drops [offset, offset+len) from this process and from the page cache once it
+  // has been consumed, so a multi-GB transfer doesn't evict everything else.
+  void release(uint64_t offset, uint64_t len);
+
+  void close();
+
+private:
+  int fd_ = -1;
+  uint8_t* data_ = nullptr;
+  uint64_t size_ = 0;
+};
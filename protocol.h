@@ -1,9 +1,25 @@
 #pragma once
+#include <cstddef>
 #include <cstdint>
 #include <vector>
 
 namespace protocol {
-constexpr uint32_t kVersion = 1;
+// Wire versions: v1 = protobuf ChatMessage inside Envelope, v2 = compact framing
+// (see wire_format.h). Peers advertise kVersion and use the lower of the two.
+constexpr uint32_t kVersionProtobuf = 1;
+constexpr uint32_t kVersionCompact = 2;
+constexpr uint32_t kVersion = kVersionCompact;
+
+// Compact-frame nonce prefixes, one per direction (see wire::compactNonce).
+constexpr uint32_t kDirectionClientToServer = 1;
+constexpr uint32_t kDirectionServerToClient = 2;
+
+// Largest frame a transport will accept; bigger length prefixes are treated as
+// a broken or hostile peer rather than allocated.
+constexpr size_t kMaxFrameSize = 16u * 1024 * 1024 + 1024;
+
+// Upper bound on ChatMessages packed into one Envelope bundle.
+constexpr size_t kMaxBundleMessages = 64;
 
 inline const std::vector<uint8_t>& hkdf_salt() {
   static const std::vector<uint8_t> k = {'E','2','E','E','-','v','1'};
@@ -14,5 +30,34 @@ inline const std::vector<uint8_t>& hkdf_info() {
   static const std::vector<uint8_t> k = {'A','E','S','-','2','5','6','-','G','C','M'};
   return k;
 }
+// Per-transfer file key: HKDF(session key, salt, info = transfer id).
+inline const std::vector<uint8_t>& file_hkdf_salt() {
+  static const std::vector<uint8_t> k = {'E','2','E','E','-','F','I','L','E','-','v','1'};
+  return k;
+}
+// Session key id for multi-recipient messages: HKDF(session key, salt, info ||
+// u32 direction), 8 bytes. Both ends of a session derive the same id for each
+// direction; it reveals nothing about the key.
+constexpr size_t kKeyIdSize = 8;
+inline const std::vector<uint8_t>& key_id_hkdf_info() {
+  static const std::vector<uint8_t> k = {'E','2','E','E','-','K','E','Y','-','I','D'};
+  return k;
+}
+// Compact-path ratchet (see Session::start_traffic): HKDF(session key, salt,
+// traffic info || u32 direction) is a direction's first epoch root; a root
+// yields its epoch's chain with the chain info and the next root with the
+// update info.
+inline const std::vector<uint8_t>& traffic_hkdf_info() {
+  static const std::vector<uint8_t> k = {'E','2','E','E','-','T','R','A','F','F','I','C'};
+  return k;
+}
+inline const std::vector<uint8_t>& chain_hkdf_info() {
+  static const std::vector<uint8_t> k = {'E','2','E','E','-','C','H','A','I','N'};
+  return k;
+}
+inline const std::vector<uint8_t>& key_update_hkdf_info() {
+  static const std::vector<uint8_t> k = {'E','2','E','E','-','K','E','Y','-','U','P','D','A','T','E'};
+  return k;
+}
 } // namespace protocol
 
@@ -1,17 +1,28 @@
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
 #include <iostream>
 #include <string>
 #include <vector>
 #include <thread>
 #include <atomic>
 #include <fstream>
+#include <memory>
+#include <mutex>
 
 #include <google/protobuf/stubs/common.h>
 
 #include "connection_engine.h"
+#include "engine_trace.h"
 #include "beast_ws_transport.h"
+#include "file_transfer.h"
+#include "protocol.h"
+#include "relay_route.h"
 
-static std::string ws_join(const std::string& base, const std::string& room) {
+static std::string ws_join(const std::string& base, const std::string& room, const std::string& user) {
   std::string url = base;
   if (url.rfind("http://", 0) == 0) url.replace(0, 4, "ws");
   else if (url.rfind("https://", 0) == 0) url.replace(0, 5, "wss");
@@ -24,13 +35,92 @@ static std::string ws_join(const std::string& base, const std::string& room) {
   }
   url += (url.find('?') == std::string::npos ? "?" : "&");
   url += "room=" + room;
+  if (!user.empty()) url += "&user=" + user;
   return url;
 }
 
+// Stdin lines, read on their own thread so the send loop can see whether more
+// are already waiting (a paste or a pipe) and bundle them. The reader is
+// detached: it may sit in getline until the process exits.
+class StdinLines {
+public:
+  StdinLines() : state_(std::make_shared<State>()) {
+    std::thread([st = state_]{
+      std::string line;
+      while (std::getline(std::cin, line)) {
+        std::lock_guard<std::mutex> lk(st->mtx);
+        st->lines.push_back(std::move(line));
+        st->cv.notify_one();
+      }
+      std::lock_guard<std::mutex> lk(st->mtx);
+      st->eof = true;
+      st->cv.notify_one();
+    }).detach();
+  }
+
+  // Blocks for the next line; false at end of input or once running clears.
+  bool next(std::string& line, const std::atomic<bool>& running) {
+    std::unique_lock<std::mutex> lk(state_->mtx);
+    while (state_->lines.empty() && !state_->eof && running)
+      state_->cv.wait_for(lk, std::chrono::milliseconds(100));
+    if (state_->lines.empty() || !running) return false;
+    line = std::move(state_->lines.front());
+    state_->lines.pop_front();
+    return true;
+  }
+
+  // True if another line is queued or arrives within window; lines of one
+  // paste follow each other by microseconds, typed ones by far more.
+  bool more(std::chrono::milliseconds window) {
+    std::unique_lock<std::mutex> lk(state_->mtx);
+    return state_->cv.wait_for(lk, window, [&]{ return !state_->lines.empty() || state_->eof; }) &&
+           !state_->lines.empty();
+  }
+
+private:
+  struct State {
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::string> lines;
+    bool eof = false;
+  };
+  std::shared_ptr<State> state_;
+};
+
 static void print_usage(const char* exe) {
-  std::cerr << "Usage: " << exe << " (--host|--connect) --relay <url> --room <name> [--password <pw>]\n";
+  std::cerr << "Usage: " << exe << " (--host|--connect) --relay <url> (--room <name> | --user <me> --to <peer>) [--password <pw>]\n"
+               "       [--no-compress] [--download-dir <dir>] [--max-file-mb N] [--trace] [--kem <set,...>]\n"
+               "       " << exe << " --kem-bench\n";
   std::cerr << "Examples:\n  " << exe << " --host --relay http://127.0.0.1:8080 --room alice --password mypass\n  "
-            << exe << " --connect --relay http://127.0.0.1:8080 --room alice --password mypass\n";
+            << exe << " --connect --relay http://127.0.0.1:8080 --room alice --password mypass\n  "
+            << exe << " --connect --relay http://127.0.0.1:8080 --user bob --to alice --password mypass\n";
+}
+
+// --kem-bench: what each KEM set enabled in this build costs a handshake here.
+static int kem_bench() {
+  std::cout << "kem            keypair us  encaps us  decaps us  handshake us  hello+resp bytes\n";
+  for (const auto& c : kem::measure(kem::supportedMask())) {
+    std::printf("%-13s %11.1f %10.1f %10.1f %13.1f %17zu\n", kem::name(c.alg), c.keypairUs, c.encapsUs,
+                c.decapsUs, c.keypairUs + c.encapsUs + c.decapsUs, c.publicKeyBytes + c.ciphertextBytes);
+  }
+  std::cout << "handshake us is the KEM work on the critical path (client keypair and decaps, host encaps);\n"
+               "bytes are the public key plus ciphertext. Default set: "
+            << kem::name(kem::preferred(kem::supportedMask())) << "\n";
+  return 0;
+}
+
+// "ml-kem-768,ml-kem-1024" -> bitmask; 0 if any name is unknown.
+static uint32_t parse_kems(const std::string& list) {
+  uint32_t mask = 0;
+  size_t start = 0;
+  while (start <= list.size()) {
+    const size_t comma = std::min(list.find(',', start), list.size());
+    kem::Alg alg;
+    if (!kem::parse(list.substr(start, comma - start), alg)) return 0;
+    mask |= 1u << alg;
+    start = comma + 1;
+  }
+  return mask;
 }
 
 static std::string url_host(const std::string& url) {
@@ -47,8 +137,15 @@ int main(int argc, char* argv[]) {
   std::string mode;
   std::string relay;
   std::string room;
+  std::string user;
+  std::string to;  // direct routing: frames go only to this user's sessions (relay_route.h)
   std::string pw;
   std::string id_path = "client.id";
+  bool compress = true;
+  std::string download_dir = "downloads";
+  uint64_t max_file_mb = 0;  // 0 = FileTransfer default
+  bool tracing = false;
+  uint32_t kems = 0;
   bool used_flags = false;
   for (int i=1; i<argc; ++i) {
     std::string a = argv[i];
@@ -56,8 +153,20 @@ int main(int argc, char* argv[]) {
     else if (a == "--connect") { mode = "connect"; used_flags = true; }
     else if ((a == "--relay" || a == "-r") && i+1 < argc) { relay = argv[++i]; used_flags = true; }
     else if ((a == "--room" || a == "-m") && i+1 < argc) { room = argv[++i]; used_flags = true; }
+    else if (a == "--user" && i+1 < argc) { user = argv[++i]; used_flags = true; }
+    else if (a == "--to" && i+1 < argc) { to = argv[++i]; used_flags = true; }
     else if ((a == "--password" || a == "-p") && i+1 < argc) { pw = argv[++i]; used_flags = true; }
     else if ((a == "--id-file" || a == "-i") && i+1 < argc) { id_path = argv[++i]; used_flags = true; }
+    else if (a == "--no-compress") { compress = false; used_flags = true; }
+    else if (a == "--download-dir" && i+1 < argc) { download_dir = argv[++i]; used_flags = true; }
+    else if (a == "--max-file-mb" && i+1 < argc) { max_file_mb = std::strtoull(argv[++i], nullptr, 10); used_flags = true; }
+    else if (a == "--trace") { tracing = true; used_flags = true; }
+    else if (a == "--kem" && i+1 < argc) {
+      kems = parse_kems(argv[++i]);
+      if (!(kems & kem::supportedMask())) { std::cerr << "--kem: unknown or disabled set in " << argv[i] << "\n"; return 1; }
+      used_flags = true;
+    }
+    else if (a == "--kem-bench") return kem_bench();
     else if (a == "--help" || a == "-h") { print_usage(argv[0]); return 0; }
   }
   if (!used_flags) {
@@ -65,12 +174,14 @@ int main(int argc, char* argv[]) {
     mode = argv[1]; relay = argv[2]; room = argv[3]; pw = argv[4];
   }
   if (mode != "host" && mode != "connect") { print_usage(argv[0]); return 1; }
+  if (!to.empty() && user.empty()) { print_usage(argv[0]); return 1; }
+  if (room.empty() && !to.empty()) room = "@" + user;  // a room of our own; peers reach us by name
   if (relay.empty() || room.empty()) { print_usage(argv[0]); return 1; }
   if (pw.empty()) {
     std::cerr << "Enter password for identity (client.id): ";
     std::getline(std::cin, pw);
   }
-  std::string url = ws_join(relay, room);
+  std::string url = ws_join(relay, room, user);
 
   ConnectionEngine engine;
   std::string fp; std::string err; bool created=false;
@@ -78,13 +189,49 @@ int main(int argc, char* argv[]) {
     std::cerr << "Identity error: " << err << "\n"; return 1;
   }
   std::cout << "Identity " << (created?"created":"loaded") << ", fp: " << fp.substr(0,16) << "...\n";
+  if (!compress) engine.setCompressionCodecs(0);
+  if (kems) engine.setKemAlgorithms(kems);
+  // --trace: per-stage engine timings, printed to stderr on exit.
+  trace::EngineTrace engine_trace;
+  if (tracing) engine.setTrace(&engine_trace);
 
   BeastWebSocketTransport ws;
   std::cout << "Connecting to " << url << " ...\n";
   if (!ws.connect_url(url)) { std::cerr << "WebSocket connect failed\n"; return 1; }
+  if (!user.empty()) {
+    // The relay opens our inbox only once we sign its challenge (relay_route.h).
+    std::vector<uint8_t> challenge;
+    if (!ws.recv(challenge) || challenge.size() != 1 + relay_route::kChallengeSize ||
+        challenge[0] != relay_route::kChallengeTag) {
+      std::cerr << "Relay sent no inbox challenge\n"; return 1;
+    }
+    std::vector<uint8_t> claim = engine.identity().pub;
+    const auto sig = IdentityStore::sign(engine.identity().priv, relay_route::claimMessage(user, challenge.data() + 1));
+    claim.insert(claim.end(), sig.begin(), sig.end());
+    if (!ws.send(claim)) { std::cerr << "Inbox claim failed\n"; return 1; }
+  }
 
-  auto send_fn = [&](const std::vector<uint8_t>& frame){ return ws.send(frame); };
-  auto recv_fn = [&](std::vector<uint8_t>& frame){ return ws.recv(frame); };
+  // Chat, file chunks and file ACKs are sent from different threads.
+  std::mutex send_mtx;
+  auto send_fn = [&](const std::vector<uint8_t>& frame){
+    std::lock_guard<std::mutex> lk(send_mtx);
+    if (to.empty()) return ws.send(frame);
+    std::vector<uint8_t> routed;
+    return relay_route::wrap(to, user, frame.data(), frame.size(), routed) && ws.send(routed);
+  };
+  // With --to, only frames routed from that user belong to this conversation.
+  auto recv_fn = [&](std::vector<uint8_t>& frame){
+    for (;;) {
+      if (!ws.recv(frame)) return false;
+      if (to.empty()) return true;
+      std::string dest, from;
+      const uint8_t* inner = nullptr;
+      size_t inner_size = 0;
+      if (!relay_route::parse(frame.data(), frame.size(), dest, from, inner, inner_size) || from != to) continue;
+      frame.assign(inner, inner + inner_size);
+      return true;
+    }
+  };
 
   std::string peer_fp;
   bool ok = false;
@@ -92,7 +239,8 @@ int main(int argc, char* argv[]) {
   else if (mode == "connect") ok = engine.runClientHandshake(send_fn, recv_fn, peer_fp, err);
   else { std::cerr << "mode must be host or connect\n"; return 1; }
   if (!ok) { std::cerr << "Handshake failed: " << err << "\n"; return 1; }
-  std::cout << "Peer fp: " << peer_fp.substr(0,16) << "...\n";
+  std::cout << "Peer fp: " << peer_fp.substr(0,16) << "... (" << kem::name(engine.kemAlgorithm()) << ", "
+            << aead::name(engine.aeadSuite()) << ")\n";
 
   // TOFU pinning: remember the first seen fingerprint
   auto load_pin = [&](const std::string& key)->std::string{
@@ -110,7 +258,7 @@ int main(int argc, char* argv[]) {
     bool exists=false; std::string k,v; while (fin >> k >> v) { if (k==key) { exists=true; break; } }
     if (!exists) { std::ofstream f("pins.txt", std::ios::app); f << key << " " << val << "\n"; }
   };
-  const std::string key = url_host(relay) + "#" + room;
+  const std::string key = url_host(relay) + "#" + (to.empty() ? room : "@" + to);
   const std::string pinned = load_pin(key);
   if (!pinned.empty() && pinned != peer_fp) {
     std::cerr << "[TOFU] Peer fingerprint changed for room '" << room << "'!\n";
@@ -123,34 +271,71 @@ int main(int argc, char* argv[]) {
     std::cout << "[TOFU] pinned peer for room '" << room << "'\n";
   }
 
-  std::cout << "Type messages, Ctrl-D to quit\n";
+  FileTransfer files(engine, send_fn, download_dir,
+                     [](const std::string& event){ std::cout << event << "\n"; });
+  files.setMaxIncomingSize(max_file_mb << 20);
+
+  std::cout << "Type messages, /send <path> to share a file, Ctrl-D to quit\n";
   std::atomic<bool> running{true};
   std::thread rx([&]{
+    std::string rx_err;
     while (running) {
       std::vector<uint8_t> frame;
-      if (!ws.recv(frame)) break;
-      std::string plain;
-      if (engine.parseAndDecryptMessage(frame, plain, err)) {
-        std::cout << "Peer: " << plain << "\n";
+      if (!recv_fn(frame)) {
+        const int hint = ws.reconnect_hint_ms();
+        if (hint >= 0) {
+          std::cout << "[relay] Relay is restarting; reconnect in ~" << hint << " ms\n";
+        }
+        break;
+      }
+      if (files.handleFrame(frame)) continue;
+      std::vector<std::string> plains;
+      if (engine.parseAndDecryptMessages(frame, plains, rx_err)) {
+        for (const auto& plain : plains) std::cout << "Peer: " << plain << "\n";
       } else {
-        std::cout << "[drop] " << err << "\n";
+        std::cout << "[drop] " << rx_err << "\n";
       }
     }
     running = false;
+    files.cancelAll();
   });
 
+  // Lines already buffered on stdin (e.g. a paste or a pipe) go out as one bundled frame.
   std::string line;
-  while (running && std::getline(std::cin, line)) {
-    if (line.empty()) continue;
+  std::vector<std::string> burst;
+  auto flush = [&]{
+    if (burst.empty()) return true;
     std::vector<uint8_t> frame;
-    if (!engine.encryptAndSerializeMessage(line, "cli", "peer", frame, err)) {
-      std::cerr << "Encrypt failed: " << err << "\n"; break;
+    if (!engine.encryptAndSerializeBundle(burst, "cli", to.empty() ? "peer" : to, frame, err)) {
+      std::cerr << "Encrypt failed: " << err << "\n"; return false;
+    }
+    burst.clear();
+    if (!trace::timed(engine.tracer(), trace::kSend, [&]{ return send_fn(frame); })) {
+      std::cerr << "Send failed\n"; return false;
+    }
+    return true;
+  };
+  std::vector<std::thread> senders;
+  StdinLines input;
+  while (input.next(line, running)) {
+    if (line.rfind("/send ", 0) == 0) {
+      if (!flush()) break;
+      const std::string path = line.substr(6);
+      senders.emplace_back([&files, path]{
+        std::string send_err;
+        if (!files.sendFile(path, send_err)) std::cout << "[file] " << path << ": " << send_err << "\n";
+      });
+      continue;
     }
-    if (!ws.send(frame)) { std::cerr << "Send failed\n"; break; }
+    if (!line.empty()) burst.push_back(line);
+    if (burst.size() < protocol::kMaxBundleMessages && input.more(std::chrono::milliseconds(2))) continue;
+    if (!flush()) break;
   }
+  for (auto& t : senders) t.join();
   running = false;
   ws.close();
   if (rx.joinable()) rx.join();
 
+  if (tracing) std::cerr << "\n[trace] engine stage timings\n" << engine_trace.dump();
   return 0;
 }
@@ -0,0 +1,401 @@
+#include "relay_cluster.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+enum : uint8_t { kHello = 1, kJoin = 2, kLeave = 3, kFrame = 4 };
+
+constexpr size_t kMaxMessage = 17u * 1024 * 1024;  // a max client frame plus header
+constexpr auto kRedialDelay = std::chrono::seconds(1);
+constexpr int kConnectTimeoutMs = 2000;
+
+bool readAll(int fd, uint8_t* p, size_t n) {
+  while (n) {
+    const ssize_t r = ::recv(fd, p, n, 0);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return false;
+    p += r;
+    n -= static_cast<size_t>(r);
+  }
+  return true;
+}
+
+// Plain socket()/accept() plus fcntl: SOCK_CLOEXEC and accept4 are Linux-only.
+int closeOnExec(int fd) {
+  if (fd >= 0) ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+}
+
+// A peer that went away must fail the send with EPIPE, not raise SIGPIPE.
+// relay_server also ignores SIGPIPE; SO_NOSIGPIPE covers embedders on macOS.
+void noSigPipe(int fd) {
+#ifdef SO_NOSIGPIPE
+  int one = 1;
+  ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#else
+  (void)fd;
+#endif
+}
+
+bool writeAll(int fd, const uint8_t* p, size_t n) {
+  while (n) {
+    const ssize_t w = ::send(fd, p, n, 0);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return false;
+    p += w;
+    n -= static_cast<size_t>(w);
+  }
+  return true;
+}
+
+// Blocking connect with a timeout so an unreachable peer cannot stall stop().
+int connectTo(const std::string& host, uint16_t port) {
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* res = nullptr;
+  if (::getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0) return -1;
+  int fd = -1;
+  for (addrinfo* ai = res; ai && fd < 0; ai = ai->ai_next) {
+    fd = closeOnExec(::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol));
+    if (fd < 0) continue;
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (::connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+      pollfd pfd{fd, POLLOUT, 0};
+      int err = 0;
+      socklen_t len = sizeof(err);
+      if (errno != EINPROGRESS || ::poll(&pfd, 1, kConnectTimeoutMs) != 1 ||
+          ::getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+        ::close(fd);
+        fd = -1;
+        continue;
+      }
+    }
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  }
+  ::freeaddrinfo(res);
+  return fd;
+}
+}  // namespace
+
+struct RelayCluster::Link {
+  int fd = -1;
+  std::string nodeId;  // peer's id once HELLO has been exchanged
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::deque<Message> queue;
+  uint64_t queuedBytes = 0;
+  bool closed = false;
+  std::thread writer;
+
+  explicit Link(int f) : fd(f) {
+    noSigPipe(fd);
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  ~Link() {
+    if (fd >= 0) ::close(fd);
+  }
+
+  // False if the link is closed or the queue is over limit (HELLO/JOIN/LEAVE
+  // bypass the limit: losing them would leave membership wrong).
+  bool enqueue(const Message& m, uint64_t limit, bool control) {
+    std::lock_guard<std::mutex> lk(mtx);
+    if (closed || (!control && queuedBytes + m->size() > limit)) return false;
+    queuedBytes += m->size();
+    queue.push_back(m);
+    cv.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lk(mtx);
+    if (closed) return;
+    closed = true;
+    ::shutdown(fd, SHUT_RDWR);
+    cv.notify_all();
+  }
+
+  void writeLoop() {
+    for (;;) {
+      Message m;
+      {
+        std::unique_lock<std::mutex> lk(mtx);
+        cv.wait(lk, [&]{ return closed || !queue.empty(); });
+        if (closed) return;
+        m = std::move(queue.front());
+        queue.pop_front();
+        queuedBytes -= m->size();
+      }
+      if (!writeAll(fd, m->data(), m->size())) {
+        close();
+        return;
+      }
+    }
+  }
+};
+
+bool RelayCluster::parsePeer(const std::string& spec, Peer& out) {
+  const auto at = spec.find('@');
+  const auto colon = spec.rfind(':');
+  if (at == std::string::npos || at == 0 || colon == std::string::npos || colon < at + 2) return false;
+  out.id = spec.substr(0, at);
+  out.host = spec.substr(at + 1, colon - at - 1);
+  const long port = std::strtol(spec.c_str() + colon + 1, nullptr, 10);
+  if (port <= 0 || port > 65535) return false;
+  out.port = static_cast<uint16_t>(port);
+  return true;
+}
+
+RelayCluster::RelayCluster(Options options, DeliverFn deliver, ForEachRoomFn forEachRoom)
+    : opt_(std::move(options)), deliver_(std::move(deliver)), forEachRoom_(std::move(forEachRoom)) {
+  if (opt_.nodeId.empty()) throw std::runtime_error("cluster: --node-id is required");
+  listenFd_ = closeOnExec(::socket(AF_INET, SOCK_STREAM, 0));
+  int one = 1;
+  ::setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(opt_.listenPort);
+  if (listenFd_ < 0 || ::bind(listenFd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+      ::listen(listenFd_, 64) != 0) {
+    const std::string err = std::strerror(errno);
+    if (listenFd_ >= 0) ::close(listenFd_);
+    throw std::runtime_error("cluster: cannot listen on port " + std::to_string(opt_.listenPort) + ": " + err);
+  }
+  threads_.emplace_back([this]{ acceptLoop(); });
+  for (const auto& peer : opt_.peers) {
+    if (opt_.nodeId < peer.id) threads_.emplace_back([this, peer]{ dialLoop(peer); });
+  }
+}
+
+RelayCluster::~RelayCluster() { stop(); }
+
+void RelayCluster::stop() {
+  if (stopping_.exchange(true)) return;
+  stopCv_.notify_all();
+  ::shutdown(listenFd_, SHUT_RDWR);  // wakes accept()
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    for (const auto& link : live_) link->close();
+  }
+  for (auto& t : threads_) t.join();
+  threads_.clear();
+  std::unique_lock<std::mutex> lk(stopMtx_);
+  stopCv_.wait(lk, [&]{ return inboundActive_ == 0; });
+  ::close(listenFd_);
+}
+
+RelayCluster::Message RelayCluster::encode(uint8_t type, const std::string& room, const uint8_t* body,
+                                           size_t size) {
+  const size_t roomLen = std::min<size_t>(room.size(), 0xffff);
+  const size_t len = 1 + 2 + roomLen + size;
+  auto msg = std::make_shared<std::vector<uint8_t>>(4 + len);
+  uint8_t* p = msg->data();
+  const uint32_t netLen = htonl(static_cast<uint32_t>(len));
+  std::memcpy(p, &netLen, 4);
+  p[4] = type;
+  p[5] = static_cast<uint8_t>(roomLen >> 8);
+  p[6] = static_cast<uint8_t>(roomLen);
+  std::memcpy(p + 7, room.data(), roomLen);
+  if (size) std::memcpy(p + 7 + roomLen, body, size);
+  return msg;
+}
+
+void RelayCluster::broadcast(const Message& msg) {
+  std::lock_guard<std::mutex> lk(mtx_);
+  for (const auto& kv : links_) kv.second->enqueue(msg, opt_.maxQueuedBytes, true);
+}
+
+void RelayCluster::roomJoined(const std::string& room) { broadcast(encode(kJoin, room, nullptr, 0)); }
+
+void RelayCluster::roomLeft(const std::string& room) { broadcast(encode(kLeave, room, nullptr, 0)); }
+
+size_t RelayCluster::forward(const std::string& room, const uint8_t* data, size_t size) {
+  std::vector<std::shared_ptr<Link>> targets;
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    auto it = remoteRooms_.find(room);
+    if (it == remoteRooms_.end()) return 0;
+    for (const auto& node : it->second) {
+      auto link = links_.find(node);
+      if (link != links_.end()) targets.push_back(link->second);
+    }
+  }
+  if (targets.empty()) return 0;
+  const Message msg = encode(kFrame, room, data, size);
+  size_t queued = 0;
+  for (const auto& link : targets) {
+    if (link->enqueue(msg, opt_.maxQueuedBytes, false)) ++queued;
+    else dropped_.fetch_add(1, std::memory_order_relaxed);
+  }
+  return queued;
+}
+
+bool RelayCluster::hasRemoteMembers(const std::string& room) const {
+  std::lock_guard<std::mutex> lk(mtx_);
+  return remoteRooms_.count(room) != 0;
+}
+
+size_t RelayCluster::linksUp() const {
+  std::lock_guard<std::mutex> lk(mtx_);
+  return links_.size();
+}
+
+void RelayCluster::acceptLoop() {
+  while (!stopping_) {
+    const int fd = closeOnExec(::accept(listenFd_, nullptr, nullptr));
+    if (fd < 0) {
+      if (stopping_) break;
+      if (errno != EINTR) std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      continue;
+    }
+    {
+      std::lock_guard<std::mutex> lk(stopMtx_);
+      ++inboundActive_;
+    }
+    std::thread([this, fd]{
+      runLink(std::make_shared<Link>(fd), std::string());
+      std::lock_guard<std::mutex> lk(stopMtx_);
+      --inboundActive_;
+      stopCv_.notify_all();
+    }).detach();
+  }
+}
+
+void RelayCluster::dialLoop(Peer peer) {
+  bool announced = false;
+  while (!stopping_) {
+    const int fd = connectTo(peer.host, peer.port);
+    if (fd >= 0) {
+      announced = false;
+      runLink(std::make_shared<Link>(fd), peer.id);
+    } else if (!announced) {
+      std::cerr << "[cluster] cannot reach " << peer.id << " at " << peer.host << ":" << peer.port
+                << "; retrying\n";
+      announced = true;
+    }
+    std::unique_lock<std::mutex> lk(stopMtx_);
+    stopCv_.wait_for(lk, kRedialDelay, [&]{ return stopping_.load(); });
+  }
+}
+
+// expectedId is the peer we dialed, or empty for an inbound connection, which
+// must come from a configured peer with a smaller id.
+void RelayCluster::runLink(const std::shared_ptr<Link>& link, const std::string& expectedId) {
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    if (stopping_) return;
+    live_.insert(link);
+  }
+  const Message hello = encode(kHello, std::string(), reinterpret_cast<const uint8_t*>(opt_.nodeId.data()),
+                               opt_.nodeId.size());
+  link->writer = std::thread([link]{ link->writeLoop(); });
+  if (!expectedId.empty()) link->enqueue(hello, opt_.maxQueuedBytes, true);
+
+  std::vector<uint8_t> buf;
+  for (;;) {
+    uint32_t netLen = 0;
+    if (!readAll(link->fd, reinterpret_cast<uint8_t*>(&netLen), 4)) break;
+    const size_t len = ntohl(netLen);
+    if (len < 3 || len > kMaxMessage) break;
+    buf.resize(len);
+    if (!readAll(link->fd, buf.data(), len)) break;
+    const uint8_t type = buf[0];
+    const size_t roomLen = (size_t(buf[1]) << 8) | buf[2];
+    if (3 + roomLen > len) break;
+    const std::string room(reinterpret_cast<const char*>(&buf[3]), roomLen);
+    const uint8_t* body = buf.data() + 3 + roomLen;
+    const size_t bodyLen = len - 3 - roomLen;
+
+    if (link->nodeId.empty()) {
+      // First message must be HELLO from the peer we expect (or any lower id).
+      const std::string id(reinterpret_cast<const char*>(body), bodyLen);
+      const bool known = std::any_of(opt_.peers.begin(), opt_.peers.end(),
+                                     [&](const Peer& p){ return p.id == id; });
+      if (type != kHello || (!expectedId.empty() && id != expectedId) ||
+          (expectedId.empty() && (!known || !(id < opt_.nodeId)))) {
+        std::cerr << "[cluster] rejecting link from '" << id << "'\n";
+        break;
+      }
+      link->nodeId = id;
+      if (expectedId.empty()) link->enqueue(hello, opt_.maxQueuedBytes, true);
+      registerLink(link);
+      continue;
+    }
+    handleMessage(*link, type, room, body, bodyLen);
+  }
+
+  link->close();
+  link->writer.join();
+  unregisterLink(link);
+}
+
+void RelayCluster::registerLink(const std::shared_ptr<Link>& link) {
+  std::shared_ptr<Link> old;
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    auto& slot = links_[link->nodeId];
+    old = slot;
+    slot = link;
+  }
+  if (old) old->close();
+  std::cout << "[cluster] link up: " << link->nodeId << std::endl;
+  // Registered first so no JOIN/LEAVE is missed; the snapshot may repeat a JOIN.
+  forEachRoom_([&](const std::string& room) {
+    link->enqueue(encode(kJoin, room, nullptr, 0), opt_.maxQueuedBytes, true);
+  });
+}
+
+void RelayCluster::unregisterLink(const std::shared_ptr<Link>& link) {
+  std::lock_guard<std::mutex> lk(mtx_);
+  live_.erase(link);
+  auto it = links_.find(link->nodeId);
+  if (link->nodeId.empty() || it == links_.end() || it->second != link) return;  // replaced or never up
+  links_.erase(it);
+  for (auto r = remoteRooms_.begin(); r != remoteRooms_.end();) {
+    r->second.erase(link->nodeId);
+    r = r->second.empty() ? remoteRooms_.erase(r) : std::next(r);
+  }
+  std::cout << "[cluster] link down: " << link->nodeId << std::endl;
+}
+
+void RelayCluster::handleMessage(Link& link, uint8_t type, const std::string& room, const uint8_t* body,
+                                 size_t size) {
+  switch (type) {
+    case kJoin: {
+      std::lock_guard<std::mutex> lk(mtx_);
+      remoteRooms_[room].insert(link.nodeId);
+      break;
+    }
+    case kLeave: {
+      std::lock_guard<std::mutex> lk(mtx_);
+      auto it = remoteRooms_.find(room);
+      if (it != remoteRooms_.end()) {
+        it->second.erase(link.nodeId);
+        if (it->second.empty()) remoteRooms_.erase(it);
+      }
+      break;
+    }
+    case kFrame:
+      deliver_(room, body, size);
+      break;
+    default:
+      break;  // unknown types are ignored so nodes can be upgraded one at a time
+  }
+}
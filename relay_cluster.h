@@ -0,0 +1,107 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Cluster mode for relay_server (--node-id, --cluster-port, --peer).
+//
+// Every node links to every other node over one TCP connection per pair (the
+// node with the smaller id dials, so there is exactly one), carrying
+// length-prefixed messages:
+//
+//   u32 length | u8 type | u16 room length | room | body
+//   HELLO (body = node id), JOIN, LEAVE, FRAME (body = the client's frame)
+//
+// A node announces JOIN when a room gets its first local member and LEAVE when
+// the last one goes, and replays JOIN for all its rooms whenever a link comes
+// up. A frame from a local client is forwarded only to nodes that have
+// members of that room; a FRAME from a peer is delivered to local members and
+// never forwarded again, so the full mesh cannot loop.
+//
+// Each link has its own writer thread and a bounded outbound queue, so a slow
+// or dead peer costs queued bytes, not blocked client sessions; frames that do
+// not fit are dropped and counted.
+class RelayCluster {
+public:
+  struct Peer {
+    std::string id;
+    std::string host;
+    uint16_t port = 0;
+  };
+
+  struct Options {
+    std::string nodeId;
+    uint16_t listenPort = 0;
+    std::vector<Peer> peers;
+    uint64_t maxQueuedBytes = 8ull << 20;  // per link
+  };
+
+  // Writes a frame received from another node to this node's members of room.
+  using DeliverFn = std::function<void(const std::string& room, const uint8_t* data, size_t size)>;
+  // Calls fn for every room with local members, under the caller's room lock so
+  // the snapshot is ordered with roomJoined()/roomLeft().
+  using ForEachRoomFn = std::function<void(const std::function<void(const std::string&)>& fn)>;
+
+  // Parses "id@host:port"; false if malformed.
+  static bool parsePeer(const std::string& spec, Peer& out);
+
+  // Throws std::runtime_error if the cluster port cannot be bound.
+  RelayCluster(Options options, DeliverFn deliver, ForEachRoomFn forEachRoom);
+  ~RelayCluster();
+  RelayCluster(const RelayCluster&) = delete;
+  RelayCluster& operator=(const RelayCluster&) = delete;
+
+  // Call under the relay's room lock when a room gains its first / loses its
+  // last local member.
+  void roomJoined(const std::string& room);
+  void roomLeft(const std::string& room);
+
+  // Queues data for every node with members in room; returns how many nodes.
+  size_t forward(const std::string& room, const uint8_t* data, size_t size);
+  bool hasRemoteMembers(const std::string& room) const;
+
+  size_t linksUp() const;
+  uint64_t droppedFrames() const { return dropped_.load(std::memory_order_relaxed); }
+  // Closes the listener and every link and joins the cluster threads.
+  void stop();
+
+private:
+  struct Link;
+  using Message = std::shared_ptr<const std::vector<uint8_t>>;
+
+  static Message encode(uint8_t type, const std::string& room, const uint8_t* body, size_t size);
+  void broadcast(const Message& msg);
+  void acceptLoop();
+  void dialLoop(Peer peer);
+  // Runs a connected link until it fails; blocks the calling thread.
+  void runLink(const std::shared_ptr<Link>& link, const std::string& expectedId);
+  void registerLink(const std::shared_ptr<Link>& link);
+  void unregisterLink(const std::shared_ptr<Link>& link);
+  void handleMessage(Link& link, uint8_t type, const std::string& room, const uint8_t* body, size_t size);
+
+  Options opt_;
+  DeliverFn deliver_;
+  ForEachRoomFn forEachRoom_;
+
+  mutable std::mutex mtx_;
+  std::map<std::string, std::shared_ptr<Link>> links_;       // by node id, once HELLO is exchanged
+  std::map<std::string, std::set<std::string>> remoteRooms_;  // room -> node ids with members
+
+  std::set<std::shared_ptr<Link>> live_;                       // every open link, for stop()
+  std::atomic<uint64_t> dropped_{0};
+
+  std::atomic<bool> stopping_{false};
+  std::mutex stopMtx_;
+  std::condition_variable stopCv_;
+  int inboundActive_ = 0;          // detached inbound link threads, guarded by stopMtx_
+  int listenFd_ = -1;
+  std::vector<std::thread> threads_;  // acceptor and one dialer per higher-id peer
+};
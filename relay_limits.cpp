@@ -0,0 +1,85 @@
+#include "relay_limits.h"
+
+#include <algorithm>
+
+namespace relay_limits {
+
+TokenBucket::TokenBucket(uint64_t ratePerSec, uint64_t burst)
+    : rate_(static_cast<double>(ratePerSec)),
+      burst_(static_cast<double>(burst)),
+      tokens_(static_cast<double>(burst)),
+      last_(std::chrono::steady_clock::now()) {}
+
+std::chrono::nanoseconds TokenBucket::take(uint64_t n) {
+  if (rate_ <= 0) return std::chrono::nanoseconds(0);
+  const auto now = std::chrono::steady_clock::now();
+  tokens_ = std::min(burst_, tokens_ + rate_ * std::chrono::duration<double>(now - last_).count());
+  last_ = now;
+  tokens_ -= static_cast<double>(n);
+  if (tokens_ >= 0) return std::chrono::nanoseconds(0);
+  return std::chrono::nanoseconds(static_cast<int64_t>(-tokens_ / rate_ * 1e9));
+}
+
+std::shared_ptr<MemoryBudget::Room> MemoryBudget::room(const std::string& name) {
+  std::lock_guard<std::mutex> lk(mtx_);
+  auto& slot = rooms_[name];
+  auto r = slot.lock();
+  if (!r) {
+    r = std::make_shared<Room>();
+    slot = r;
+  }
+  // Sweep rooms nobody uses any more while we hold the lock anyway.
+  for (auto it = rooms_.begin(); it != rooms_.end();) {
+    it = it->second.expired() ? rooms_.erase(it) : std::next(it);
+  }
+  return r;
+}
+
+namespace {
+bool reserveUpTo(std::atomic<uint64_t>& counter, uint64_t n, uint64_t limit) {
+  uint64_t cur = counter.load(std::memory_order_relaxed);
+  do {
+    if (cur + n > limit) return false;
+  } while (!counter.compare_exchange_weak(cur, cur + n, std::memory_order_relaxed));
+  return true;
+}
+}  // namespace
+
+bool MemoryBudget::reserve(Room& room, uint64_t n) {
+  if (!reserveUpTo(room.bytes, n, roomLimit_)) return false;
+  if (!reserveUpTo(used_, n, globalLimit_)) {
+    room.bytes.fetch_sub(n, std::memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+void MemoryBudget::release(Room& room, uint64_t n) {
+  room.bytes.fetch_sub(n, std::memory_order_relaxed);
+  used_.fetch_sub(n, std::memory_order_relaxed);
+}
+
+bool SessionLimiter::acquire(const std::string& ip) {
+  std::lock_guard<std::mutex> lk(mtx_);
+  if (total_ >= maxTotal_) return false;
+  auto& n = perIp_[ip];
+  if (n >= maxPerIp_) return false;
+  ++n;
+  ++total_;
+  return true;
+}
+
+void SessionLimiter::release(const std::string& ip) {
+  std::lock_guard<std::mutex> lk(mtx_);
+  auto it = perIp_.find(ip);
+  if (it == perIp_.end()) return;
+  if (--it->second == 0) perIp_.erase(it);
+  --total_;
+}
+
+size_t SessionLimiter::active() const {
+  std::lock_guard<std::mutex> lk(mtx_);
+  return total_;
+}
+
+}  // namespace relay_limits
@@ -0,0 +1,90 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// Resource limits for relay_server, so one client cannot exhaust a small host.
+//
+// MemoryBudget bounds the frame bytes the relay holds at once (read buffers
+// waiting to be broadcast), globally and per room. Sessions reserve before
+// each read, so the bound holds even for frames still arriving.
+// TokenBucket paces each session's reads; an empty bucket makes the session
+// stop reading, and TCP flow control pushes back on the client.
+// SessionLimiter caps open sessions in total and per client address.
+namespace relay_limits {
+
+struct Config {
+  uint64_t globalBytes = 256ull << 20;
+  uint64_t roomBytes = 32ull << 20;
+  size_t maxFrameBytes = 16u * 1024 * 1024 + 1024;  // protocol::kMaxFrameSize
+  uint64_t rateBytesPerSec = 4ull << 20;            // 0 = unlimited
+  uint64_t burstBytes = 0;                          // 0 = two max frames
+  size_t maxSessions = 1024;
+  size_t maxSessionsPerIp = 32;
+};
+
+class TokenBucket {
+public:
+  TokenBucket(uint64_t ratePerSec, uint64_t burst);
+
+  // Spends n tokens (the balance may go negative) and returns how long the
+  // caller should pause before the debt is repaid; zero if it is not in debt.
+  std::chrono::nanoseconds take(uint64_t n);
+
+private:
+  double rate_;
+  double burst_;
+  double tokens_;
+  std::chrono::steady_clock::time_point last_;
+};
+
+class MemoryBudget {
+public:
+  struct Room {
+    std::atomic<uint64_t> bytes{0};
+  };
+
+  MemoryBudget(uint64_t globalLimit, uint64_t roomLimit)
+      : globalLimit_(globalLimit), roomLimit_(roomLimit) {}
+
+  // Shared usage counter for a room; lives while any session holds it.
+  std::shared_ptr<Room> room(const std::string& name);
+
+  // All-or-nothing against both limits.
+  bool reserve(Room& room, uint64_t n);
+  void release(Room& room, uint64_t n);
+
+  uint64_t used() const { return used_.load(std::memory_order_relaxed); }
+  uint64_t limit() const { return globalLimit_; }
+
+private:
+  const uint64_t globalLimit_;
+  const uint64_t roomLimit_;
+  std::atomic<uint64_t> used_{0};
+  std::mutex mtx_;
+  std::map<std::string, std::weak_ptr<Room>> rooms_;
+};
+
+class SessionLimiter {
+public:
+  SessionLimiter(size_t maxTotal, size_t maxPerIp) : maxTotal_(maxTotal), maxPerIp_(maxPerIp) {}
+
+  bool acquire(const std::string& ip);
+  void release(const std::string& ip);
+  size_t active() const;
+  size_t limit() const { return maxTotal_; }
+
+private:
+  const size_t maxTotal_;
+  const size_t maxPerIp_;
+  mutable std::mutex mtx_;
+  size_t total_ = 0;
+  std::map<std::string, size_t> perIp_;
+};
+
+}  // namespace relay_limits
@@ -0,0 +1,192 @@
+#include "relay_metrics.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+namespace relay_metrics {
+namespace {
+
+struct HistogramSpec {
+  const char* name;
+  const char* help;
+  double scale;               // base unit -> exported unit
+  std::vector<uint64_t> le;   // bucket upper bounds in base units (+Inf implied)
+};
+
+const HistogramSpec kHistograms[kHistogramCount] = {
+  {"relay_fanout_recipients", "Recipients per broadcast frame.", 1.0,
+   {0, 1, 2, 4, 8, 16, 32, 64, 128}},
+  {"relay_write_latency_seconds", "Time spent in one WebSocket write.", 1e-9,
+   {50'000, 100'000, 250'000, 500'000, 1'000'000, 2'500'000, 5'000'000, 10'000'000,
+    25'000'000, 50'000'000, 100'000'000, 250'000'000, 1'000'000'000}},
+};
+constexpr size_t kMaxBuckets = 14;  // largest le list + the +Inf bucket
+
+struct alignas(64) Shard {
+  std::atomic<uint64_t> counters[kCounterCount] = {};
+  std::atomic<int64_t> gauges[kGaugeCount] = {};
+  std::atomic<uint64_t> buckets[kHistogramCount][kMaxBuckets] = {};
+  std::atomic<uint64_t> sums[kHistogramCount] = {};
+  std::atomic<uint64_t> counts[kHistogramCount] = {};
+};
+
+// Only the owning thread writes a shard, so updates are a load and a store
+// rather than a locked read-modify-write.
+template <typename T, typename D>
+inline void bump(std::atomic<T>& a, D d) {
+  a.store(a.load(std::memory_order_relaxed) + static_cast<T>(d), std::memory_order_relaxed);
+}
+
+struct Registry {
+  std::mutex mtx;
+  std::vector<std::unique_ptr<Shard>> all;
+  std::vector<Shard*> free;
+};
+
+Registry& registry() {
+  static Registry r;
+  return r;
+}
+
+// Borrowed for the thread's lifetime; the mutex handoff orders the previous
+// owner's writes before the next owner's.
+struct ShardLease {
+  Shard* shard;
+  ShardLease() {
+    auto& r = registry();
+    std::lock_guard<std::mutex> lk(r.mtx);
+    if (r.free.empty()) {
+      r.all.push_back(std::make_unique<Shard>());
+      shard = r.all.back().get();
+    } else {
+      shard = r.free.back();
+      r.free.pop_back();
+    }
+  }
+  ~ShardLease() {
+    auto& r = registry();
+    std::lock_guard<std::mutex> lk(r.mtx);
+    r.free.push_back(shard);
+  }
+};
+
+Shard& local() {
+  thread_local ShardLease lease;
+  return *lease.shard;
+}
+
+const auto kStartTime = std::chrono::system_clock::now();
+
+void header(std::ostringstream& os, const char* name, const char* help, const char* type) {
+  os << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type << '\n';
+}
+
+}  // namespace
+
+void add(Counter c, uint64_t n) { bump(local().counters[c], n); }
+
+void gauge(Gauge g, int64_t delta) { bump(local().gauges[g], delta); }
+
+void observe(Histogram h, uint64_t value) {
+  Shard& s = local();
+  const auto& le = kHistograms[h].le;
+  size_t b = 0;
+  while (b < le.size() && value > le[b]) ++b;
+  bump(s.buckets[h][b], 1);
+  bump(s.sums[h], value);
+  bump(s.counts[h], 1);
+}
+
+std::string render(const Levels& levels) {
+  uint64_t counters[kCounterCount] = {};
+  int64_t gauges[kGaugeCount] = {};
+  uint64_t buckets[kHistogramCount][kMaxBuckets] = {};
+  uint64_t sums[kHistogramCount] = {}, counts[kHistogramCount] = {};
+  {
+    auto& r = registry();
+    std::lock_guard<std::mutex> lk(r.mtx);
+    for (const auto& s : r.all) {
+      for (size_t i = 0; i < kCounterCount; ++i) counters[i] += s->counters[i].load(std::memory_order_relaxed);
+      for (size_t i = 0; i < kGaugeCount; ++i) gauges[i] += s->gauges[i].load(std::memory_order_relaxed);
+      for (size_t h = 0; h < kHistogramCount; ++h) {
+        for (size_t b = 0; b < kMaxBuckets; ++b) buckets[h][b] += s->buckets[h][b].load(std::memory_order_relaxed);
+        sums[h] += s->sums[h].load(std::memory_order_relaxed);
+        counts[h] += s->counts[h].load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  std::ostringstream os;
+  auto counter = [&](const char* name, const char* help, uint64_t v) {
+    header(os, name, help, "counter");
+    os << name << ' ' << v << '\n';
+  };
+  auto gaugeLine = [&](const char* name, const char* help, int64_t v) {
+    header(os, name, help, "gauge");
+    os << name << ' ' << v << '\n';
+  };
+
+  counter("relay_accepts_total", "TCP connections accepted.", counters[kAccepts]);
+  counter("relay_sessions_opened_total", "WebSocket sessions established.", counters[kSessionsOpened]);
+  counter("relay_frames_in_total", "Frames received from clients.", counters[kFramesIn]);
+  counter("relay_bytes_in_total", "Payload bytes received from clients.", counters[kBytesIn]);
+  counter("relay_frames_out_total", "Frames written to clients.", counters[kFramesOut]);
+  counter("relay_bytes_out_total", "Payload bytes written to clients.", counters[kBytesOut]);
+  header(os, "relay_frames_dropped_total", "Frames not delivered, by reason.", "counter");
+  os << "relay_frames_dropped_total{reason=\"no_peers\"} " << counters[kDroppedNoPeers] << '\n';
+  os << "relay_frames_dropped_total{reason=\"write_error\"} " << counters[kDroppedWriteError] << '\n';
+  os << "relay_frames_dropped_total{reason=\"store_full\"} " << counters[kDroppedStoreFull] << '\n';
+  os << "relay_frames_dropped_total{reason=\"memory_budget\"} " << counters[kDroppedBudget] << '\n';
+  os << "relay_frames_dropped_total{reason=\"cluster_queue_full\"} " << levels.clusterDropped << '\n';
+  os << "relay_frames_dropped_total{reason=\"bad_route\"} " << counters[kDroppedBadRoute] << '\n';
+  counter("relay_frames_routed_total", "Frames routed to a named user instead of the room.", counters[kRoutedFrames]);
+  counter("relay_frames_stored_total", "Frames queued for absent room members.", counters[kStoredFrames]);
+  counter("relay_frames_replayed_total", "Queued frames delivered on join.", counters[kReplayedFrames]);
+  counter("relay_sessions_rejected_total", "WebSocket upgrades refused by session limits.", counters[kSessionsRejected]);
+  counter("relay_inbox_claims_rejected_total", "Sessions closed for failing to prove they own their user name.",
+          counters[kInboxClaimsRejected]);
+  counter("relay_cluster_frames_out_total", "Frames forwarded to other relay nodes.", counters[kClusterFramesOut]);
+  counter("relay_cluster_frames_in_total", "Frames received from other relay nodes.", counters[kClusterFramesIn]);
+  header(os, "relay_throttled_seconds_total", "Time sessions spent paused by the read rate limit.", "counter");
+  os << "relay_throttled_seconds_total " << counters[kThrottledNanos] * 1e-9 << '\n';
+
+  gaugeLine("relay_active_sessions", "Open WebSocket sessions.", gauges[kActiveSessions]);
+  gaugeLine("relay_session_limit", "Maximum concurrent WebSocket sessions.", static_cast<int64_t>(levels.sessionLimit));
+  gaugeLine("relay_cluster_links", "Connected peer relay nodes.", static_cast<int64_t>(levels.clusterLinks));
+  gaugeLine("relay_rooms", "Rooms with at least one session.", static_cast<int64_t>(levels.rooms));
+  gaugeLine("relay_routable_users", "User names with at least one session.",
+            static_cast<int64_t>(levels.routableUsers));
+  gaugeLine("relay_stored_bytes", "Bytes held in the store-and-forward log.", static_cast<int64_t>(levels.storedBytes));
+  gaugeLine("relay_buffered_bytes", "Frame bytes held in memory against the budget.",
+            static_cast<int64_t>(levels.bufferedBytes));
+  gaugeLine("relay_buffer_budget_bytes", "Global memory budget for buffered frames.",
+            static_cast<int64_t>(levels.bufferBudget));
+  gaugeLine("relay_writes_in_flight", "WebSocket writes currently executing.", gauges[kWritesInFlight]);
+  gaugeLine("relay_write_waiters",
+            "Writers blocked behind another sender on the same session (the relay's queue depth).",
+            gauges[kWriteWaiters]);
+  header(os, "relay_start_time_seconds", "Unix time the relay started.", "gauge");
+  os << "relay_start_time_seconds "
+     << std::chrono::duration_cast<std::chrono::seconds>(kStartTime.time_since_epoch()).count() << '\n';
+
+  for (size_t h = 0; h < kHistogramCount; ++h) {
+    const auto& spec = kHistograms[h];
+    header(os, spec.name, spec.help, "histogram");
+    uint64_t cumulative = 0;
+    for (size_t b = 0; b <= spec.le.size(); ++b) {
+      cumulative += buckets[h][b];
+      os << spec.name << "_bucket{le=\"";
+      if (b < spec.le.size()) os << spec.le[b] * spec.scale; else os << "+Inf";
+      os << "\"} " << cumulative << '\n';
+    }
+    os << spec.name << "_sum " << sums[h] * spec.scale << '\n';
+    os << spec.name << "_count " << counts[h] << '\n';
+  }
+  return os.str();
+}
+
+}  // namespace relay_metrics
@@ -0,0 +1,71 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Relay instrumentation served on GET /metrics (Prometheus text format).
+//
+// Every thread (one per connection) writes to its own cache-line-aligned shard
+// with plain relaxed loads/stores, so the broadcast path never contends on a
+// shared counter; a scrape sums all shards. Shards are recycled when a thread
+// exits, so totals survive and the shard count tracks peak concurrency.
+namespace relay_metrics {
+
+enum Counter : size_t {
+  kAccepts,             // TCP connections accepted
+  kSessionsOpened,      // successful WebSocket upgrades
+  kFramesIn,
+  kBytesIn,
+  kFramesOut,
+  kBytesOut,
+  kDroppedNoPeers,      // frame arrived in a room with nobody else in it
+  kDroppedWriteError,   // per-recipient write failures
+  kDroppedStoreFull,    // nobody in the room and the store refused the frame
+  kStoredFrames,        // appended to the store-and-forward log (relay_store.h)
+  kReplayedFrames,      // delivered from the store to a joining session
+  kDroppedBudget,       // frame did not fit the global or per-room memory budget
+  kSessionsRejected,    // upgrade refused by the session limits
+  kThrottledNanos,      // time sessions spent paused by their read rate limit
+  kClusterFramesOut,    // frames queued to other relay nodes (relay_cluster.h), per node
+  kClusterFramesIn,     // frames received from other relay nodes
+  kRoutedFrames,        // frames with a routing header (relay_route.h) sent to a user's inbox
+  kDroppedBadRoute,     // malformed routing header, or from is not the sender's user=
+  kInboxClaimsRejected, // session closed: it could not prove it owns its user= (relay_route.h)
+  kCounterCount
+};
+
+// Up/down values; each increment and its matching decrement happen on the same
+// thread, so they shard like counters and sum to the current level.
+enum Gauge : size_t {
+  kActiveSessions,
+  kWritesInFlight,
+  kWriteWaiters,        // writers queued behind another sender on the same session
+  kGaugeCount
+};
+
+enum Histogram : size_t {
+  kFanout,              // recipients per broadcast frame
+  kWriteLatency,        // nanoseconds per ws.write
+  kHistogramCount
+};
+
+void add(Counter c, uint64_t n = 1);
+void gauge(Gauge g, int64_t delta);
+void observe(Histogram h, uint64_t value);
+
+// Levels owned by other parts of the relay, sampled at scrape time.
+struct Levels {
+  size_t rooms = 0;
+  size_t routableUsers = 0;     // distinct user= names with an open session
+  uint64_t storedBytes = 0;     // store-and-forward backlog
+  uint64_t bufferedBytes = 0;   // frame bytes held against the memory budget
+  uint64_t bufferBudget = 0;
+  size_t sessionLimit = 0;
+  size_t clusterLinks = 0;       // connected peer nodes
+  uint64_t clusterDropped = 0;   // frames a full peer link queue refused
+};
+
+// Prometheus exposition of everything above plus levels.
+std::string render(const Levels& levels);
+
+}  // namespace relay_metrics
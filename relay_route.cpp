@@ -0,0 +1,53 @@
+#include "relay_route.h"
+
+namespace relay_route {
+
+bool isRouted(const uint8_t* data, size_t size) {
+  return size >= 3 && data[0] == kRouteTag;
+}
+
+bool wrap(const std::string& to, const std::string& from, const uint8_t* frame, size_t size,
+          std::vector<uint8_t>& out) {
+  if (to.size() > kMaxNameSize || from.size() > kMaxNameSize) return false;
+  out.clear();
+  out.reserve(3 + to.size() + from.size() + size);
+  out.push_back(kRouteTag);
+  out.push_back(static_cast<uint8_t>(to.size()));
+  out.insert(out.end(), to.begin(), to.end());
+  out.push_back(static_cast<uint8_t>(from.size()));
+  out.insert(out.end(), from.begin(), from.end());
+  out.insert(out.end(), frame, frame + size);
+  return true;
+}
+
+bool parse(const uint8_t* data, size_t size, std::string& to, std::string& from,
+           const uint8_t*& inner, size_t& innerSize) {
+  if (!isRouted(data, size)) return false;
+  const size_t toLen = data[1];
+  if (2 + toLen + 1 > size) return false;
+  const size_t fromLen = data[2 + toLen];
+  const size_t headerSize = 3 + toLen + fromLen;
+  if (headerSize > size) return false;
+  to.assign(reinterpret_cast<const char*>(data + 2), toLen);
+  from.assign(reinterpret_cast<const char*>(data + 3 + toLen), fromLen);
+  inner = data + headerSize;
+  innerSize = size - headerSize;
+  return true;
+}
+
+size_t stripRecipient(uint8_t* data, size_t /*size*/) {
+  // tag, 0 written just before the from length; the recipient bytes drop off the front.
+  const size_t offset = data[1];
+  data[offset] = kRouteTag;
+  data[offset + 1] = 0;
+  return offset;
+}
+
+std::vector<uint8_t> claimMessage(const std::string& user, const uint8_t* challenge) {
+  const std::string prefix = "E2EE-RELAY-INBOX-v1|" + user + "|";
+  std::vector<uint8_t> msg(prefix.begin(), prefix.end());
+  msg.insert(msg.end(), challenge, challenge + kChallengeSize);
+  return msg;
+}
+
+}  // namespace relay_route
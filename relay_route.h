@@ -0,0 +1,52 @@
+// Direct routing header: an unencrypted prefix that tells relay_server which
+// user's sessions should get a frame, instead of everyone in the room.
+//
+// Layout:
+//   u8  tag = kRouteTag
+//   u8  to length   | to    recipient's user= name; the relay empties it
+//   u8  from length | from  sender's user= name; the relay checks it
+//   ... the frame (handshake, compact record, Envelope, file chunk)
+//
+// The relay delivers the same bytes with the recipient removed (to length 0),
+// so a client with one connection can tell its conversations apart by sender.
+// Like kVersionCompact and kFileChunkTag the tag is below 0x08, which no
+// protobuf message can start with, so unrouted frames are never mistaken for
+// routed ones.
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace relay_route {
+
+constexpr uint8_t kRouteTag = 0x04;
+constexpr size_t kMaxNameSize = 255;
+
+bool isRouted(const uint8_t* data, size_t size);
+
+// out = header || frame. False if either name is longer than kMaxNameSize.
+bool wrap(const std::string& to, const std::string& from, const uint8_t* frame, size_t size,
+          std::vector<uint8_t>& out);
+
+// Parses the header; inner points at the wrapped frame.
+bool parse(const uint8_t* data, size_t size, std::string& to, std::string& from,
+           const uint8_t*& inner, size_t& innerSize);
+
+// Relay side: rewrites the header in place so that data[offset..size) is the
+// same frame addressed to nobody, and returns offset. data must parse.
+size_t stripRecipient(uint8_t* data, size_t size);
+
+// Inbox claim. Before a session with user= joins, the relay sends it one frame,
+// kChallengeTag || kChallengeSize random bytes, and the session answers with
+// its Ed25519 public key (32) || a signature over claimMessage (64). The first
+// key to claim a name on a relay owns it there; sessions holding any other key
+// are closed, so nobody else receives that user's frames or drains their backlog.
+constexpr uint8_t kChallengeTag = 0x06;
+constexpr size_t kChallengeSize = 32;
+constexpr size_t kClaimSize = 32 + 64;
+
+std::vector<uint8_t> claimMessage(const std::string& user, const uint8_t* challenge);
+
+}  // namespace relay_route
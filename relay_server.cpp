@@ -1,7 +1,42 @@
 // WebSocket relay: clients connect to /ws?room=<name> and frames fan out to the
-// other participants in that room. A GET /health endpoint returns "ok".
+// other participants in that room. A GET /health endpoint returns "ok" and
+// GET /metrics serves Prometheus counters (relay_metrics.h).
+//
+// With --store-dir, frames sent while nobody else is in the room are queued on
+// disk and replayed to the next session that joins (relay_store.h). Clients may
+// add user=<id> so their own queued frames are not replayed back to them.
+//
+// A session with user= must first prove it holds the Ed25519 key that owns the
+// name (relay_route.h inbox claim): the first key to claim a name keeps it,
+// persisted under --store-dir, so no one else can read that user's inbox or
+// drain its stored backlog.
+//
+// Frame sizes, buffered bytes (global and per room), per-session read rate and
+// session counts are bounded by relay_limits.h; see print_usage for the flags.
+//
+// SIGTERM drains: the listener closes at once (with --reuse-port a replacement
+// process can already be bound to the same port), then open sessions are sent
+// a Close (1012 "service restart", reason "reconnect <ms>" with a random delay)
+// spread over --drain-seconds so clients do not all come back at once.
+//
+// With --node-id/--cluster-port/--peer several relays form a cluster: a frame
+// also goes to every other node with members in the room (relay_cluster.h), so
+// members of one room may be spread across nodes behind any load balancer.
+//
+// A frame that starts with a routing header (relay_route.h) goes only to the
+// sessions whose user= matches its recipient, wherever their room is: each
+// user's sessions are also indexed in g_rooms under inbox_key(user), so the
+// store and the cluster handle inboxes exactly like rooms.
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <random>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -10,86 +45,362 @@
 #include <memory>
 #include <sstream>
 
+#include <sys/socket.h>
+
 #include <boost/asio.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/websocket.hpp>
 #include <boost/beast/version.hpp>
 
+#include <openssl/rand.h>
+
+#include "identity.h"
+#include "relay_cluster.h"
+#include "relay_limits.h"
+#include "relay_metrics.h"
+#include "relay_route.h"
+#include "relay_store.h"
+
 using tcp = boost::asio::ip::tcp;
 namespace http = boost::beast::http;
 namespace websocket = boost::beast::websocket;
 
 struct WsSession; // fwd
 
+// Rooms and user inboxes; inbox keys start with a NUL, which room names may not.
 static std::unordered_map<std::string, std::vector<std::weak_ptr<WsSession>>> g_rooms;
 static std::mutex g_rooms_mtx;
+static std::unique_ptr<RelayStore> g_store;  // null unless --store-dir
+static relay_limits::Config g_limits;
+static std::unique_ptr<relay_limits::MemoryBudget> g_budget;
+static std::unique_ptr<relay_limits::SessionLimiter> g_sessions;
+static std::atomic<bool> g_draining{false};
+static std::unique_ptr<RelayCluster> g_cluster;  // null unless --node-id
+
+// Reads are reserved against the budget in chunks; the first is small so idle
+// sessions blocked in a read hold little.
+static constexpr size_t kFirstReadChunk = 4 * 1024;
+static constexpr size_t kReadChunk = 64 * 1024;
+static constexpr uint64_t kFrameRateCost = 64;  // per-frame charge so tiny frames are not free
+
+static std::string inbox_key(const std::string& user) { return std::string(1, '\0') + user; }
+static bool is_inbox_key(const std::string& key) { return !key.empty() && key[0] == '\0'; }
+
+// Owner key of each claimed user= name. With --store-dir the claims are appended
+// to <dir>/inbox_owners ("<hex name> <hex key>" per line) and survive restarts;
+// without it they last as long as the process.
+static std::unordered_map<std::string, std::vector<uint8_t>> g_owners;
+static std::mutex g_owners_mtx;
+static std::string g_owners_path;
+
+static std::string to_hex(const uint8_t* data, size_t size) {
+  static const char* digits = "0123456789abcdef";
+  std::string out;
+  for (size_t i = 0; i < size; ++i) {
+    out.push_back(digits[data[i] >> 4]);
+    out.push_back(digits[data[i] & 15]);
+  }
+  return out;
+}
+
+static bool from_hex(const std::string& hex, std::string& out) {
+  if (hex.size() % 2) return false;
+  out.clear();
+  for (size_t i = 0; i < hex.size(); i += 2) {
+    const std::string byte = hex.substr(i, 2);
+    if (byte.find_first_not_of("0123456789abcdef") != std::string::npos) return false;
+    out.push_back(static_cast<char>(std::stoi(byte, nullptr, 16)));
+  }
+  return true;
+}
+
+static void load_owners(const std::string& path) {
+  g_owners_path = path;
+  std::ifstream in(path);
+  std::string name_hex, key_hex, name, key;
+  while (in >> name_hex >> key_hex) {
+    if (from_hex(name_hex, name) && from_hex(key_hex, key) && key.size() == 32)
+      g_owners.emplace(name, std::vector<uint8_t>(key.begin(), key.end()));
+  }
+}
+
+// True if pub owns user, claiming the name for it when nobody has yet.
+static bool claim_owner(const std::string& user, const std::vector<uint8_t>& pub) {
+  std::lock_guard<std::mutex> lk(g_owners_mtx);
+  auto it = g_owners.find(user);
+  if (it != g_owners.end()) return it->second == pub;
+  g_owners.emplace(user, pub);
+  if (!g_owners_path.empty()) {
+    std::ofstream out(g_owners_path, std::ios::app);
+    out << to_hex(reinterpret_cast<const uint8_t*>(user.data()), user.size()) << ' '
+        << to_hex(pub.data(), pub.size()) << '\n';
+    if (!out.flush()) std::cerr << "[relay] cannot record inbox owner in " << g_owners_path << "\n";
+  }
+  return true;
+}
+
+static void deliver(const std::string& key, const std::string& sender, boost::asio::const_buffer data,
+                    const WsSession* self, bool forward);
 
 struct WsSession : public std::enable_shared_from_this<WsSession> {
   websocket::stream<tcp::socket> ws;
   std::string room;
+  std::string user;      // optional user= query value; tags frames in the store
+  std::string inbox;     // inbox_key(user), or empty when the session is not routable
+  std::string ip;        // holds a SessionLimiter slot until the session ends
+  std::shared_ptr<relay_limits::MemoryBudget::Room> usage;
+  std::mutex write_mtx;  // several room members may broadcast to this session at once
+  bool closing = false;  // guarded by write_mtx; no frames may follow the drain Close
 
   explicit WsSession(tcp::socket s) : ws(std::move(s)) {}
 
-  void do_run(std::string room_name) {
-    room = std::move(room_name);
-    {
-      std::lock_guard<std::mutex> lk(g_rooms_mtx);
-      auto& vec = g_rooms[room];
-      // clean expired
-      vec.erase(std::remove_if(vec.begin(), vec.end(),
-               [](auto& w){ return w.expired(); }), vec.end());
-      vec.push_back(this->shared_from_this());
+  void leave_room() {
+    std::lock_guard<std::mutex> lk(g_rooms_mtx);
+    for (const std::string* key : {&room, &inbox}) {
+      auto it = g_rooms.find(*key);
+      if (it == g_rooms.end()) continue;
+      it->second.erase(std::remove_if(it->second.begin(), it->second.end(),
+            [&](auto& w){ return w.expired() || w.lock().get() == this; }), it->second.end());
+      if (it->second.empty()) {
+        g_rooms.erase(it);
+        if (g_cluster) g_cluster->roomLeft(*key);
+      }
     }
-    // Read loop (blocking, simple)
+  }
+
+  // Writes one frame to this session unless it is draining.
+  void send_frame(boost::asio::const_buffer data) {
+    boost::system::error_code wec;
+    relay_metrics::gauge(relay_metrics::kWriteWaiters, +1);
+    std::lock_guard<std::mutex> wlk(write_mtx);
+    relay_metrics::gauge(relay_metrics::kWriteWaiters, -1);
+    if (closing) return;
+    relay_metrics::gauge(relay_metrics::kWritesInFlight, +1);
+    const auto t0 = std::chrono::steady_clock::now();
+    ws.binary(true);
+    ws.write(data, wec);
+    relay_metrics::observe(relay_metrics::kWriteLatency,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count());
+    relay_metrics::gauge(relay_metrics::kWritesInFlight, -1);
+    if (wec) {
+      relay_metrics::add(relay_metrics::kDroppedWriteError);
+      std::cerr << "[ws] write error: " << wec.message() << "\n";
+    } else {
+      relay_metrics::add(relay_metrics::kFramesOut);
+      relay_metrics::add(relay_metrics::kBytesOut, data.size());
+    }
+  }
+
+  // Drain: leave the room so peers stop writing here (their frames go to the
+  // store, if enabled), then put a Close frame straight onto the socket. Beast's
+  // close() would also read, racing this session's own read loop; the client's
+  // Close reply ends that loop instead.
+  void begin_drain(unsigned reconnect_ms) {
+    leave_room();
+    std::lock_guard<std::mutex> lk(write_mtx);
+    if (closing) return;
+    closing = true;
+    const std::string reason = "reconnect " + std::to_string(reconnect_ms);
+    std::vector<uint8_t> frame{0x88, static_cast<uint8_t>(2 + reason.size()), 0x03, 0xF4};  // FIN|Close, 1012
+    frame.insert(frame.end(), reason.begin(), reason.end());
+    boost::system::error_code ec;
+    boost::asio::write(ws.next_layer(), boost::asio::buffer(frame), ec);
+  }
+
+  // For clients that never answer the Close: unblocks the read loop.
+  void force_close() { ::shutdown(ws.next_layer().native_handle(), SHUT_RDWR); }
+
+  // Inbox claim (relay_route.h): challenges the session to sign with the key
+  // that owns user=. Runs before the session joins anything.
+  bool prove_owner() {
+    std::vector<uint8_t> challenge(1 + relay_route::kChallengeSize);
+    challenge[0] = relay_route::kChallengeTag;
+    if (RAND_bytes(challenge.data() + 1, static_cast<int>(relay_route::kChallengeSize)) != 1) return false;
+    boost::system::error_code ec;
+    ws.binary(true);
+    ws.write(boost::asio::buffer(challenge), ec);
+    if (ec) return false;
+    ws.read_message_max(relay_route::kClaimSize);
+    boost::beast::flat_buffer reply;
+    ws.read(reply, ec);
+    if (ec || reply.size() != relay_route::kClaimSize) return false;
+    const auto* claim = static_cast<const uint8_t*>(reply.data().data());
+    const std::vector<uint8_t> pub(claim, claim + 32), sig(claim + 32, claim + relay_route::kClaimSize);
+    return IdentityStore::verify(pub, relay_route::claimMessage(user, challenge.data() + 1), sig) &&
+           claim_owner(user, pub);
+  }
+
+  void do_run(std::string room_name, std::string user_id) {
+    room = std::move(room_name);
+    user = std::move(user_id);
+    relay_metrics::add(relay_metrics::kSessionsOpened);
+    relay_metrics::gauge(relay_metrics::kActiveSessions, +1);
     boost::system::error_code ec;
     ws.set_option(websocket::stream_base::timeout::suggested(boost::beast::role_type::server));
+    if (!user.empty() && !prove_owner()) {
+      relay_metrics::add(relay_metrics::kInboxClaimsRejected);
+      ws.close(websocket::close_reason(websocket::close_code::policy_error, "user name owned by another key"), ec);
+      relay_metrics::gauge(relay_metrics::kActiveSessions, -1);
+      g_sessions->release(ip);
+      return;
+    }
+    ws.read_message_max(g_limits.maxFrameBytes);
     ws.binary(true);
+    usage = g_budget->room(room);
+    relay_limits::TokenBucket bucket(g_limits.rateBytesPerSec, g_limits.burstBytes);
+    auto pace = [&](uint64_t bytes) {
+      const auto wait = bucket.take(bytes);
+      if (wait.count() <= 0) return;
+      relay_metrics::add(relay_metrics::kThrottledNanos, static_cast<uint64_t>(wait.count()));
+      std::this_thread::sleep_for(wait);
+    };
+    auto join = [&](const std::string& key) {
+      auto add_member = [&]{
+        std::lock_guard<std::mutex> lk(g_rooms_mtx);
+        auto& vec = g_rooms[key];
+        // clean expired
+        vec.erase(std::remove_if(vec.begin(), vec.end(),
+                 [](auto& w){ return w.expired(); }), vec.end());
+        if (vec.empty() && g_cluster) g_cluster->roomJoined(key);
+        vec.push_back(this->shared_from_this());
+      };
+      if (!g_store) {
+        add_member();
+        return;
+      }
+      // Hold our write lock through the replay so live frames from peers that
+      // see us in the room queue behind the backlog instead of overtaking it.
+      std::lock_guard<std::mutex> wlk(write_mtx);
+      const size_t replayed = g_store->join(key, user, add_member, [&](const RelayStore::Record& rec) {
+        boost::system::error_code wec;
+        ws.write(boost::asio::buffer(rec.payload), wec);
+        if (wec) return false;
+        relay_metrics::add(relay_metrics::kFramesOut);
+        relay_metrics::add(relay_metrics::kBytesOut, rec.payload.size());
+        return true;
+      });
+      relay_metrics::add(relay_metrics::kReplayedFrames, replayed);
+    };
+    join(room);
+    if (!user.empty() && user.size() <= relay_route::kMaxNameSize) {
+      inbox = inbox_key(user);
+      join(inbox);
+    }
+    // Read loop (blocking, simple)
 
     for (;;) {
+      // Reserve budget before each chunk so frames still arriving count too. A
+      // frame that does not fit is read to its end and discarded.
       boost::beast::flat_buffer buffer;
-      ws.read(buffer, ec);
-      if (ec == websocket::error::closed || ec == boost::asio::error::eof) break;
-      if (ec) { std::cerr << "[ws] read error: " << ec.message() << "\n"; break; }
-
-      // broadcast to others in the room
-      std::vector<std::shared_ptr<WsSession>> peers;
-      {
-        std::lock_guard<std::mutex> lk(g_rooms_mtx);
-        auto it = g_rooms.find(room);
-        if (it != g_rooms.end()) {
-          for (auto& w : it->second) {
-            if (auto p = w.lock()) {
-              if (p.get() != this) peers.push_back(p);
-            }
-          }
-          // also drop dead weak_ptrs
-          it->second.erase(std::remove_if(it->second.begin(), it->second.end(),
-                [](auto& w){ return w.expired(); }), it->second.end());
+      uint64_t reserved = 0;
+      bool over_budget = false;
+      do {
+        const size_t chunk = reserved ? kReadChunk : kFirstReadChunk;
+        const uint64_t need = buffer.size() + chunk > reserved ? buffer.size() + chunk - reserved : 0;
+        if (!over_budget && g_budget->reserve(*usage, need)) reserved += need;
+        else over_budget = true;
+        if (over_budget) buffer.clear();
+        const size_t n = ws.read_some(buffer, chunk, ec);
+        if (ec) break;
+        pace(n);
+      } while (!ws.is_message_done());
+      if (ec) {
+        g_budget->release(*usage, reserved);
+        if (ec != websocket::error::closed && ec != boost::asio::error::eof && !g_draining) {
+          std::cerr << "[ws] read error: " << ec.message() << "\n";
         }
+        break;
       }
-      for (auto& p : peers) {
-        boost::system::error_code wec;
-        p->ws.binary(true);
-        p->ws.write(buffer.data(), wec);
-        if (wec) {
-          std::cerr << "[ws] write error: " << wec.message() << "\n";
+      pace(kFrameRateCost);
+      relay_metrics::add(relay_metrics::kFramesIn);
+      if (over_budget) {
+        g_budget->release(*usage, reserved);
+        relay_metrics::add(relay_metrics::kDroppedBudget);
+        continue;
+      }
+      const size_t frame_bytes = buffer.size();
+      g_budget->release(*usage, reserved - frame_bytes);
+      reserved = frame_bytes;
+      relay_metrics::add(relay_metrics::kBytesIn, frame_bytes);
+
+      auto* frame = static_cast<uint8_t*>(buffer.data().data());
+      if (relay_route::isRouted(frame, frame_bytes)) {
+        // Only the sender's own name is accepted as from, so recipients can
+        // trust it as far as they trust user= itself.
+        std::string to, from;
+        const uint8_t* inner = nullptr;
+        size_t inner_size = 0;
+        if (!relay_route::parse(frame, frame_bytes, to, from, inner, inner_size) || to.empty() || from != user) {
+          relay_metrics::add(relay_metrics::kDroppedBadRoute);
+        } else {
+          relay_metrics::add(relay_metrics::kRoutedFrames);
+          const size_t offset = relay_route::stripRecipient(frame, frame_bytes);
+          deliver(inbox_key(to), user, boost::asio::const_buffer(frame + offset, frame_bytes - offset), this, true);
         }
+      } else {
+        deliver(room, user, buffer.cdata(), this, true);
       }
+      g_budget->release(*usage, reserved);
     }
 
-    // on exit: remove self from room
-    {
-      std::lock_guard<std::mutex> lk(g_rooms_mtx);
-      auto it = g_rooms.find(room);
-      if (it != g_rooms.end()) {
-        it->second.erase(std::remove_if(it->second.begin(), it->second.end(),
-              [&](auto& w){ return w.expired() || w.lock().get() == this; }), it->second.end());
-        if (it->second.empty()) g_rooms.erase(it);
+    leave_room();
+    relay_metrics::gauge(relay_metrics::kActiveSessions, -1);
+    g_sessions->release(ip);
+  }
+};
+
+// Writes data to every member of key (a room or an inbox) except self. With
+// forward set it also goes to cluster nodes that have members; if nobody has,
+// it is stored for the next member when the store is enabled.
+static void deliver(const std::string& key, const std::string& sender, boost::asio::const_buffer data,
+                    const WsSession* self, bool forward) {
+  const auto* bytes = static_cast<const uint8_t*>(data.data());
+  std::vector<std::shared_ptr<WsSession>> peers;
+  auto find_peers = [&]{
+    std::lock_guard<std::mutex> lk(g_rooms_mtx);
+    auto it = g_rooms.find(key);
+    if (it != g_rooms.end()) {
+      for (auto& w : it->second) {
+        if (auto p = w.lock()) {
+          if (p.get() != self) peers.push_back(p);
+        }
       }
+      // also drop dead weak_ptrs
+      it->second.erase(std::remove_if(it->second.begin(), it->second.end(),
+            [](auto& w){ return w.expired(); }), it->second.end());
     }
+    return !peers.empty();
+  };
+  // Members on other cluster nodes count as present too: nothing is stored.
+  bool remote = false;
+  auto find_members = [&]{
+    const bool local = find_peers();
+    remote = forward && g_cluster && g_cluster->hasRemoteMembers(key);
+    return local || remote;
+  };
+  if (g_store) {
+    switch (g_store->appendIfAbsent(key, sender, bytes, data.size(), find_members)) {
+      case RelayStore::Append::kStored: relay_metrics::add(relay_metrics::kStoredFrames); break;
+      case RelayStore::Append::kDropped: relay_metrics::add(relay_metrics::kDroppedStoreFull); break;
+      case RelayStore::Append::kPeersPresent: break;
+    }
+  } else if (!find_members()) {
+    relay_metrics::add(relay_metrics::kDroppedNoPeers);
   }
-};
+  // Queued first: the node links write on their own threads, in parallel
+  // with the local writes below.
+  if (remote) relay_metrics::add(relay_metrics::kClusterFramesOut, g_cluster->forward(key, bytes, data.size()));
+  relay_metrics::observe(relay_metrics::kFanout, peers.size());
+  for (auto& p : peers) p->send_frame(data);
+}
+
+// RelayCluster callback: a frame forwarded by another node goes to the local
+// members of the room or inbox, or to the store if they all left meanwhile.
+static void deliver_from_cluster(const std::string& key, const uint8_t* data, size_t size) {
+  relay_metrics::add(relay_metrics::kClusterFramesIn);
+  deliver(key, std::string(), boost::asio::const_buffer(data, size), nullptr, false);
+}
 
 static std::string url_decode(const std::string& s) {
   std::string out; out.reserve(s.size());
@@ -128,11 +439,35 @@ void do_http(tcp::socket socket) {
   http::read(socket, buffer, req, ec);
   if (ec) { /* ignore */ }
 
-  // health
+  // health: "ok" (or "draining", with 503) on the first line, then current usage
   if (req.method()==http::verb::get && req.target()=="/health") {
-    http::response<http::string_body> res{http::status::ok, req.version()};
+    http::response<http::string_body> res{g_draining ? http::status::service_unavailable : http::status::ok,
+                                          req.version()};
     res.set(http::field::content_type, "text/plain");
-    res.body() = "ok";
+    res.body() = std::string(g_draining ? "draining" : "ok") + "\nsessions " + std::to_string(g_sessions->active()) + "/" + std::to_string(g_sessions->limit()) +
+                 "\nbuffered_bytes " + std::to_string(g_budget->used()) + "/" + std::to_string(g_budget->limit()) +
+                 "\nstored_bytes " + std::to_string(g_store ? g_store->totalBytes() : 0) + "\n";
+    res.prepare_payload();
+    http::write(socket, res);
+    socket.shutdown(tcp::socket::shutdown_send, ec);
+    return;
+  }
+
+  if (req.method()==http::verb::get && req.target()=="/metrics") {
+    relay_metrics::Levels levels;
+    {
+      std::lock_guard<std::mutex> lk(g_rooms_mtx);
+      for (const auto& kv : g_rooms) ++(is_inbox_key(kv.first) ? levels.routableUsers : levels.rooms);
+    }
+    levels.storedBytes = g_store ? g_store->totalBytes() : 0;
+    levels.bufferedBytes = g_budget->used();
+    levels.bufferBudget = g_budget->limit();
+    levels.sessionLimit = g_sessions->limit();
+    levels.clusterLinks = g_cluster ? g_cluster->linksUp() : 0;
+    levels.clusterDropped = g_cluster ? g_cluster->droppedFrames() : 0;
+    http::response<http::string_body> res{http::status::ok, req.version()};
+    res.set(http::field::content_type, "text/plain; version=0.0.4");
+    res.body() = relay_metrics::render(levels);
     res.prepare_payload();
     http::write(socket, res);
     socket.shutdown(tcp::socket::shutdown_send, ec);
@@ -154,12 +489,41 @@ void do_http(tcp::socket socket) {
     }
     std::string room = get_query_value(target, "room");
     if (room.empty()) room = "default";
+    std::string user = get_query_value(target, "user");
+    if (room.find('\0') != std::string::npos || user.find('\0') != std::string::npos) {
+      http::response<http::string_body> res{http::status::bad_request, req.version()};
+      res.set(http::field::content_type, "text/plain");
+      res.body() = "room and user may not contain NUL";
+      res.prepare_payload();
+      http::write(socket, res, ec);
+      socket.shutdown(tcp::socket::shutdown_send, ec);
+      return;
+    }
+
+    const auto remote = socket.remote_endpoint(ec);
+    std::string ip = ec ? std::string() : remote.address().to_string();
+    if (g_draining || !g_sessions->acquire(ip)) {
+      relay_metrics::add(relay_metrics::kSessionsRejected);
+      http::response<http::string_body> res{http::status::service_unavailable, req.version()};
+      res.set(http::field::content_type, "text/plain");
+      res.set(http::field::retry_after, "5");
+      res.body() = g_draining ? "draining" : "too many sessions";
+      res.prepare_payload();
+      http::write(socket, res, ec);
+      socket.shutdown(tcp::socket::shutdown_send, ec);
+      return;
+    }
 
     auto session = std::make_shared<WsSession>(std::move(socket));
+    session->ip = ip;
     // Accept handshake
     session->ws.accept(req, ec);
-    if (ec) { std::cerr << "[ws] accept: " << ec.message() << "\n"; return; }
-    std::thread([session, room]{ session->do_run(room); }).detach();
+    if (ec) {
+      g_sessions->release(ip);
+      std::cerr << "[ws] accept: " << ec.message() << "\n";
+      return;
+    }
+    std::thread([session, room, user]{ session->do_run(room, user); }).detach();
     return;
   }
 
@@ -172,18 +536,179 @@ void do_http(tcp::socket socket) {
   socket.shutdown(tcp::socket::shutdown_send, ec);
 }
 
+// Spread over window so the reconnects (and re-handshakes) arrive spread too;
+// the reason also carries a random delay for clients that honour it.
+static constexpr unsigned kReconnectJitterMs = 5000;
+
+static std::vector<std::shared_ptr<WsSession>> all_sessions() {
+  std::vector<std::shared_ptr<WsSession>> all;
+  std::lock_guard<std::mutex> lk(g_rooms_mtx);
+  for (auto& kv : g_rooms) {
+    for (auto& w : kv.second) {
+      if (auto p = w.lock()) all.push_back(p);
+    }
+  }
+  // A session with a user= is listed under its room and its inbox.
+  std::sort(all.begin(), all.end());
+  all.erase(std::unique(all.begin(), all.end()), all.end());
+  return all;
+}
+
+static void drain_sessions(std::chrono::milliseconds window, std::chrono::milliseconds grace) {
+  auto all = all_sessions();
+  std::cout << "[relay] Draining " << all.size() << " sessions over " << window.count() << " ms" << std::endl;
+  std::mt19937 rng(std::random_device{}());
+  std::uniform_int_distribution<unsigned> jitter(0, kReconnectJitterMs);
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < all.size(); ++i) {
+    std::this_thread::sleep_until(start + std::chrono::milliseconds(window.count() * static_cast<int64_t>(i) /
+                                                                     static_cast<int64_t>(all.size())));
+    all[i]->begin_drain(jitter(rng));
+  }
+  // Upgrades that were already in flight when the listener closed.
+  for (auto& late : all_sessions()) {
+    late->begin_drain(jitter(rng));
+    all.push_back(late);
+  }
+  auto wait_idle = [](std::chrono::milliseconds limit) {
+    const auto deadline = std::chrono::steady_clock::now() + limit;
+    while (g_sessions->active() > 0 && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+  };
+  wait_idle(grace);
+  for (auto& s : all) s->force_close();
+  wait_idle(std::chrono::seconds(1));
+}
+
+static void print_usage(const char* exe) {
+  std::cerr << "Usage: " << exe << " [port] [--store-dir <dir>] [--store-quota-mb N]"
+               " [--store-ttl-hours H] [--store-fsync-ms MS]\n"
+               "       [--mem-budget-mb N] [--room-budget-mb N] [--max-frame-kb N]"
+               " [--rate-kbps N] [--burst-kb N] [--max-sessions N] [--max-sessions-per-ip N]\n"
+               "       [--reuse-port] [--drain-seconds N]\n"
+               "       [--node-id ID --cluster-port P [--peer ID@HOST:PORT]...]\n";
+}
+
 int main(int argc, char* argv[]) {
   try {
     unsigned short port = 8080;
-    if (argc >= 2) port = static_cast<unsigned short>(std::atoi(argv[1]));
+    RelayStore::Options store_opts;
+    bool reuse_port = false;
+    std::chrono::seconds drain_window{10};
+    RelayCluster::Options cluster_opts;
+    for (int i = 1; i < argc; ++i) {
+      std::string a = argv[i];
+      if (a == "--store-dir" && i + 1 < argc) store_opts.dir = argv[++i];
+      else if (a == "--store-quota-mb" && i + 1 < argc) store_opts.roomQuotaBytes = std::strtoull(argv[++i], nullptr, 10) << 20;
+      else if (a == "--store-ttl-hours" && i + 1 < argc) store_opts.ttl = std::chrono::hours(std::atoi(argv[++i]));
+      else if (a == "--store-fsync-ms" && i + 1 < argc) store_opts.fsyncInterval = std::chrono::milliseconds(std::atoi(argv[++i]));
+      else if (a == "--mem-budget-mb" && i + 1 < argc) g_limits.globalBytes = std::strtoull(argv[++i], nullptr, 10) << 20;
+      else if (a == "--room-budget-mb" && i + 1 < argc) g_limits.roomBytes = std::strtoull(argv[++i], nullptr, 10) << 20;
+      else if (a == "--max-frame-kb" && i + 1 < argc) g_limits.maxFrameBytes = std::strtoull(argv[++i], nullptr, 10) << 10;
+      else if (a == "--rate-kbps" && i + 1 < argc) g_limits.rateBytesPerSec = std::strtoull(argv[++i], nullptr, 10) << 10;
+      else if (a == "--burst-kb" && i + 1 < argc) g_limits.burstBytes = std::strtoull(argv[++i], nullptr, 10) << 10;
+      else if (a == "--max-sessions" && i + 1 < argc) g_limits.maxSessions = std::strtoull(argv[++i], nullptr, 10);
+      else if (a == "--max-sessions-per-ip" && i + 1 < argc) g_limits.maxSessionsPerIp = std::strtoull(argv[++i], nullptr, 10);
+      else if (a == "--reuse-port") reuse_port = true;
+      else if (a == "--drain-seconds" && i + 1 < argc) drain_window = std::chrono::seconds(std::atoi(argv[++i]));
+      else if (a == "--node-id" && i + 1 < argc) cluster_opts.nodeId = argv[++i];
+      else if (a == "--cluster-port" && i + 1 < argc) cluster_opts.listenPort = static_cast<uint16_t>(std::atoi(argv[++i]));
+      else if (a == "--peer" && i + 1 < argc) {
+        RelayCluster::Peer peer;
+        if (!RelayCluster::parsePeer(argv[++i], peer)) { print_usage(argv[0]); return 1; }
+        cluster_opts.peers.push_back(peer);
+      }
+      else if (a == "--help" || a == "-h") { print_usage(argv[0]); return 0; }
+      else if (!a.empty() && a[0] != '-') port = static_cast<unsigned short>(std::atoi(a.c_str()));
+      else { print_usage(argv[0]); return 1; }
+    }
+    if (g_limits.maxFrameBytes == 0 || g_limits.globalBytes < g_limits.roomBytes || g_limits.roomBytes < kReadChunk ||
+        g_limits.maxSessions == 0 || g_limits.maxSessionsPerIp == 0) {
+      print_usage(argv[0]);
+      return 1;
+    }
+    if (g_limits.burstBytes == 0) g_limits.burstBytes = 2 * static_cast<uint64_t>(g_limits.maxFrameBytes);
+    g_budget = std::make_unique<relay_limits::MemoryBudget>(g_limits.globalBytes, g_limits.roomBytes);
+    g_sessions = std::make_unique<relay_limits::SessionLimiter>(g_limits.maxSessions, g_limits.maxSessionsPerIp);
+    if (!store_opts.dir.empty()) {
+      if (store_opts.roomQuotaBytes == 0 || store_opts.fsyncInterval.count() <= 0) { print_usage(argv[0]); return 1; }
+      g_store = std::make_unique<RelayStore>(store_opts);
+      load_owners(store_opts.dir + "/inbox_owners");
+      std::cout << "[relay] Store-and-forward in " << store_opts.dir << " ("
+                << (store_opts.roomQuotaBytes >> 20) << " MiB/room, ttl " << store_opts.ttl.count() << "s)\n";
+    }
+    if (!cluster_opts.nodeId.empty()) {
+      if (cluster_opts.listenPort == 0) { print_usage(argv[0]); return 1; }
+      // Cluster links write with plain send(); a dead peer is an EPIPE to handle.
+      std::signal(SIGPIPE, SIG_IGN);
+      g_cluster = std::make_unique<RelayCluster>(cluster_opts, &deliver_from_cluster,
+          [](const std::function<void(const std::string&)>& fn) {
+            std::lock_guard<std::mutex> lk(g_rooms_mtx);
+            for (auto& kv : g_rooms) fn(kv.first);
+          });
+      std::cout << "[relay] Cluster node " << cluster_opts.nodeId << " on port " << cluster_opts.listenPort
+                << " with " << cluster_opts.peers.size() << " peers\n";
+    }
     boost::asio::io_context ioc{1};
-    tcp::acceptor acc{ioc, tcp::endpoint(tcp::v4(), port)};
-    std::cout << "[relay] Listening on port " << port << " (/ws?room=<name>)\n";
-    for (;;) {
-      tcp::socket socket{ioc};
-      acc.accept(socket);
-      std::thread(&do_http, std::move(socket)).detach();
+    const tcp::endpoint endpoint(tcp::v4(), port);
+    tcp::acceptor acc{ioc};
+    acc.open(endpoint.protocol());
+    acc.set_option(tcp::acceptor::reuse_address(true));
+    if (reuse_port) {
+      // Lets a replacement relay bind while this one drains; the kernel spreads
+      // new connections across both until this listener closes.
+      acc.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+    }
+    acc.bind(endpoint);
+    acc.listen(boost::asio::socket_base::max_listen_connections);
+    std::cout << "[relay] Listening on port " << port << " (/ws?room=<name>)" << std::endl;
+
+    std::function<void()> accept_next = [&]{
+      acc.async_accept([&](boost::system::error_code ec, tcp::socket socket) {
+        if (ec == boost::asio::error::operation_aborted) return;
+        if (ec) {
+          std::cerr << "[relay] accept: " << ec.message() << "\n";
+        } else {
+          relay_metrics::add(relay_metrics::kAccepts);
+          std::thread(&do_http, std::move(socket)).detach();
+        }
+        if (acc.is_open()) accept_next();
+      });
+    };
+    accept_next();
+
+    // SIGTERM/SIGINT: stop listening at once, drain on a helper thread while the
+    // io_context keeps watching for a second signal, which exits immediately.
+    boost::asio::signal_set signals(ioc, SIGTERM, SIGINT);
+    std::thread drainer;
+    signals.async_wait([&](const boost::system::error_code& ec, int sig) {
+      if (ec) return;
+      std::cout << "[relay] Signal " << sig << ": listener closed, draining" << std::endl;
+      g_draining = true;
+      boost::system::error_code ignored;
+      acc.close(ignored);
+      signals.async_wait([](const boost::system::error_code& e, int) {
+        if (e) return;
+        std::cerr << "[relay] Second signal, exiting without drain\n";
+        std::_Exit(1);
+      });
+      drainer = std::thread([&]{
+        drain_sessions(drain_window, std::chrono::seconds(5));
+        ioc.stop();
+      });
+    });
+    ioc.run();
+    if (drainer.joinable()) drainer.join();
+
+    if (g_sessions->active() > 0) {
+      // Session threads still running would race static destructors.
+      std::cerr << "[relay] " << g_sessions->active() << " sessions did not close; exiting\n";
+      std::_Exit(0);
     }
+    if (g_cluster) g_cluster->stop();
+    g_store.reset();  // final fdatasync
+    std::cout << "[relay] Drained" << std::endl;
   } catch (const std::exception& e) {
     std::cerr << "Fatal: " << e.what() << "\n";
     return 1;
@@ -0,0 +1,450 @@
+#include "relay_store.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+// Segment file: magic, then records of
+//   u32 body length | u32 crc32(body) | body = u64 timestamp ms | u16 sender length | sender | payload
+// all little-endian.
+constexpr char kSegmentMagic[8] = {'E', '2', 'E', 'S', 'E', 'G', '0', '1'};
+constexpr size_t kRecordHeader = 8;
+constexpr size_t kBodyFixed = 10;
+
+void putLe(uint8_t* p, uint64_t v, size_t n) {
+  for (size_t i = 0; i < n; ++i) p[i] = static_cast<uint8_t>(v >> (8 * i));
+}
+
+uint64_t getLe(const uint8_t* p, size_t n) {
+  uint64_t v = 0;
+  for (size_t i = 0; i < n; ++i) v |= uint64_t(p[i]) << (8 * i);
+  return v;
+}
+
+uint64_t nowMs() {
+  return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+// Room names are arbitrary query strings; hex keeps them filesystem-safe.
+std::string hexName(const std::string& room) {
+  static const char kHex[] = "0123456789abcdef";
+  std::string out;
+  out.reserve(room.size() * 2 + 1);
+  out.push_back('r');  // never empty, even for room ""
+  for (unsigned char c : room) { out.push_back(kHex[c >> 4]); out.push_back(kHex[c & 15]); }
+  return out;
+}
+
+bool unhexName(const std::string& dir, std::string& room) {
+  if (dir.empty() || dir[0] != 'r' || dir.size() % 2 == 0) return false;
+  room.clear();
+  for (size_t i = 1; i + 1 < dir.size(); i += 2) {
+    unsigned v = 0;
+    for (size_t k = 0; k < 2; ++k) {
+      const char c = dir[i + k];
+      v <<= 4;
+      if (c >= '0' && c <= '9') v |= unsigned(c - '0');
+      else if (c >= 'a' && c <= 'f') v |= unsigned(c - 'a' + 10);
+      else return false;
+    }
+    room.push_back(static_cast<char>(v));
+  }
+  return true;
+}
+
+std::string segmentName(uint64_t seq) {
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "%016llu.seg", static_cast<unsigned long long>(seq));
+  return buf;
+}
+
+bool readFile(const std::string& path, std::vector<uint8_t>& out) {
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  struct stat st{};
+  bool ok = ::fstat(fd, &st) == 0;
+  if (ok) {
+    out.resize(static_cast<size_t>(st.st_size));
+    size_t got = 0;
+    while (got < out.size()) {
+      const ssize_t n = ::read(fd, out.data() + got, out.size() - got);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+      got += static_cast<size_t>(n);
+    }
+    out.resize(got);
+  }
+  ::close(fd);
+  return ok;
+}
+
+// Walks the records in a segment image; returns the offset just past the last
+// intact record (the valid length of the file).
+template <typename Fn>
+size_t forEachRecord(const std::vector<uint8_t>& buf, Fn&& fn) {
+  if (buf.size() < sizeof(kSegmentMagic) || std::memcmp(buf.data(), kSegmentMagic, sizeof(kSegmentMagic)) != 0) {
+    return 0;
+  }
+  size_t off = sizeof(kSegmentMagic);
+  while (off + kRecordHeader <= buf.size()) {
+    const size_t len = static_cast<size_t>(getLe(&buf[off], 4));
+    const uint32_t crc = static_cast<uint32_t>(getLe(&buf[off + 4], 4));
+    if (len < kBodyFixed || off + kRecordHeader + len > buf.size()) break;
+    const uint8_t* body = &buf[off + kRecordHeader];
+    if (::crc32(0, body, static_cast<uInt>(len)) != crc) break;
+    const size_t senderLen = static_cast<size_t>(getLe(body + 8, 2));
+    if (kBodyFixed + senderLen > len) break;
+    RelayStore::Record rec;
+    rec.timestampMs = getLe(body, 8);
+    rec.sender.assign(reinterpret_cast<const char*>(body + kBodyFixed), senderLen);
+    rec.payload.assign(body + kBodyFixed + senderLen, body + len);
+    fn(rec);
+    off += kRecordHeader + len;
+  }
+  return off;
+}
+
+// Flushes fd's data to stable storage. macOS has no fdatasync, and its fsync
+// stops at the drive cache, so it uses F_FULLFSYNC (plain fsync where the
+// filesystem does not support that).
+void syncData(int fd) {
+#ifdef __APPLE__
+  if (::fcntl(fd, F_FULLFSYNC) == -1) ::fsync(fd);
+#else
+  ::fdatasync(fd);
+#endif
+}
+}  // namespace
+
+struct RelayStore::Room {
+  std::mutex mtx;
+  std::string name;
+  std::string dir;
+  std::deque<Segment> segments;  // oldest first; back() is the active one while fd >= 0
+  int fd = -1;
+  uint64_t nextSeq = 1;
+  uint64_t bytes = 0;
+  bool dirty = false;            // appended since the last syncData
+};
+
+RelayStore::RelayStore(Options options) : opt_(std::move(options)) {
+  if (opt_.dir.empty()) throw std::runtime_error("store: no directory");
+  opt_.segmentBytes = std::max<uint64_t>(64 * 1024, std::min(opt_.segmentBytes, opt_.roomQuotaBytes / 4));
+  std::error_code ec;
+  fs::create_directories(opt_.dir, ec);
+  if (ec || !fs::is_directory(opt_.dir)) throw std::runtime_error("store: cannot create " + opt_.dir);
+  recover();
+  flusher_ = std::thread([this]{ flusherLoop(); });
+}
+
+RelayStore::~RelayStore() {
+  {
+    std::lock_guard<std::mutex> lk(flushMtx_);
+    stopping_ = true;
+  }
+  flushCv_.notify_all();
+  flusher_.join();
+  std::lock_guard<std::mutex> lk(roomsMtx_);
+  for (auto& kv : rooms_) {
+    std::lock_guard<std::mutex> rlk(kv.second->mtx);
+    closeActiveLocked(*kv.second);
+  }
+}
+
+std::shared_ptr<RelayStore::Room> RelayStore::room(const std::string& name, bool create) {
+  std::lock_guard<std::mutex> lk(roomsMtx_);
+  auto it = rooms_.find(name);
+  if (it != rooms_.end()) return it->second;
+  if (!create) return nullptr;
+  auto r = std::make_shared<Room>();
+  r->name = name;
+  r->dir = (fs::path(opt_.dir) / hexName(name)).string();
+  rooms_.emplace(name, r);
+  return r;
+}
+
+void RelayStore::recover() {
+  std::error_code ec;
+  for (const auto& entry : fs::directory_iterator(opt_.dir, ec)) {
+    std::string name;
+    if (entry.is_directory() && unhexName(entry.path().filename().string(), name)) {
+      recoverRoom(name, entry.path().string());
+    }
+  }
+  if (totalBytes_) {
+    std::cout << "[store] recovered " << rooms_.size() << " rooms, " << totalBytes_ << " bytes\n";
+  }
+}
+
+// Segment sizes and mtimes are trusted except for the newest, which may end in
+// a torn record if the relay died mid-append; that one is scanned and truncated.
+void RelayStore::recoverRoom(const std::string& name, const std::string& dir) {
+  std::vector<std::pair<uint64_t, fs::path>> found;
+  std::error_code ec;
+  for (const auto& entry : fs::directory_iterator(dir, ec)) {
+    if (entry.path().extension() != ".seg") continue;
+    found.emplace_back(std::strtoull(entry.path().stem().string().c_str(), nullptr, 10), entry.path());
+  }
+  std::sort(found.begin(), found.end());
+  auto r = room(name, true);
+  std::lock_guard<std::mutex> lk(r->mtx);
+  for (size_t i = 0; i < found.size(); ++i) {
+    const std::string path = found[i].second.string();
+    uint64_t bytes = fs::file_size(found[i].second, ec);
+    if (i + 1 == found.size()) {
+      std::vector<uint8_t> buf;
+      readFile(path, buf);
+      bytes = forEachRecord(buf, [](const Record&){});
+      if (bytes != buf.size()) ::truncate(path.c_str(), static_cast<off_t>(bytes));
+    }
+    if (bytes <= sizeof(kSegmentMagic)) {
+      fs::remove(found[i].second, ec);
+      continue;
+    }
+    struct stat st{};
+    const uint64_t mtimeMs = ::stat(path.c_str(), &st) == 0 ? uint64_t(st.st_mtime) * 1000 : nowMs();
+    r->segments.push_back(Segment{found[i].first, path, bytes, mtimeMs});
+    r->bytes += bytes;
+    r->nextSeq = found[i].first + 1;
+  }
+  totalBytes_ += r->bytes;
+}
+
+bool RelayStore::openSegmentLocked(Room& r) {
+  std::error_code ec;
+  fs::create_directories(r.dir, ec);
+  Segment seg;
+  // O_EXCL: during a rolling restart another relay may share the directory.
+  do {
+    seg.seq = r.nextSeq++;
+    seg.path = (fs::path(r.dir) / segmentName(seg.seq)).string();
+    r.fd = ::open(seg.path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0600);
+  } while (r.fd < 0 && errno == EEXIST);
+  if (r.fd < 0) {
+    std::cerr << "[store] open " << seg.path << ": " << std::strerror(errno) << "\n";
+    return false;
+  }
+  if (::write(r.fd, kSegmentMagic, sizeof(kSegmentMagic)) != static_cast<ssize_t>(sizeof(kSegmentMagic))) {
+    std::cerr << "[store] write " << seg.path << ": " << std::strerror(errno) << "\n";
+    ::close(r.fd);
+    r.fd = -1;
+    ::unlink(seg.path.c_str());
+    return false;
+  }
+  seg.bytes = sizeof(kSegmentMagic);
+  seg.newestMs = nowMs();
+  r.bytes += seg.bytes;
+  totalBytes_ += seg.bytes;
+  r.segments.push_back(seg);
+  r.dirty = true;
+  return true;
+}
+
+// Rotation happens once per segment, so its syncData is not on the hot path.
+void RelayStore::closeActiveLocked(Room& r) {
+  if (r.fd < 0) return;
+  if (r.dirty) syncData(r.fd);
+  ::close(r.fd);
+  r.fd = -1;
+  r.dirty = false;
+}
+
+void RelayStore::dropSegmentLocked(Room& r, const Segment& seg) {
+  ::unlink(seg.path.c_str());
+  r.bytes -= seg.bytes;
+  totalBytes_ -= seg.bytes;
+}
+
+bool RelayStore::appendLocked(Room& r, uint64_t timestampMs, const std::string& sender,
+                              const uint8_t* data, size_t size) {
+  const size_t senderLen = std::min<size_t>(sender.size(), 0xffff);
+  const size_t bodyLen = kBodyFixed + senderLen + size;
+  const uint64_t recordBytes = kRecordHeader + bodyLen;
+  if (recordBytes + sizeof(kSegmentMagic) > opt_.roomQuotaBytes || bodyLen > 0xffffffffu) return false;
+
+  // Evict oldest-first until the record fits under the quota.
+  while (!r.segments.empty() && r.bytes + recordBytes + sizeof(kSegmentMagic) > opt_.roomQuotaBytes) {
+    if (r.segments.size() == 1 && r.fd >= 0) closeActiveLocked(r);
+    dropSegmentLocked(r, r.segments.front());
+    r.segments.pop_front();
+  }
+  if (r.fd >= 0 && r.segments.back().bytes + recordBytes > opt_.segmentBytes) closeActiveLocked(r);
+  if (r.fd < 0 && !openSegmentLocked(r)) return false;
+
+  uint8_t head[kRecordHeader + kBodyFixed];
+  putLe(head + kRecordHeader, timestampMs, 8);
+  putLe(head + kRecordHeader + 8, senderLen, 2);
+  uLong crc = ::crc32(0, head + kRecordHeader, kBodyFixed);
+  crc = ::crc32(crc, reinterpret_cast<const Bytef*>(sender.data()), static_cast<uInt>(senderLen));
+  crc = ::crc32(crc, data, static_cast<uInt>(size));
+  putLe(head, bodyLen, 4);
+  putLe(head + 4, crc, 4);
+  iovec iov[3] = {{head, sizeof(head)},
+                  {const_cast<char*>(sender.data()), senderLen},
+                  {const_cast<uint8_t*>(data), size}};
+  const ssize_t n = ::writev(r.fd, iov, 3);
+  Segment& seg = r.segments.back();
+  if (n != static_cast<ssize_t>(recordBytes)) {
+    std::cerr << "[store] append " << seg.path << ": " << (n < 0 ? std::strerror(errno) : "short write") << "\n";
+    if (n > 0) ::ftruncate(r.fd, static_cast<off_t>(seg.bytes));  // keep the log parseable
+    return false;
+  }
+  seg.bytes += recordBytes;
+  seg.newestMs = std::max(seg.newestMs, timestampMs);
+  r.bytes += recordBytes;
+  totalBytes_ += recordBytes;
+  r.dirty = true;
+  return true;
+}
+
+RelayStore::Append RelayStore::appendIfAbsent(const std::string& name, const std::string& sender,
+                                              const uint8_t* data, size_t size,
+                                              const PeersPresentFn& peersPresent) {
+  auto r = room(name, true);
+  std::lock_guard<std::mutex> lk(r->mtx);
+  if (peersPresent()) return Append::kPeersPresent;
+  return appendLocked(*r, nowMs(), sender, data, size) ? Append::kStored : Append::kDropped;
+}
+
+// Picks up segments written by another relay on the same directory (the old
+// process during a rolling restart) so they are replayed too.
+void RelayStore::adoptSegmentsLocked(Room& r) {
+  std::error_code ec;
+  bool added = false;
+  for (const auto& entry : fs::directory_iterator(r.dir, ec)) {
+    if (entry.path().extension() != ".seg") continue;
+    const std::string path = entry.path().string();
+    if (std::any_of(r.segments.begin(), r.segments.end(), [&](const Segment& s){ return s.path == path; })) continue;
+    struct stat st{};
+    if (::stat(path.c_str(), &st) != 0 || uint64_t(st.st_size) <= sizeof(kSegmentMagic)) continue;
+    const uint64_t seq = std::strtoull(entry.path().stem().string().c_str(), nullptr, 10);
+    r.segments.push_back(Segment{seq, path, uint64_t(st.st_size), uint64_t(st.st_mtime) * 1000});
+    r.bytes += uint64_t(st.st_size);
+    totalBytes_ += uint64_t(st.st_size);
+    r.nextSeq = std::max(r.nextSeq, seq + 1);
+    added = true;
+  }
+  if (added) {
+    std::sort(r.segments.begin(), r.segments.end(),
+              [](const Segment& a, const Segment& b){ return a.seq < b.seq; });
+  }
+}
+
+size_t RelayStore::join(const std::string& name, const std::string& user,
+                        const JoinFn& addToRoom, const DeliverFn& deliver) {
+  auto r = room(name, true);
+  std::deque<Segment> backlog;
+  {
+    std::lock_guard<std::mutex> lk(r->mtx);
+    adoptSegmentsLocked(*r);
+    closeActiveLocked(*r);
+    backlog.swap(r->segments);
+    totalBytes_ -= r->bytes;
+    r->bytes = 0;
+    addToRoom();
+  }
+
+  const uint64_t expiredBefore = nowMs() - static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(opt_.ttl).count());
+  size_t delivered = 0;
+  bool failed = false;
+  std::vector<uint8_t> buf;
+  for (const auto& seg : backlog) {
+    if (!readFile(seg.path, buf)) {
+      std::cerr << "[store] read " << seg.path << ": " << std::strerror(errno) << "\n";
+      continue;
+    }
+    forEachRecord(buf, [&](const Record& rec) {
+      if (rec.timestampMs < expiredBefore) return;
+      const bool own = !user.empty() && rec.sender == user;
+      if (!own && !failed) {
+        if (deliver(rec)) { ++delivered; return; }
+        failed = true;
+      }
+      std::lock_guard<std::mutex> lk(r->mtx);
+      appendLocked(*r, rec.timestampMs, rec.sender, rec.payload.data(), rec.payload.size());
+    });
+    ::unlink(seg.path.c_str());
+  }
+  return delivered;
+}
+
+void RelayStore::flusherLoop() {
+  auto nextExpire = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lk(flushMtx_);
+  while (!stopping_) {
+    flushCv_.wait_for(lk, opt_.fsyncInterval, [&]{ return stopping_; });
+    lk.unlock();
+    const auto now = std::chrono::steady_clock::now();
+    const bool expire = now >= nextExpire;
+    if (expire) nextExpire = now + std::chrono::seconds(1);
+    flushAndExpire(expire);
+    lk.lock();
+  }
+}
+
+// Group commit: one syncData per dirty room per interval covers every append
+// since the last one. The fd is dup'd so appends continue during the sync.
+void RelayStore::flushAndExpire(bool expire) {
+  std::vector<std::shared_ptr<Room>> snapshot;
+  {
+    std::lock_guard<std::mutex> lk(roomsMtx_);
+    snapshot.reserve(rooms_.size());
+    for (auto& kv : rooms_) snapshot.push_back(kv.second);
+  }
+  const uint64_t expiredBefore = nowMs() - static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(opt_.ttl).count());
+  for (auto& r : snapshot) {
+    int fd = -1;
+    {
+      std::lock_guard<std::mutex> lk(r->mtx);
+      if (r->dirty && r->fd >= 0) {
+        fd = ::dup(r->fd);
+        r->dirty = false;
+      }
+      while (expire && !r->segments.empty() && r->segments.front().newestMs < expiredBefore) {
+        if (r->segments.size() == 1 && r->fd >= 0) closeActiveLocked(*r);
+        dropSegmentLocked(*r, r->segments.front());
+        r->segments.pop_front();
+      }
+    }
+    if (fd >= 0) {
+      syncData(fd);
+      ::close(fd);
+    }
+  }
+  if (!expire) return;
+
+  // Forget rooms with nothing stored that nobody is using.
+  std::lock_guard<std::mutex> lk(roomsMtx_);
+  for (auto it = rooms_.begin(); it != rooms_.end();) {
+    Room& r = *it->second;
+    if (it->second.use_count() <= 2 && r.mtx.try_lock()) {  // the map and snapshot
+      const bool empty = r.segments.empty() && r.fd < 0;
+      const std::string dir = r.dir;
+      r.mtx.unlock();
+      if (empty) {
+        std::error_code ec;
+        fs::remove(dir, ec);
+        it = rooms_.erase(it);
+        continue;
+      }
+    }
+    ++it;
+  }
+}
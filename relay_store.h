@@ -0,0 +1,107 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Optional store-and-forward queue for relay_server (--store-dir).
+//
+// A frame sent into a room with nobody else in it is appended to that room's
+// log instead of being dropped, and the log is replayed in order to the next
+// session that joins with a different user= (or to anyone, for anonymous
+// senders). Each room is a directory of append-only segment files
+// (<dir>/<hex room>/<seq>.seg); a record is one writev() so appends cost a
+// syscall, not an fsync. A flusher thread fdatasyncs dirty segments every
+// fsyncInterval (group commit: a crash loses at most that window) and deletes
+// whole segments older than ttl. When a room would exceed roomQuotaBytes its
+// oldest segments are evicted first; a frame that still does not fit is
+// dropped. Delivery is at-least-once: replayed segments are deleted only after
+// the replay finishes, so a crash mid-replay replays them again. Two relays may
+// share dir during a rolling restart: segment files are created exclusively,
+// and a join also replays segments the other process wrote.
+//
+// Throws std::runtime_error from the constructor if dir is unusable; append
+// and replay I/O errors are logged and reported through the return values.
+class RelayStore {
+public:
+  struct Options {
+    std::string dir;
+    uint64_t roomQuotaBytes = 64ull << 20;
+    uint64_t segmentBytes = 4ull << 20;  // clamped to a quarter of the quota
+    std::chrono::seconds ttl{std::chrono::hours(24 * 7)};
+    std::chrono::milliseconds fsyncInterval{50};
+  };
+
+  struct Record {
+    uint64_t timestampMs = 0;
+    std::string sender;  // user= of the session that sent it; empty if anonymous
+    std::vector<uint8_t> payload;
+  };
+
+  // Called under the room's store lock so the caller's room membership check
+  // is atomic with respect to join().
+  using PeersPresentFn = std::function<bool()>;
+  using JoinFn = std::function<void()>;
+  // Writes one replayed frame to the joining session; false stops the replay
+  // and keeps the remaining records.
+  using DeliverFn = std::function<bool(const Record&)>;
+
+  explicit RelayStore(Options options);
+  ~RelayStore();
+  RelayStore(const RelayStore&) = delete;
+  RelayStore& operator=(const RelayStore&) = delete;
+
+  enum class Append { kPeersPresent, kStored, kDropped };
+
+  // Stores data for room unless peersPresent() says someone can take it live.
+  // kDropped means the frame is larger than the quota or the write failed.
+  Append appendIfAbsent(const std::string& room, const std::string& sender,
+                        const uint8_t* data, size_t size, const PeersPresentFn& peersPresent);
+
+  // Detaches the room's backlog, runs addToRoom() (so later frames go live),
+  // then streams every record not sent by user through deliver, in order.
+  // Records from user itself, and anything after a failed delivery, are
+  // re-appended. Returns the number of records delivered.
+  size_t join(const std::string& room, const std::string& user,
+              const JoinFn& addToRoom, const DeliverFn& deliver);
+
+  uint64_t totalBytes() const { return totalBytes_.load(std::memory_order_relaxed); }
+
+private:
+  struct Segment {
+    uint64_t seq = 0;
+    std::string path;
+    uint64_t bytes = 0;
+    uint64_t newestMs = 0;
+  };
+  struct Room;
+
+  std::shared_ptr<Room> room(const std::string& name, bool create);
+  void recover();
+  void recoverRoom(const std::string& name, const std::string& dir);
+  void adoptSegmentsLocked(Room& r);
+  bool appendLocked(Room& r, uint64_t timestampMs, const std::string& sender,
+                    const uint8_t* data, size_t size);
+  bool openSegmentLocked(Room& r);
+  void closeActiveLocked(Room& r);
+  void dropSegmentLocked(Room& r, const Segment& seg);
+  void flusherLoop();
+  void flushAndExpire(bool expire);
+
+  Options opt_;
+  std::mutex roomsMtx_;
+  std::map<std::string, std::shared_ptr<Room>> rooms_;
+  std::atomic<uint64_t> totalBytes_{0};
+
+  std::mutex flushMtx_;
+  std::condition_variable flushCv_;
+  bool stopping_ = false;
+  std::thread flusher_;
+};
@@ -4,6 +4,7 @@ set -euo pipefail
 sudo apt-get update
 sudo apt-get install -y build-essential cmake pkg-config \
   libboost-system-dev libssl-dev protobuf-compiler libprotobuf-dev \
+  zlib1g-dev libzstd-dev \
   qt6-base-dev qt6-websockets-dev
 
 # liboqs: use distro if available, otherwise build from source
@@ -0,0 +1,261 @@
+#include "session.h"
+
+#include <algorithm>
+#include <memory>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+#include "hkdf.h"
+#include "protocol.h"
+
+namespace {
+// HMAC-SHA256 of one byte under a 32-byte chain key, computed from SHA-256
+// directly: the one-shot HMAC() fetches and allocates a MAC context on every
+// call, which is most of a small message's cost on OpenSSL 3.
+void hmac_byte(const uint8_t* key, size_t keyLen, uint8_t input, uint8_t* out) {
+  thread_local std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(EVP_MD_CTX_new(), &EVP_MD_CTX_free);
+  static EVP_MD* sha256 = EVP_MD_fetch(nullptr, "SHA256", nullptr);  // explicit fetch: no per-init lookup
+  uint8_t pad[64];
+  uint8_t inner[32];
+  unsigned int len = 0;
+  auto digest = [&](uint8_t xorByte, const uint8_t* msg, size_t msgLen, uint8_t* md) {
+    std::fill(pad, pad + sizeof(pad), xorByte);
+    for (size_t i = 0; i < keyLen; ++i) pad[i] ^= key[i];
+    if (!ctx || !sha256 || EVP_DigestInit_ex(ctx.get(), sha256, nullptr) != 1 ||
+        EVP_DigestUpdate(ctx.get(), pad, sizeof(pad)) != 1 || EVP_DigestUpdate(ctx.get(), msg, msgLen) != 1 ||
+        EVP_DigestFinal_ex(ctx.get(), md, &len) != 1 || len != 32)
+      throw std::runtime_error("HMAC-SHA256 failed");
+  };
+  digest(0x36, &input, 1, inner);
+  digest(0x5c, inner, sizeof(inner), out);
+  OPENSSL_cleanse(pad, sizeof(pad));
+  OPENSSL_cleanse(inner, sizeof(inner));
+}
+}  // namespace
+
+void Session::set_key(const std::vector<uint8_t>& key, aead::Suite suite) {
+  if (key.size() != EvpAeadCrypto::KEY_SIZE) throw std::invalid_argument("AEAD key must be 32 bytes");
+  key_ = key;
+  suite_ = suite;
+}
+
+void Session::start_epoch(Direction& d, const Key& root, uint32_t epoch) {
+  std::vector<uint8_t> ikm(root.begin(), root.end());
+  auto chain = hkdf_sha256(ikm, protocol::hkdf_salt(), protocol::chain_hkdf_info(), EvpAeadCrypto::KEY_SIZE);
+  auto next = hkdf_sha256(ikm, protocol::hkdf_salt(), protocol::key_update_hkdf_info(), EvpAeadCrypto::KEY_SIZE);
+  d.chain.epoch = epoch;
+  d.chain.index = 0;
+  d.chain.since = Clock::now();
+  d.chain.window = ReplayWindow();
+  std::copy(chain.begin(), chain.end(), d.chain.key.begin());
+  std::copy(next.begin(), next.end(), d.next_root.begin());
+  OPENSSL_cleanse(ikm.data(), ikm.size());
+  OPENSSL_cleanse(chain.data(), chain.size());
+  OPENSSL_cleanse(next.data(), next.size());
+}
+
+Session::Key Session::step(Chain& chain) {
+  Key messageKey, next;
+  hmac_byte(chain.key.data(), chain.key.size(), 0x01, messageKey.data());
+  hmac_byte(chain.key.data(), chain.key.size(), 0x02, next.data());
+  chain.key = next;
+  OPENSSL_cleanse(next.data(), next.size());
+  ++chain.index;
+  return messageKey;
+}
+
+Session::Key Session::advance_to(Chain& chain, uint64_t index, SkippedKeys& skipped) {
+  if (index < chain.index || index - chain.index > kMaxSkip)
+    throw std::runtime_error("Record index outside the receive window");
+  while (chain.index < index) {
+    const uint64_t id = skipped_id(chain.epoch, chain.index);
+    skipped.emplace_back(id, step(chain));
+  }
+  return step(chain);
+}
+
+void Session::commit_skipped(SkippedKeys& skipped) const {
+  for (auto& entry : skipped) {
+    skipped_[entry.first] = entry.second;
+    skipped_order_.push_back(entry.first);
+    OPENSSL_cleanse(entry.second.data(), entry.second.size());
+  }
+  while (skipped_.size() > kMaxSkippedKeys) {
+    auto it = skipped_.find(skipped_order_.front());
+    skipped_order_.pop_front();
+    if (it == skipped_.end()) continue;  // already used
+    OPENSSL_cleanse(it->second.data(), it->second.size());
+    skipped_.erase(it);
+  }
+  // Used keys leave stale ids behind; compact now and then so the queue stays bounded.
+  if (skipped_order_.size() > 2 * kMaxSkippedKeys) {
+    skipped_order_.erase(std::remove_if(skipped_order_.begin(), skipped_order_.end(),
+                                        [&](uint64_t id) { return skipped_.count(id) == 0; }),
+                         skipped_order_.end());
+  }
+}
+
+void Session::drop_skipped(uint32_t epoch) const {
+  for (auto it = skipped_.begin(); it != skipped_.end();) {
+    if (static_cast<uint32_t>(it->first >> 32) == epoch) {
+      OPENSSL_cleanse(it->second.data(), it->second.size());
+      it = skipped_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void Session::start_traffic(uint32_t sendDirection, uint32_t recvDirection) {
+  if (key_.empty()) throw std::runtime_error("Session key not set");
+  auto root = [&](uint32_t direction) {
+    auto info = protocol::traffic_hkdf_info();
+    for (int i = 3; i >= 0; --i) info.push_back(static_cast<uint8_t>(direction >> (8 * i)));
+    auto derived = hkdf_sha256(key_, protocol::hkdf_salt(), info, EvpAeadCrypto::KEY_SIZE);
+    Key r;
+    std::copy(derived.begin(), derived.end(), r.begin());
+    OPENSSL_cleanse(derived.data(), derived.size());
+    return r;
+  };
+  {
+    std::lock_guard<std::mutex> lk(send_mtx_);
+    start_epoch(send_, root(sendDirection), 0);
+  }
+  std::lock_guard<std::mutex> lk(recv_mtx_);
+  start_epoch(recv_, root(recvDirection), 0);
+  recv_prev_.reset();
+  skipped_.clear();
+  skipped_order_.clear();
+  recv_window_ = ReplayWindow();
+}
+
+void Session::set_key_update_policy(uint64_t maxRecords, std::chrono::seconds maxAge) {
+  std::lock_guard<std::mutex> lk(send_mtx_);
+  update_records_ = maxRecords ? maxRecords : kDefaultUpdateRecords;
+  update_age_ = maxAge.count() > 0 ? Clock::duration(maxAge) : Clock::duration(kDefaultUpdateAge);
+}
+
+Session::SendKey Session::next_send_key() const {
+  std::lock_guard<std::mutex> lk(send_mtx_);
+  if (key_.empty()) throw std::runtime_error("Session key not set");
+  // Indices stay below 2^32 so (epoch, index) fits the receiver's cache key.
+  if (send_.chain.index >= update_records_ || send_.chain.index >= UINT32_MAX ||
+      Clock::now() - send_.chain.since >= update_age_) {
+    start_epoch(send_, send_.next_root, send_.chain.epoch + 1);
+  }
+  SendKey out;
+  out.index = send_.chain.index;
+  out.phase = send_.chain.epoch & 1;
+  out.key = step(send_.chain);
+  return out;
+}
+
+void Session::seal_record(SendKey& key, uint32_t direction, const uint8_t* plaintext, size_t len,
+                          const uint8_t* aad, size_t aad_len, uint8_t* out) const {
+  uint8_t nonce[aead::kNonceSize];
+  aead::counterNonce(direction, key.index, nonce);
+  aead::seal(suite_, key.key.data(), nonce, aad, aad_len, plaintext, len, out);
+  OPENSSL_cleanse(key.key.data(), key.key.size());
+}
+
+void Session::decrypt_record(uint64_t index, bool phase, uint32_t direction, const uint8_t* ct_tag, size_t len,
+                             const uint8_t* aad, size_t aad_len, uint8_t* out) const {
+  uint8_t nonce[aead::kNonceSize];
+  aead::counterNonce(direction, index, nonce);
+  auto try_decrypt = [&](const Key& key) {
+    return aead::open(suite_, key.data(), nonce, aad, aad_len, ct_tag, len, out);
+  };
+  std::lock_guard<std::mutex> lk(recv_mtx_);
+  if (key_.empty()) throw std::runtime_error("Session key not set");
+  if (index >= UINT32_MAX) throw std::runtime_error("Record index outside the receive window");
+  if (recv_prev_ && Clock::now() >= recv_prev_until_) {
+    drop_skipped(recv_prev_->epoch);
+    recv_prev_.reset();
+  }
+  const bool current = phase == static_cast<bool>(recv_.chain.epoch & 1);
+  Chain* chain = current ? &recv_.chain : recv_prev_.get();
+  // A few bit operations turn replays away before any hashing or decryption.
+  // The previous and next epochs share a phase, so for the other phase a seen
+  // index only rules out the previous one.
+  if (chain && !chain->window.check(index)) {
+    if (current) throw std::runtime_error("Record replayed or too old");
+    chain = nullptr;
+  }
+
+  // A key set aside when a later record arrived first: O(1) lookup, used once.
+  if (chain) {
+    auto it = skipped_.find(skipped_id(chain->epoch, index));
+    if (it != skipped_.end()) {
+      const bool ok = try_decrypt(it->second);
+      if (!ok) throw std::runtime_error("AEAD tag verification failed");
+      OPENSSL_cleanse(it->second.data(), it->second.size());
+      skipped_.erase(it);
+      chain->window.accept(index);
+      return;
+    }
+  }
+
+  // The same chain moved forward (in order or with a gap), or the tail of the
+  // previous epoch arriving after the update. Work on copies until the tag checks.
+  SkippedKeys skipped;
+  if (chain && index >= chain->index && index - chain->index <= kMaxSkip) {
+    Chain next = *chain;
+    Key messageKey = advance_to(next, index, skipped);
+    const bool ok = try_decrypt(messageKey);
+    OPENSSL_cleanse(messageKey.data(), messageKey.size());
+    if (ok) {
+      *chain = next;
+      chain->window.accept(index);
+      commit_skipped(skipped);
+      return;
+    }
+    if (current) throw std::runtime_error("AEAD tag verification failed");
+    skipped.clear();
+  } else if (current) {
+    throw std::runtime_error(index < recv_.chain.index ? "Record replayed or its key expired"
+                                                       : "Record index outside the receive window");
+  }
+
+  // The other phase and not the previous epoch: the peer has started the next one.
+  Direction updated;
+  start_epoch(updated, recv_.next_root, recv_.chain.epoch + 1);
+  Key messageKey = advance_to(updated.chain, index, skipped);
+  const bool ok = try_decrypt(messageKey);
+  OPENSSL_cleanse(messageKey.data(), messageKey.size());
+  if (!ok) throw std::runtime_error("AEAD tag verification failed");
+  updated.chain.window.accept(index);
+  if (recv_prev_) drop_skipped(recv_prev_->epoch);
+  recv_prev_.reset(new Chain(recv_.chain));
+  recv_prev_until_ = Clock::now() + kPreviousKeyGrace;
+  OPENSSL_cleanse(recv_.next_root.data(), recv_.next_root.size());
+  recv_ = updated;
+  OPENSSL_cleanse(updated.chain.key.data(), updated.chain.key.size());
+  OPENSSL_cleanse(updated.next_root.data(), updated.next_root.size());
+  commit_skipped(skipped);
+}
+
+bool Session::check_sequence(uint64_t seq) const {
+  std::lock_guard<std::mutex> lk(recv_mtx_);
+  return recv_window_.check(seq);
+}
+
+bool Session::accept_sequence(uint64_t seq) const {
+  std::lock_guard<std::mutex> lk(recv_mtx_);
+  return recv_window_.accept(seq);
+}
+
+uint32_t Session::send_epoch() const {
+  std::lock_guard<std::mutex> lk(send_mtx_);
+  return send_.chain.epoch;
+}
+
+uint32_t Session::recv_epoch() const {
+  std::lock_guard<std::mutex> lk(recv_mtx_);
+  return recv_.chain.epoch;
+}
+
+size_t Session::skipped_keys() const {
+  std::lock_guard<std::mutex> lk(recv_mtx_);
+  return skipped_.size();
+}
@@ -1,31 +1,199 @@
 #pragma once
+#include <array>
+#include <chrono>
 #include <vector>
 #include <cstdint>
-#include "crypto.h"
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include "aead.h"
+
+// Anti-replay window over per-direction sequence numbers, as in IPsec
+// (RFC 4303 3.4.3): one bit for each of the last kSize numbers below the
+// highest accepted. A check is a shift and a mask, and memory is fixed however
+// long the session runs. Numbers below the window count as replays.
+class ReplayWindow {
+public:
+  static constexpr uint64_t kSize = 2048;  // covers Session::kMaxSkip
+
+  // False if seq was already accepted or is too old; call before decrypting.
+  bool check(uint64_t seq) const {
+    if (seq >= top_) return true;
+    if (top_ - seq > kSize) return false;
+    return !(bits_[(seq / 64) % kWords] >> (seq % 64) & 1);
+  }
+
+  // Records seq once its record authenticated. False if it was taken meanwhile.
+  bool accept(uint64_t seq) {
+    if (!check(seq)) return false;
+    if (seq >= top_) {
+      // Clear the words past the one holding the highest accepted number, up to
+      // seq's; all of them after a long jump.
+      const uint64_t from = top_ == 0 ? 0 : (top_ - 1) / 64 + 1, to = seq / 64;
+      for (uint64_t w = from; w <= to && w < from + kWords; ++w) bits_[w % kWords] = 0;
+      top_ = seq + 1;
+    }
+    bits_[(seq / 64) % kWords] |= uint64_t(1) << (seq % 64);
+    return true;
+  }
+
+private:
+  // One spare word, so the word holding the newest number never shares a slot
+  // with the oldest one still in the window.
+  static constexpr uint64_t kWords = kSize / 64 + 1;
+  uint64_t top_ = 0;  // highest accepted + 1
+  std::array<uint64_t, kWords> bits_{};
+};
 
 // Minimal wrapper so Phase 4 (Kyber) can just call set_key()
 class Session {
 public:
+  // Defaults for epoch updates on the compact path (see start_traffic).
+  static constexpr uint64_t kDefaultUpdateRecords = 1ull << 24;
+  static constexpr std::chrono::seconds kDefaultUpdateAge{3600};
+  // How long the previous receive chain is kept after the peer updates, so
+  // records sent just before the update still decrypt.
+  static constexpr std::chrono::seconds kPreviousKeyGrace{30};
+
   Session() = default;
 
-  void set_key(const std::vector<uint8_t>& key) { key_ = key; }
+  // suite is the AEAD negotiated in the handshake; every key derived from this
+  // session (ratchet message keys included) is used with it.
+  void set_key(const std::vector<uint8_t>& key, aead::Suite suite = aead::kAes256Gcm);
   const std::vector<uint8_t>& key() const { return key_; }
+  aead::Suite suite() const { return suite_; }
 
-  // Encrypt/decrypt via AES-GCM (nonce management stays with caller for now)
+  // Encrypt/decrypt under the session key (nonce management stays with caller for now)
   std::vector<uint8_t> encrypt(const std::vector<uint8_t>& plaintext,
                                const std::vector<uint8_t>& nonce) const {
-    if (key_.empty()) throw std::runtime_error("Session key not set");
-    AESGCMCrypto crypto(key_);
-    return crypto.encrypt(plaintext, nonce);
+    if (nonce.size() != EvpAeadCrypto::NONCE_SIZE) throw std::invalid_argument("AEAD encrypt: nonce must be 12 bytes");
+    std::vector<uint8_t> out(plaintext.size() + EvpAeadCrypto::TAG_SIZE);
+    encrypt_into(plaintext.data(), plaintext.size(), nonce.data(), nullptr, 0, out.data());
+    return out;
   }
 
   std::vector<uint8_t> decrypt(const std::vector<uint8_t>& ct_tag,
                                const std::vector<uint8_t>& nonce) const {
+    if (nonce.size() != EvpAeadCrypto::NONCE_SIZE) throw std::invalid_argument("AEAD decrypt: nonce must be 12 bytes");
+    if (ct_tag.size() < EvpAeadCrypto::TAG_SIZE) throw std::invalid_argument("AEAD decrypt: input too short");
+    std::vector<uint8_t> out(ct_tag.size() - EvpAeadCrypto::TAG_SIZE);
+    decrypt_into(ct_tag.data(), ct_tag.size(), nonce.data(), nullptr, 0, out.data());
+    return out;
+  }
+
+  // Buffer variants with AAD; same contract as EvpAeadCrypto::encrypt_into.
+  void encrypt_into(const uint8_t* plaintext, size_t pt_len, const uint8_t* nonce,
+                    const uint8_t* aad, size_t aad_len, uint8_t* out) const {
     if (key_.empty()) throw std::runtime_error("Session key not set");
-    AESGCMCrypto crypto(key_);
-    return crypto.decrypt(ct_tag, nonce);
+    aead::seal(suite_, key_.data(), nonce, aad, aad_len, plaintext, pt_len, out);
   }
 
+  void decrypt_into(const uint8_t* ct_tag, size_t len, const uint8_t* nonce,
+                    const uint8_t* aad, size_t aad_len, uint8_t* out) const {
+    if (key_.empty()) throw std::runtime_error("Session key not set");
+    if (len < EvpAeadCrypto::TAG_SIZE) throw std::invalid_argument("AEAD decrypt: input too short");
+    if (!aead::open(suite_, key_.data(), nonce, aad, aad_len, ct_tag, len, out))
+      throw std::runtime_error("AEAD tag verification failed");
+  }
+
+  // Per-direction traffic keys for compact records, derived from the session
+  // key after set_key(). Each direction is a symmetric ratchet:
+  //   epoch root r(0) = HKDF(session key, traffic info || direction)
+  //   chain c(e, 0)   = HKDF(r(e), chain info),  r(e+1) = HKDF(r(e), update info)
+  //   message key     = HMAC(c(e, i), 0x01),     c(e, i+1) = HMAC(c(e, i), 0x02)
+  // so every record has its own key, erased once used. Only r(e+1) and the
+  // current chain are held, so a leaked state exposes no earlier record.
+  //
+  // The sender starts a new epoch after set_key_update_policy()'s record count
+  // or age and flips the header's key phase bit (wire::kFlagKeyPhase); the
+  // header counter is the record's index within its epoch. The receiver
+  // derives the next epoch when it sees the other phase, and keeps the previous
+  // chain for kPreviousKeyGrace for records reordered across the update.
+  // Keys for records skipped by out-of-order delivery wait in a cache of at
+  // most kMaxSkippedKeys (oldest evicted); a record more than kMaxSkip ahead
+  // of its chain is rejected.
+  static constexpr uint32_t kMaxSkip = 2000;
+  static constexpr size_t kMaxSkippedKeys = 1024;
+
+  void start_traffic(uint32_t sendDirection, uint32_t recvDirection);
+  void set_key_update_policy(uint64_t maxRecords, std::chrono::seconds maxAge);
+
+  using Key = std::array<uint8_t, EvpAeadCrypto::KEY_SIZE>;
+  struct SendKey {
+    Key key{};
+    uint64_t index = 0;  // header counter
+    bool phase = false;  // header key phase bit
+  };
+
+  // Advances the send chain, starting a new epoch first when due. index and
+  // phase go in the record header, whose bytes seal_record() takes as AAD.
+  SendKey next_send_key() const;
+  // Seals one record under key with the aead::counterNonce for
+  // (direction, key.index), then erases key.
+  void seal_record(SendKey& key, uint32_t direction, const uint8_t* plaintext, size_t len,
+                   const uint8_t* aad, size_t aad_len, uint8_t* out) const;
+
+  // Decrypts an incoming record under the message key its phase bit and index
+  // select; throws like EvpAeadCrypto::decrypt_into. Chains move, and cached
+  // keys are consumed, only for a record that authenticates.
+  void decrypt_record(uint64_t index, bool phase, uint32_t direction, const uint8_t* ct_tag, size_t len,
+                      const uint8_t* aad, size_t aad_len, uint8_t* out) const;
+
+  // Replay window for records under the session key itself (protobuf
+  // ChatMessages and multi-recipient content keys), which carry a per-direction
+  // sequence number in their AAD. Check before decrypting, accept after.
+  bool check_sequence(uint64_t seq) const;
+  bool accept_sequence(uint64_t seq) const;
+
+  // Current key epochs (0 right after the handshake) and cached skipped keys.
+  uint32_t send_epoch() const;
+  uint32_t recv_epoch() const;
+  size_t skipped_keys() const;
+
 private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Chain {
+    uint32_t epoch = 0;
+    uint64_t index = 0;  // next message index
+    Key key{};
+    Clock::time_point since;
+    ReplayWindow window;  // receive side: indices already decrypted
+  };
+  struct Direction {
+    Chain chain;
+    Key next_root{};
+  };
+
+  static void start_epoch(Direction& d, const Key& root, uint32_t epoch);
+  static Key step(Chain& chain);  // message key for chain.index, then advances
+
+  using SkippedKeys = std::vector<std::pair<uint64_t, Key>>;
+  static uint64_t skipped_id(uint32_t epoch, uint64_t index) { return (uint64_t(epoch) << 32) | index; }
+  // Steps chain up to index, collecting the keys it passes, and returns index's key.
+  static Key advance_to(Chain& chain, uint64_t index, SkippedKeys& skipped);
+  void commit_skipped(SkippedKeys& skipped) const;
+  void drop_skipped(uint32_t epoch) const;
+
   std::vector<uint8_t> key_; // will be filled by Kyber in Phase 4
+  aead::Suite suite_ = aead::kAes256Gcm;
+
+  // Ratchet state changes from const send/receive paths, like the engine's counter.
+  mutable std::mutex send_mtx_;
+  mutable Direction send_;
+  uint64_t update_records_ = kDefaultUpdateRecords;
+  Clock::duration update_age_ = kDefaultUpdateAge;
+
+  // Held while a record decrypts, so receives on one session are serialized.
+  mutable std::mutex recv_mtx_;
+  mutable Direction recv_;
+  mutable std::unique_ptr<Chain> recv_prev_;  // until recv_prev_until_
+  mutable Clock::time_point recv_prev_until_;
+  // Skipped message keys by (epoch << 32 | index), oldest first in skipped_order_.
+  mutable std::unordered_map<uint64_t, Key> skipped_;
+  mutable std::deque<uint64_t> skipped_order_;
+  mutable ReplayWindow recv_window_;  // session-key records, see check_sequence
 };
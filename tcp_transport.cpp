@@ -1,4 +1,5 @@
 #include "tcp_transport.h"
+#include "protocol.h"
 
 #include <vector>
 #include <string>
@@ -56,6 +57,7 @@ bool TcpTransport::recv(std::vector<uint8_t>& out_frame) {
     uint32_t net_len = 0;
     boost::asio::read(socket_, boost::asio::buffer(&net_len, sizeof(net_len)));
     uint32_t len = ntohl(net_len);
+    if (len > protocol::kMaxFrameSize) return false;
     out_frame.resize(len);
     if (len) {
       boost::asio::read(socket_, boost::asio::buffer(out_frame.data(), out_frame.size()));
@@ -0,0 +1,197 @@
+// Shared helpers for the benchmark tools: allocation counting, cycle counter,
+// batched timing loops, latency percentiles and JSON output.
+//
+// allocations() only counts when the executable links tools/bench_alloc.cpp,
+// which replaces the global operator new/delete.
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include <openssl/crypto.h>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+  #include <x86intrin.h>
+  #define BENCH_HAVE_RDTSC 1
+#endif
+
+namespace bench {
+
+inline std::atomic<uint64_t>& allocationCounter() {
+  static std::atomic<uint64_t> n{0};
+  return n;
+}
+
+// Heap allocations made by this process so far (all threads).
+inline uint64_t allocations() { return allocationCounter().load(std::memory_order_relaxed); }
+
+// Time-stamp counter ticks (reference cycles at the nominal frequency); 0 where unavailable.
+inline uint64_t cycles() {
+#ifdef BENCH_HAVE_RDTSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+inline bool haveCycles() {
+#ifdef BENCH_HAVE_RDTSC
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Routes OpenSSL's own mallocs (EVP contexts etc.) through the allocation
+// counter too. Must run before the first OpenSSL call; false if too late.
+inline bool countOpenSslAllocations() {
+  return CRYPTO_set_mem_functions(
+      [](size_t n, const char*, int) -> void* {
+        allocationCounter().fetch_add(1, std::memory_order_relaxed);
+        return std::malloc(n);
+      },
+      [](void* p, size_t n, const char*, int) -> void* {
+        if (!p) allocationCounter().fetch_add(1, std::memory_order_relaxed);
+        return std::realloc(p, n);
+      },
+      [](void* p, const char*, int) { std::free(p); }) == 1;
+}
+
+struct Result {
+  std::string name;
+  size_t bytes = 0;       // payload bytes per op (0 when not meaningful)
+  uint64_t ops = 0;
+  double seconds = 0;
+  double cycles = 0;      // total TSC ticks
+  uint64_t allocs = 0;
+
+  double opsPerSec() const { return seconds > 0 ? ops / seconds : 0; }
+  double nsPerOp() const { return ops ? seconds * 1e9 / ops : 0; }
+  double cyclesPerByte() const { return ops && bytes ? cycles / (double(ops) * bytes) : 0; }
+  double allocsPerOp() const { return ops ? double(allocs) / ops : 0; }
+  double mbPerSec() const { return seconds > 0 ? double(ops) * bytes / seconds / 1e6 : 0; }
+};
+
+// Runs fn() in growing batches until minSeconds have elapsed (and at least minOps
+// calls), after one warm-up call. Batches amortise the clock reads for fast ops.
+template <typename Fn>
+Result run(const std::string& name, size_t bytes, Fn&& fn, double minSeconds = 0.3,
+           uint64_t minOps = 3) {
+  fn();
+  Result r;
+  r.name = name;
+  r.bytes = bytes;
+  uint64_t batch = 1;
+  const uint64_t a0 = allocations();
+  const uint64_t c0 = cycles();
+  const auto t0 = std::chrono::steady_clock::now();
+  for (;;) {
+    for (uint64_t i = 0; i < batch; ++i) fn();
+    r.ops += batch;
+    r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    if (r.seconds >= minSeconds && r.ops >= minOps) break;
+    if (r.seconds < minSeconds / 10) batch *= 2;
+  }
+  r.cycles = static_cast<double>(cycles() - c0);
+  r.allocs = allocations() - a0;
+  return r;
+}
+
+// Collects per-operation latencies (ns) for percentile reporting.
+class Samples {
+public:
+  void reserve(size_t n) { ns_.reserve(n); }
+  void add(double ns) {
+    ns_.push_back(ns);
+    sorted_ = false;
+  }
+  void merge(const Samples& other) {
+    ns_.insert(ns_.end(), other.ns_.begin(), other.ns_.end());
+    sorted_ = false;
+  }
+  size_t size() const { return ns_.size(); }
+  // Nearest-rank percentile, p in (0, 100]. Sorts on first use after an add.
+  double percentile(double p) {
+    if (ns_.empty()) return 0;
+    if (!sorted_) {
+      std::sort(ns_.begin(), ns_.end());
+      sorted_ = true;
+    }
+    size_t rank = static_cast<size_t>(p / 100.0 * ns_.size() + 0.5);
+    rank = std::min(std::max<size_t>(rank, 1), ns_.size());
+    return ns_[rank - 1];
+  }
+
+private:
+  std::vector<double> ns_;
+  bool sorted_ = true;
+};
+
+// Minimal JSON array-of-objects writer; values are numbers or strings.
+class JsonRows {
+public:
+  JsonRows& row() {
+    rows_.emplace_back();
+    return *this;
+  }
+  JsonRows& field(const std::string& key, const std::string& value) {
+    append(key, "\"" + escape(value) + "\"");
+    return *this;
+  }
+  JsonRows& field(const std::string& key, double value) {
+    char buf[64];
+    std::snprintf(buf, sizeof(buf), "%.6g", value);
+    append(key, buf);
+    return *this;
+  }
+  JsonRows& result(const Result& r) {
+    field("name", r.name);
+    field("bytes", double(r.bytes));
+    field("ops", double(r.ops));
+    field("ops_per_sec", r.opsPerSec());
+    field("ns_per_op", r.nsPerOp());
+    if (haveCycles() && r.bytes) field("cycles_per_byte", r.cyclesPerByte());
+    field("allocs_per_op", r.allocsPerOp());
+    return *this;
+  }
+  std::string str() const {
+    std::string out = "[\n";
+    for (size_t i = 0; i < rows_.size(); ++i) {
+      out += "  {" + rows_[i] + "}" + (i + 1 < rows_.size() ? ",\n" : "\n");
+    }
+    return out + "]\n";
+  }
+  // Writes to path ("-" for stdout); false on I/O error.
+  bool write(const std::string& path) const {
+    const std::string s = str();
+    if (path == "-") return std::fwrite(s.data(), 1, s.size(), stdout) == s.size();
+    FILE* f = std::fopen(path.c_str(), "w");
+    if (!f) return false;
+    const bool ok = std::fwrite(s.data(), 1, s.size(), f) == s.size();
+    return std::fclose(f) == 0 && ok;
+  }
+
+private:
+  void append(const std::string& key, const std::string& value) {
+    auto& r = rows_.back();
+    if (!r.empty()) r += ", ";
+    r += "\"" + escape(key) + "\": " + value;
+  }
+  static std::string escape(const std::string& s) {
+    std::string out;
+    for (char c : s) {
+      if (c == '"' || c == '\\') out += '\\';
+      out += c;
+    }
+    return out;
+  }
+  std::vector<std::string> rows_;
+};
+
+}  // namespace bench
@@ -0,0 +1,105 @@
+// Measures compress-then-encrypt codecs on a message corpus: bytes saved vs CPU.
+// Each corpus file is split into messages on blank lines; with no files a small
+// built-in sample (chat lines, JSON, logs) is used.
+//
+// Usage: compress_bench [corpus files...]
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "compression.h"
+
+namespace {
+std::vector<std::string> loadCorpus(int argc, char* argv[]) {
+  std::vector<std::string> msgs;
+  for (int i = 1; i < argc; ++i) {
+    std::ifstream f(argv[i]);
+    if (!f) { std::cerr << "cannot open " << argv[i] << "\n"; continue; }
+    std::string line, cur;
+    while (std::getline(f, line)) {
+      if (line.empty()) {
+        if (!cur.empty()) msgs.push_back(cur);
+        cur.clear();
+      } else {
+        cur += line + "\n";
+      }
+    }
+    if (!cur.empty()) msgs.push_back(cur);
+  }
+  if (!msgs.empty()) return msgs;
+
+  for (int i = 0; i < 200; ++i) msgs.push_back("hey, are we still on for " + std::to_string(i % 12 + 1) + "pm?");
+  for (int i = 0; i < 50; ++i) {
+    std::ostringstream js;
+    js << "{\"data\":{\"items\":[";
+    for (int j = 0; j < 20; ++j) {
+      js << (j ? "," : "") << "{\"id\":\"" << i * 100 + j << "\",\"name\":\"item" << j
+         << "\",\"status\":\"ok\",\"created_at\":\"2024-05-0" << j % 9 + 1 << "T12:00:00Z\"}";
+    }
+    js << "]}}";
+    msgs.push_back(js.str());
+  }
+  for (int i = 0; i < 50; ++i) {
+    std::ostringstream log;
+    for (int j = 0; j < 40; ++j) {
+      log << "2024-05-01 12:00:" << j % 60 << " " << (j % 7 ? "INFO " : "ERROR")
+          << " worker-" << j % 4 << " request " << i * 40 + j << " GET /api/v1/items 200 OK "
+          << j * 3 << "ms\n";
+    }
+    msgs.push_back(log.str());
+  }
+  return msgs;
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  const auto msgs = loadCorpus(argc, argv);
+  size_t total = 0, eligible = 0;
+  for (const auto& m : msgs) {
+    total += m.size();
+    if (m.size() >= compression::kMinCompressSize) eligible += m.size();
+  }
+  std::cout << msgs.size() << " messages, " << total << " bytes ("
+            << eligible << " at or above the " << compression::kMinCompressSize << "-byte threshold)\n";
+  std::cout << "codec     wire_bytes  saved%  compress_MB/s  decompress_MB/s\n";
+
+  for (auto codec : {compression::kDeflate, compression::kZstd}) {
+    if (!compression::inMask(compression::supportedMask(), codec)) continue;
+    size_t wire = 0;
+    std::vector<std::vector<uint8_t>> packed(msgs.size());
+    std::vector<bool> used(msgs.size());
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < msgs.size(); ++i) {
+      const auto& m = msgs[i];
+      used[i] = m.size() >= compression::kMinCompressSize &&
+                compression::compress(codec, reinterpret_cast<const uint8_t*>(m.data()), m.size(), packed[i]);
+      wire += used[i] ? packed[i].size() : m.size();
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    std::vector<uint8_t> out;
+    for (size_t i = 0; i < msgs.size(); ++i) {
+      if (!used[i]) continue;
+      compression::decompress(codec, packed[i].data(), packed[i].size(), out);
+      if (out.size() != msgs[i].size()) { std::cerr << "roundtrip mismatch\n"; return 1; }
+    }
+    auto t2 = std::chrono::steady_clock::now();
+
+    auto mbps = [&](std::chrono::steady_clock::duration d) {
+      double s = std::chrono::duration<double>(d).count();
+      return s > 0 ? eligible / s / 1e6 : 0.0;
+    };
+    std::cout << std::left << std::setw(9) << compression::name(codec) << std::right
+              << std::setw(11) << wire
+              << std::fixed << std::setprecision(1)
+              << std::setw(8) << 100.0 * (total - wire) / total
+              << std::setw(15) << mbps(t1 - t0)
+              << std::setw(17) << mbps(t2 - t1) << "\n";
+  }
+  return 0;
+}
@@ -1,41 +1,27 @@
 // Minimal in-memory handshake + message roundtrip using ConnectionEngine.
 // No sockets; uses two queues as channels.
 
-#include <condition_variable>
+#include <chrono>
 #include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iostream>
-#include <mutex>
-#include <queue>
+#include <iterator>
 #include <string>
 #include <thread>
 
 #include <google/protobuf/stubs/common.h>
 
 #include "connection_engine.h"
-
-struct Channel {
-  std::mutex mtx;
-  std::condition_variable cv;
-  std::queue<std::vector<uint8_t>> q;
-  bool closed = false;
-};
-
-static bool send_to(Channel& ch, const std::vector<uint8_t>& frame) {
-  std::lock_guard<std::mutex> lk(ch.mtx);
-  if (ch.closed) return false;
-  ch.q.push(frame);
-  ch.cv.notify_one();
-  return true;
-}
-
-static bool recv_from(Channel& ch, std::vector<uint8_t>& out) {
-  std::unique_lock<std::mutex> lk(ch.mtx);
-  ch.cv.wait(lk, [&]{ return !ch.q.empty() || ch.closed; });
-  if (ch.q.empty()) return false;
-  out = std::move(ch.q.front());
-  ch.q.pop();
-  return true;
-}
+#include "engine_trace.h"
+#include "envelope.pb.h"
+#include "file_transfer.h"
+#include "group_session.h"
+#include "handshake.pb.h"
+#include "handshake_guard.h"
+#include "mem_channel.h"
+#include "relay_route.h"
+#include "wire_format.h"
 
 int main() {
   GOOGLE_PROTOBUF_VERIFY_VERSION;
@@ -60,6 +46,8 @@ int main() {
   std::cout << "server fp: " << fp_s.substr(0, 16) << "...\n";
 
   Channel c2s, s2c;
+  trace::EngineTrace client_trace;
+  client.setTrace(&client_trace);
 
   auto c_send = [&](const std::vector<uint8_t>& f){ return send_to(c2s, f); };
   auto c_recv = [&](std::vector<uint8_t>& f){ return recv_from(s2c, f); };
@@ -72,8 +60,8 @@ int main() {
     if (!server.runServerHandshake(s_send, s_recv, peer, err)) {
       std::cerr << "server handshake failed: " << err << "\n";
       // close channels
-      { std::lock_guard<std::mutex> lk(c2s.mtx); c2s.closed = true; c2s.cv.notify_all(); }
-      { std::lock_guard<std::mutex> lk(s2c.mtx); s2c.closed = true; s2c.cv.notify_all(); }
+      close_channel(c2s);
+      close_channel(s2c);
       return;
     }
     std::cout << "server sees client fp: " << peer.substr(0, 16) << "...\n";
@@ -82,8 +70,8 @@ int main() {
   std::string peer_client;
   if (!client.runClientHandshake(c_send, c_recv, peer_client, err)) {
     std::cerr << "client handshake failed: " << err << "\n";
-    { std::lock_guard<std::mutex> lk(c2s.mtx); c2s.closed = true; c2s.cv.notify_all(); }
-    { std::lock_guard<std::mutex> lk(s2c.mtx); s2c.closed = true; s2c.cv.notify_all(); }
+    close_channel(c2s);
+    close_channel(s2c);
     th_server.join();
     return 1;
   }
@@ -103,6 +91,485 @@ int main() {
     std::cerr << "decrypt failed: " << err << "\n"; return 1;
   }
   std::cout << "server decrypted: " << plain << "\n";
+  for (auto stage : {trace::kKeygen, trace::kSign, trace::kVerify, trace::kDecaps, trace::kHkdf, trace::kEncrypt}) {
+    if (client_trace.stage(stage).count() != 1) {
+      std::cerr << "trace missing stage " << trace::stageName(stage) << "\n"; return 1;
+    }
+  }
+  client.setTrace(nullptr);
+
+  // Round-trip a bundled burst; order must be preserved
+  const std::vector<std::string> burst = {"one", "two", "three"};
+  if (!client.encryptAndSerializeBundle(burst, "client", "server", frame, err)) {
+    std::cerr << "bundle encrypt failed: " << err << "\n"; return 1;
+  }
+  std::vector<std::string> plains;
+  if (!server.parseAndDecryptMessages(frame, plains, err)) {
+    std::cerr << "bundle decrypt failed: " << err << "\n"; return 1;
+  }
+  if (plains != burst) { std::cerr << "bundle mismatch\n"; return 1; }
+  std::cout << "server decrypted bundle of " << plains.size() << "\n";
+
+  // Both paths must interoperate: protobuf frames are still accepted after v2 negotiation
+  if (client.wireVersion() != protocol::kVersionCompact) {
+    std::cerr << "expected compact wire version, got " << client.wireVersion() << "\n"; return 1;
+  }
+  for (uint32_t version : {protocol::kVersionProtobuf, protocol::kVersionCompact}) {
+    server.setWireVersion(version);
+    if (!server.encryptAndSerializeBundle(burst, "server", "client", frame, err) ||
+        !client.parseAndDecryptMessages(frame, plains, err) || plains != burst) {
+      std::cerr << "v" << version << " server->client failed: " << err << "\n"; return 1;
+    }
+  }
+  std::cout << "client decrypted v1 and v2 bundles\n";
+
+  // In-band key updates: the client rotates every 4 records; a record sealed
+  // just before an update still decrypts after the server has moved on
+  {
+    client.setWireVersion(protocol::kVersionCompact);
+    client.setKeyUpdatePolicy(4, std::chrono::seconds(3600));
+    const uint32_t epoch_before = client.session().send_epoch();
+    std::vector<uint8_t> held;
+    for (int i = 0; i < 10; ++i) {
+      if (!client.encryptAndSerializeMessage("update " + std::to_string(i), "client", "server", frame, err)) {
+        std::cerr << "key update encrypt failed: " << err << "\n"; return 1;
+      }
+      if (i == 7) { held = frame; continue; }
+      if (!server.parseAndDecryptMessage(frame, plain, err) || plain != "update " + std::to_string(i)) {
+        std::cerr << "key update decrypt " << i << " failed: " << err << "\n"; return 1;
+      }
+    }
+    if (!server.parseAndDecryptMessage(held, plain, err) || plain != "update 7") {
+      std::cerr << "record from previous key epoch rejected: " << err << "\n"; return 1;
+    }
+    if (client.session().send_epoch() < epoch_before + 2 ||
+        server.session().recv_epoch() != client.session().send_epoch()) {
+      std::cerr << "key epochs did not advance together: " << client.session().send_epoch() << "/"
+                << server.session().recv_epoch() << "\n"; return 1;
+    }
+    client.setKeyUpdatePolicy(0, std::chrono::seconds(0));
+    std::cout << "key updates ok (epoch " << server.session().recv_epoch() << ")\n";
+  }
+
+  // Per-message ratchet: records delivered out of order decrypt from the
+  // skipped-key cache, each key works once, and the cache drains
+  {
+    std::vector<std::vector<uint8_t>> records(5);
+    for (size_t i = 0; i < records.size(); ++i) {
+      if (!client.encryptAndSerializeMessage("ratchet " + std::to_string(i), "client", "server", records[i], err)) {
+        std::cerr << "ratchet encrypt failed: " << err << "\n"; return 1;
+      }
+    }
+    for (size_t i : {4, 0, 2, 1, 3}) {
+      if (!server.parseAndDecryptMessage(records[i], plain, err) || plain != "ratchet " + std::to_string(i)) {
+        std::cerr << "out-of-order record " << i << " failed: " << err << "\n"; return 1;
+      }
+    }
+    if (server.session().skipped_keys() != 0) {
+      std::cerr << server.session().skipped_keys() << " skipped keys left behind\n"; return 1;
+    }
+    if (server.parseAndDecryptMessage(records[2], plain, err)) { std::cerr << "ratchet replay accepted\n"; return 1; }
+    std::cout << "ratchet ok (out of order, replay rejected)\n";
+  }
+
+  // Replay window: protobuf messages carry a sequence number in their AAD; a
+  // repeat is refused before decryption, late arrivals inside the window are not
+  {
+    client.setWireVersion(protocol::kVersionProtobuf);
+    std::vector<uint8_t> first, second;
+    if (!client.encryptAndSerializeMessage("seq a", "client", "server", first, err) ||
+        !client.encryptAndSerializeMessage("seq b", "client", "server", second, err) ||
+        !server.parseAndDecryptMessage(second, plain, err) || plain != "seq b" ||
+        !server.parseAndDecryptMessage(first, plain, err) || plain != "seq a") {
+      std::cerr << "sequenced protobuf messages failed: " << err << "\n"; return 1;
+    }
+    if (server.parseAndDecryptMessage(first, plain, err)) { std::cerr << "protobuf replay accepted\n"; return 1; }
+    // Past the window ring's first wrap, a late record inside the window still decrypts.
+    std::vector<std::vector<uint8_t>> run(2300);
+    for (auto& f : run)
+      if (!client.encryptAndSerializeMessage("seq run", "client", "server", f, err)) {
+        std::cerr << "sequenced encrypt failed: " << err << "\n"; return 1;
+      }
+    for (size_t i = 0; i < run.size(); ++i)
+      if (i != 2250 && !server.parseAndDecryptMessage(run[i], plain, err)) {
+        std::cerr << "in-order record " << i << " rejected: " << err << "\n"; return 1;
+      }
+    if (!server.parseAndDecryptMessage(run[2250], plain, err) || server.parseAndDecryptMessage(run[2250], plain, err)) {
+      std::cerr << "late record after the window wrapped mishandled: " << err << "\n"; return 1;
+    }
+    client.setWireVersion(protocol::kVersionCompact);
+
+    ReplayWindow w;
+    const uint64_t top = 5000;
+    if (!w.accept(top) || !w.accept(top - 1) || w.check(top) || w.check(top - 1) || !w.check(top - 2) ||
+        !w.accept(top + 1 - ReplayWindow::kSize) || w.check(top - ReplayWindow::kSize) ||
+        !w.accept(top + 3 * ReplayWindow::kSize) || w.check(top + 3 * ReplayWindow::kSize) ||
+        !w.check(top + 3 * ReplayWindow::kSize - 1)) {
+      std::cerr << "replay window bookkeeping wrong\n"; return 1;
+    }
+    ReplayWindow inOrder;
+    for (uint64_t seq = 0; seq < 3 * ReplayWindow::kSize; ++seq)
+      if (seq != 3 * ReplayWindow::kSize - 100 && !inOrder.accept(seq)) {
+        std::cerr << "in-order sequence " << seq << " rejected\n"; return 1;
+      }
+    if (!inOrder.accept(3 * ReplayWindow::kSize - 100)) {
+      std::cerr << "replay window bookkeeping wrong\n"; return 1;
+    }
+    std::cout << "replay window ok\n";
+  }
+
+  // A routed frame as the relay delivers it: recipient stripped in place, sender kept
+  {
+    std::vector<uint8_t> routed;
+    if (!client.encryptAndSerializeMessage("routed", "client", "server", frame, err) ||
+        !relay_route::wrap("server", "client", frame.data(), frame.size(), routed)) {
+      std::cerr << "route wrap failed: " << err << "\n"; return 1;
+    }
+    const size_t offset = relay_route::stripRecipient(routed.data(), routed.size());
+    std::string to, from;
+    const uint8_t* inner = nullptr;
+    size_t inner_size = 0;
+    if (!relay_route::parse(routed.data() + offset, routed.size() - offset, to, from, inner, inner_size) ||
+        !to.empty() || from != "client" ||
+        !server.parseAndDecryptMessage(std::vector<uint8_t>(inner, inner + inner_size), plain, err) ||
+        plain != "routed") {
+      std::cerr << "routed frame roundtrip failed: " << err << "\n"; return 1;
+    }
+    std::cout << "routed frame ok\n";
+  }
+
+  // Encrypt-once for several sessions: each direction's engine can wrap the
+  // content key for its peer, and the frame decrypts on either side
+  {
+    std::string big_multi(4096, 'm');
+    if (!ConnectionEngine::encryptForRecipients({&client, &server}, big_multi, "client", frame, err) ||
+        !server.parseAndDecryptMessage(frame, plain, err) || plain != big_multi ||
+        !client.parseAndDecryptMessage(frame, plain, err) || plain != big_multi) {
+      std::cerr << "multi-recipient roundtrip failed: " << err << "\n"; return 1;
+    }
+    if (frame.size() >= big_multi.size()) { std::cerr << "multi-recipient payload was not compressed\n"; return 1; }
+    if (server.parseAndDecryptMessage(frame, plain, err)) { std::cerr << "multi-recipient replay accepted\n"; return 1; }
+
+    // A recipient can unwrap the content key; re-sealing other content under
+    // it must not fool the other recipient
+    if (!ConnectionEngine::encryptForRecipients({&client, &server}, "from client", "client", frame, err)) {
+      std::cerr << "multi-recipient encrypt failed: " << err << "\n"; return 1;
+    }
+    Envelope env;
+    env.ParseFromArray(frame.data(), static_cast<int>(frame.size()));
+    MultiRecipientPayload& multi = *env.mutable_multi_recipient();
+    const WrappedKey& for_server = multi.keys(0);
+    uint8_t key_nonce[AESGCMCrypto::NONCE_SIZE];
+    wire::compactNonce(protocol::kDirectionClientToServer, for_server.counter(), key_nonce);
+    const auto aad = ConnectionEngine::wrappedKeyAad(multi, for_server.key_id());
+    std::vector<uint8_t> content_key(AESGCMCrypto::KEY_SIZE);
+    server.session().decrypt_into(reinterpret_cast<const uint8_t*>(for_server.sealed().data()),
+                                  for_server.sealed().size(), key_nonce, aad.data(), aad.size(), content_key.data());
+    const std::string forged = "from server";
+    std::string& ct = *multi.mutable_ciphertext();
+    ct.resize(forged.size() + AESGCMCrypto::TAG_SIZE);
+    AESGCMCrypto(content_key).encrypt_into(reinterpret_cast<const uint8_t*>(forged.data()), forged.size(),
+                                           reinterpret_cast<const uint8_t*>(multi.nonce().data()), nullptr, 0,
+                                           reinterpret_cast<uint8_t*>(&ct[0]));
+    multi.set_compression(compression::kNone);
+    const std::string resealed = env.SerializeAsString();
+    if (client.parseAndDecryptMessage(std::vector<uint8_t>(resealed.begin(), resealed.end()), plain, err)) {
+      std::cerr << "content re-sealed by a co-recipient accepted\n"; return 1;
+    }
+    if (!client.parseAndDecryptMessage(frame, plain, err) || plain != "from client") {
+      std::cerr << "multi-recipient frame rejected after a forgery: " << err << "\n"; return 1;
+    }
+    std::cout << "multi-recipient frame ok (" << frame.size() << " bytes for 2 sessions)\n";
+  }
+
+  // A client without AES instructions offers only ChaCha20-Poly1305; the host
+  // must pick it and both wire paths must work under it
+  // Handshakes a fresh pair over new channels; the host's error wins if it
+  // failed. to_host / to_client may rewrite frames in flight.
+  using Rewrite = std::function<void(std::vector<uint8_t>&)>;
+  auto handshake_pair = [&](ConnectionEngine& a, ConnectionEngine& b, std::string& e,
+                            const Rewrite& to_host = {}, const Rewrite& to_client = {}) {
+    std::string fp;
+    if (!a.loadOrCreateIdentity(client_id, pw, fp, e) || !b.loadOrCreateIdentity(server_id, pw, fp, e)) return false;
+    Channel a2b, b2a;
+    bool host_ok = false;
+    std::string host_err;
+    std::thread th([&]{
+      std::string peer;
+      host_ok = b.runServerHandshake([&](const std::vector<uint8_t>& f){
+                                       std::vector<uint8_t> out = f;
+                                       if (to_client) to_client(out);
+                                       return send_to(b2a, out);
+                                     },
+                                     [&](std::vector<uint8_t>& f){ return recv_from(a2b, f); }, peer, host_err);
+      if (!host_ok) { close_channel(a2b); close_channel(b2a); }
+    });
+    std::string peer;
+    const bool ok = a.runClientHandshake([&](const std::vector<uint8_t>& f){
+                                           std::vector<uint8_t> out = f;
+                                           if (to_host) to_host(out);
+                                           return send_to(a2b, out);
+                                         },
+                                         [&](std::vector<uint8_t>& f){ return recv_from(b2a, f); }, peer, e);
+    th.join();
+    if (!host_ok) e = host_err;
+    return ok && host_ok;
+  };
+
+  {
+    if (client.aeadSuite() != server.aeadSuite()) { std::cerr << "suite mismatch\n"; return 1; }
+    ConnectionEngine slow, host;
+    slow.setAeadSuites(1u << aead::kChaCha20Poly1305);
+    if (!handshake_pair(slow, host, err) || slow.aeadSuite() != aead::kChaCha20Poly1305 ||
+        host.aeadSuite() != aead::kChaCha20Poly1305) {
+      std::cerr << "chacha20-poly1305 negotiation failed: " << err << "\n"; return 1;
+    }
+    for (uint32_t version : {protocol::kVersionProtobuf, protocol::kVersionCompact}) {
+      slow.setWireVersion(version);
+      if (!slow.encryptAndSerializeMessage("chacha", "slow", "host", frame, err) ||
+          !host.parseAndDecryptMessage(frame, plain, err) || plain != "chacha") {
+        std::cerr << "v" << version << " chacha20-poly1305 roundtrip failed: " << err << "\n"; return 1;
+      }
+    }
+    // Both signatures cover the negotiation: a rewritten choice or offer fails
+    auto rewrite_resp = [](std::vector<uint8_t>& f) {
+      HandshakeResponse resp;
+      if (!resp.ParseFromArray(f.data(), static_cast<int>(f.size())) || resp.kem_ciphertext().empty()) return;
+      resp.set_aead_suite(resp.aead_suite() == aead::kAes256Gcm ? aead::kChaCha20Poly1305 : aead::kAes256Gcm);
+      const std::string bytes = resp.SerializeAsString();
+      f.assign(bytes.begin(), bytes.end());
+    };
+    auto rewrite_hello = [](std::vector<uint8_t>& f) {
+      HandshakeHello hello;
+      if (!hello.ParseFromArray(f.data(), static_cast<int>(f.size()))) return;
+      hello.set_aead_suites(1u << aead::kAes256Gcm);
+      hello.set_compression_codecs(0);
+      const std::string bytes = hello.SerializeAsString();
+      f.assign(bytes.begin(), bytes.end());
+    };
+    ConnectionEngine victim, steered;
+    if (handshake_pair(victim, steered, err, {}, rewrite_resp)) {
+      std::cerr << "rewritten aead_suite accepted\n"; return 1;
+    }
+    ConnectionEngine legacy_victim, legacy_host;
+    legacy_victim.setKemAlgorithms(1u << kem::kKyber512);  // legacy hello, v2 host signature
+    if (handshake_pair(legacy_victim, legacy_host, err, {}, rewrite_resp)) {
+      std::cerr << "rewritten aead_suite accepted after a legacy hello\n"; return 1;
+    }
+    ConnectionEngine offerer, offer_host;
+    if (handshake_pair(offerer, offer_host, err, rewrite_hello)) {
+      std::cerr << "rewritten hello offer accepted\n"; return 1;
+    }
+    std::cout << "cipher suites ok (" << aead::name(client.aeadSuite()) << " by default, "
+              << aead::name(slow.aeadSuite()) << " when offered alone)\n";
+  }
+
+  // KEM negotiation: the client's first choice when the host accepts it, one
+  // hello retry when the host only takes another set, failure with nothing common
+  {
+    if (client.kemAlgorithm() != kem::preferred(kem::supportedMask()) ||
+        server.kemAlgorithm() != client.kemAlgorithm()) {
+      std::cerr << "default KEM not negotiated\n"; return 1;
+    }
+    ConnectionEngine strong, host;
+    strong.setKemAlgorithms(1u << kem::kMlKem1024);
+    if (!handshake_pair(strong, host, err) || host.kemAlgorithm() != kem::kMlKem1024) {
+      std::cerr << "ml-kem-1024 handshake failed: " << err << "\n"; return 1;
+    }
+    ConnectionEngine retried, picky;
+    trace::EngineTrace retried_trace;
+    retried.setTrace(&retried_trace);
+    picky.setKemAlgorithms(1u << kem::kMlKem512);
+    if (!handshake_pair(retried, picky, err) || retried.kemAlgorithm() != kem::kMlKem512 ||
+        retried_trace.stage(trace::kKeygen).count() != 2) {
+      std::cerr << "hello retry failed: " << err << "\n"; return 1;
+    }
+    if (!retried.encryptAndSerializeMessage("after retry", "a", "b", frame, err) ||
+        !picky.parseAndDecryptMessage(frame, plain, err) || plain != "after retry") {
+      std::cerr << "roundtrip after hello retry failed: " << err << "\n"; return 1;
+    }
+    ConnectionEngine legacy, modern;
+    legacy.setKemAlgorithms(1u << kem::kKyber512);
+    modern.setKemAlgorithms(1u << kem::kMlKem768);
+    if (handshake_pair(legacy, modern, err)) { std::cerr << "handshake without a common KEM succeeded\n"; return 1; }
+    ConnectionEngine old_style, any_host;
+    old_style.setKemAlgorithms(1u << kem::kKyber512);  // sends the pre-negotiation hello
+    if (!handshake_pair(old_style, any_host, err) || any_host.kemAlgorithm() != kem::kKyber512) {
+      std::cerr << "kyber-512 hello without a list failed: " << err << "\n"; return 1;
+    }
+    std::cout << "kem negotiation ok (" << kem::name(client.kemAlgorithm()) << " by default, hello retry to "
+              << kem::name(retried.kemAlgorithm()) << ")\n";
+  }
+
+  // Hybrid X25519 + KEM by default; a host with it off gives a KEM-only session
+  {
+    if (!client.hybrid() || !server.hybrid()) { std::cerr << "default handshake was not hybrid\n"; return 1; }
+    ConnectionEngine hybrid_client, kem_only_host;
+    kem_only_host.setHybrid(false);
+    if (!handshake_pair(hybrid_client, kem_only_host, err) || hybrid_client.hybrid() || kem_only_host.hybrid() ||
+        !hybrid_client.encryptAndSerializeMessage("kem only", "a", "b", frame, err) ||
+        !kem_only_host.parseAndDecryptMessage(frame, plain, err) || plain != "kem only") {
+      std::cerr << "kem-only fallback failed: " << err << "\n"; return 1;
+    }
+    std::cout << "hybrid x25519 + " << kem::name(client.kemAlgorithm()) << " ok (kem-only when the host declines)\n";
+  }
+
+  // Handshake guard: over budget, the host answers a hello with a cookie
+  // challenge and the client comes back with a solved puzzle; a replayed,
+  // re-bound or unsolved cookie is rejected
+  {
+    HandshakeGuard::Config config;
+    config.freeHellosPerSecond = 0;  // challenge every hello
+    config.puzzleBits = 12;
+    HandshakeGuard guard(config);
+    ConnectionEngine guest, guarded;
+    guarded.setHandshakeGuard(&guard);
+    if (!handshake_pair(guest, guarded, err) || guard.challenged() != 1 ||
+        !guest.encryptAndSerializeMessage("past the guard", "a", "b", frame, err) ||
+        !guarded.parseAndDecryptMessage(frame, plain, err) || plain != "past the guard") {
+      std::cerr << "guarded handshake failed: " << err << "\n"; return 1;
+    }
+    std::string cookie, other;
+    uint32_t bits = 0;
+    const auto keys = HandshakeGuard::binding({"kem", "identity", "x25519"});
+    if (guard.check(keys, "", 0, cookie, bits) != HandshakeGuard::kChallenge || bits != 12) {
+      std::cerr << "guard did not challenge\n"; return 1;
+    }
+    const uint64_t solution = HandshakeGuard::solve(cookie, bits);
+    uint64_t wrong = solution + 1;
+    while (HandshakeGuard::solved(cookie, wrong, bits)) ++wrong;
+    const auto shifted = HandshakeGuard::binding({"kemi", "dentity", "x25519"});
+    if (guard.check(shifted, cookie, solution, other, bits) != HandshakeGuard::kReject ||
+        guard.check(keys, cookie, wrong, other, bits) != HandshakeGuard::kReject ||
+        guard.check(keys, cookie, solution, other, bits) != HandshakeGuard::kAdmit ||
+        guard.check(keys, cookie, solution, other, bits) != HandshakeGuard::kReject) {
+      std::cerr << "guard accepted a bad cookie\n"; return 1;
+    }
+    // A full replay filter turns cookies away instead of forgetting live ones
+    config.puzzleBits = 0;
+    HandshakeGuard busy(config);
+    size_t admitted = 0;
+    for (size_t i = 0; i <= HandshakeGuard::kSpentCookies; ++i) {
+      const auto binding = HandshakeGuard::binding({std::to_string(i)});
+      if (busy.check(binding, "", 0, cookie, bits) == HandshakeGuard::kChallenge &&
+          busy.check(binding, cookie, 0, other, bits) == HandshakeGuard::kAdmit)
+        ++admitted;
+    }
+    if (admitted != HandshakeGuard::kSpentCookies) {
+      std::cerr << "replay filter admitted " << admitted << " cookies\n"; return 1;
+    }
+    std::cout << "handshake guard ok (" << guard.challenged() << " challenges, " << guard.rejected()
+              << " cookies rejected)\n";
+  }
+
+  // Group: alice's sender key reaches bob over the pairwise session, carol gets
+  // hers directly; one frame then decrypts for both until carol is removed
+  {
+    GroupSession alice("g", "alice"), bob("g", "bob"), carol("g", "carol");
+    std::vector<uint8_t> key_frame, group_frame;
+    std::string key_plain, sender, group_plain;
+    auto share = [&](GroupSession& to) {
+      if (&to == &bob) {
+        return client.encryptAndSerializeMessage(alice.senderKey(), "alice", "bob", key_frame, err) &&
+               server.parseAndDecryptMessage(key_frame, key_plain, err) &&
+               bob.addSenderKey("alice", key_plain, err);
+      }
+      return to.addSenderKey("alice", alice.senderKey(), err);
+    };
+    if (!share(bob) || !share(carol) || !alice.encrypt("hi group", group_frame, err) ||
+        !bob.decrypt(group_frame, sender, group_plain, err) || group_plain != "hi group" || sender != "alice" ||
+        !carol.decrypt(group_frame, sender, group_plain, err) || group_plain != "hi group") {
+      std::cerr << "group message failed: " << err << "\n"; return 1;
+    }
+    if (bob.decrypt(group_frame, sender, group_plain, err)) { std::cerr << "group replay accepted\n"; return 1; }
+    alice.removeMember("carol");
+    if (!share(bob) || !alice.encrypt("without carol", group_frame, err) ||
+        !bob.decrypt(group_frame, sender, group_plain, err) || group_plain != "without carol") {
+      std::cerr << "group rekey failed: " << err << "\n"; return 1;
+    }
+    if (carol.decrypt(group_frame, sender, group_plain, err)) { std::cerr << "removed member decrypted\n"; return 1; }
+    std::cout << "group sender keys ok (rekeyed on removal)\n";
+  }
+
+  // Large compressible payloads go through compress-then-encrypt on both paths
+  if (client.compressionCodec() == compression::kNone) {
+    std::cerr << "expected a negotiated compression codec\n"; return 1;
+  }
+  std::string big;
+  for (int i = 0; i < 200; ++i) big += "INFO worker request " + std::to_string(i) + " GET /api 200 OK\n";
+  for (uint32_t version : {protocol::kVersionProtobuf, protocol::kVersionCompact}) {
+    client.setWireVersion(version);
+    if (!client.encryptAndSerializeMessage(big, "client", "server", frame, err) ||
+        !server.parseAndDecryptMessage(frame, plain, err) || plain != big) {
+      std::cerr << "v" << version << " compressed roundtrip failed: " << err << "\n"; return 1;
+    }
+    if (frame.size() >= big.size()) { std::cerr << "payload was not compressed\n"; return 1; }
+  }
+  std::cout << "compressed " << big.size() << " bytes to " << frame.size() << " ("
+            << compression::name(client.compressionCodec()) << ")\n";
+
+  // Stream a multi-chunk file through FileTransfer with a receive loop on each side.
+  // The first attempt loses the link after 20 chunks; the second must resume from
+  // the receiver's bitmap and send only the remaining chunks.
+  const std::string src = "build/test_id/transfer.bin";
+  const std::string downloads = "build/test_id/downloads";
+  const size_t chunk_total = 41;
+  {
+    std::ofstream f(src, std::ios::binary);
+    for (size_t i = 0; i < 40 * FileTransfer::kChunkSize + 123; ++i) f.put(static_cast<char>(i * 7));
+  }
+  std::filesystem::remove_all(downloads);
+  auto transfer = [&](size_t drop_after, size_t& chunks, std::string& ft_err, uint64_t max_size = 0) {
+    Channel up, down;
+    chunks = 0;
+    FileTransfer client_ft(client, [&](const std::vector<uint8_t>& f) {
+      if (ConnectionEngine::frameKind(f) == ConnectionEngine::FrameKind::FileChunk &&
+          ++chunks > drop_after) {
+        return false;
+      }
+      return send_to(up, f);
+    }, "build/test_id/unused");
+    FileTransfer server_ft(server, [&](const std::vector<uint8_t>& f) { return send_to(down, f); },
+                           downloads);
+    server_ft.setMaxIncomingSize(max_size);
+    auto pump = [](Channel& ch, FileTransfer& ft) {
+      std::vector<uint8_t> f;
+      while (recv_from(ch, f)) ft.handleFrame(f);
+    };
+    std::thread rx_server([&]{ pump(up, server_ft); });
+    std::thread rx_client([&]{ pump(down, client_ft); });
+    const bool ok = client_ft.sendFile(src, ft_err);
+    close_channel(up);
+    close_channel(down);
+    rx_server.join();
+    rx_client.join();
+    server_ft.cancelAll();  // disconnect: keeps any partial download for resume
+    return ok;
+  };
+  size_t chunks = 0;
+  std::string ft_err;
+  if (transfer(chunk_total, chunks, ft_err, 1 << 20) || ft_err.find("too large") == std::string::npos ||
+      std::filesystem::exists(downloads + "/transfer.bin.part")) {
+    std::cerr << "oversized offer was not refused: " << ft_err << "\n"; return 1;
+  }
+  if (transfer(20, chunks, ft_err) || !std::filesystem::exists(downloads + "/transfer.bin.part.map")) {
+    std::cerr << "interrupted transfer did not leave a resumable partial\n"; return 1;
+  }
+  if (!transfer(chunk_total, chunks, ft_err)) {
+    std::cerr << "file transfer failed: " << ft_err << "\n"; return 1;
+  }
+  if (chunks != chunk_total - 20) {
+    std::cerr << "resume sent " << chunks << " chunks, expected " << chunk_total - 20 << "\n"; return 1;
+  }
+  auto slurp = [](const std::string& path) {
+    std::ifstream f(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(f), {});
+  };
+  if (slurp(src) != slurp(downloads + "/transfer.bin") ||
+      std::filesystem::exists(downloads + "/transfer.bin.part.map")) {
+    std::cerr << "received file differs\n"; return 1;
+  }
+  std::cout << "file transfer ok (" << std::filesystem::file_size(src) << " bytes, resumed after 20 chunks)\n";
 
   google::protobuf::ShutdownProtobufLibrary();
   return 0;
@@ -0,0 +1,490 @@
+// Handshake throughput benchmark and soak test for the host side.
+//
+// C client threads each loop: open a connection, hand the host end to an accept
+// queue, and run runClientHandshake on a fresh engine. H host threads pop
+// connections and run runServerHandshake on a fresh engine, as a host would per
+// accepted socket. Both sides reuse one unlocked identity per role (setIdentity),
+// so PBKDF2 is paid once and every handshake exercises keygen/sign/verify/KEM/HKDF.
+//
+//   --mode memory   in-memory channels (mem_channel.h): engine cost only
+//   --mode tcp      loopback TCP, length-prefixed like TcpTransport
+//   --mode ws       through a relay: the host end joins a fresh room, then the client
+//
+// Latency is per handshake from "connect" to the client finishing, so it includes
+// time spent waiting in the accept queue; the host-side stage breakdown comes from
+// a shared EngineTrace. Histograms are fixed-size (engine_trace.h), so a long
+// --duration run holds steady memory unless the engine leaks; each --report-every
+// line shows the interval rate and RSS, and the summary prints RSS growth since the
+// first report.
+//
+// Usage: handshake_bench [--mode memory|tcp|ws] [--relay ws://host:port] [--clients C]
+//                        [--host-threads H] [--count N | --duration S] [--report-every S]
+//                        [--kem <set>] [--no-hybrid] [--guard] [--guard-rate R]
+//                        [--puzzle-bits B] [--flood F] [--json <file|->]
+//
+// --kem makes clients offer only that set (kem::parse names, e.g. ml-kem-1024),
+// to compare parameter sets end to end; --no-hybrid leaves out the X25519 half
+// to show what the hybrid exchange adds.
+//
+// --flood adds F threads that replay one captured hello on new connections as
+// fast as the host answers, reading one response each and hanging up, like a
+// handshake flood. --guard gives the host pool a shared HandshakeGuard (R free
+// hellos/s, B-bit puzzles), which answers the flood with cookie challenges
+// instead of public-key work; compare hs/s for the real clients with and
+// without it.
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <boost/asio.hpp>
+#include <google/protobuf/stubs/common.h>
+
+#include "beast_ws_transport.h"
+#include "bench_util.h"
+#include "connection_engine.h"
+#include "engine_trace.h"
+#include "handshake_guard.h"
+#include "mem_channel.h"
+#include "tcp_transport.h"
+
+namespace {
+using Clock = std::chrono::steady_clock;
+using tcp = boost::asio::ip::tcp;
+
+// Host end of one accepted connection.
+struct HostConn {
+  ConnectionEngine::SendFrameFn send;
+  ConnectionEngine::RecvFrameFn recv;
+  std::function<void()> close;
+  std::shared_ptr<void> keepAlive;  // channels / socket / transport the functions use
+};
+
+// Accept queue between client threads (or the TCP acceptor) and the host pool.
+class AcceptQueue {
+public:
+  void push(std::unique_ptr<HostConn> conn) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    q_.push_back(std::move(conn));
+    cv_.notify_one();
+  }
+  std::unique_ptr<HostConn> pop() {
+    std::unique_lock<std::mutex> lk(mtx_);
+    cv_.wait(lk, [&]{ return !q_.empty() || closed_; });
+    if (q_.empty()) return nullptr;
+    auto conn = std::move(q_.front());
+    q_.pop_front();
+    return conn;
+  }
+  void close() {
+    std::lock_guard<std::mutex> lk(mtx_);
+    closed_ = true;
+    cv_.notify_all();
+  }
+
+private:
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  std::deque<std::unique_ptr<HostConn>> q_;
+  bool closed_ = false;
+};
+
+// Client end: the functions runClientHandshake uses, plus whatever owns them.
+struct ClientConn {
+  ConnectionEngine::SendFrameFn send;
+  ConnectionEngine::RecvFrameFn recv;
+  std::function<void()> close;
+  std::shared_ptr<void> keepAlive;
+};
+
+struct MemPair {
+  Channel c2s, s2c;
+};
+
+bool connectMemory(AcceptQueue& accepts, ClientConn& out) {
+  auto pair = std::make_shared<MemPair>();
+  auto host = std::make_unique<HostConn>();
+  host->send = [p = pair.get()](const std::vector<uint8_t>& f){ return send_to(p->s2c, f); };
+  host->recv = [p = pair.get()](std::vector<uint8_t>& f){ return recv_from(p->c2s, f); };
+  host->close = [p = pair.get()]{ close_channel(p->s2c); };
+  host->keepAlive = pair;
+  accepts.push(std::move(host));
+  out.send = [p = pair.get()](const std::vector<uint8_t>& f){ return send_to(p->c2s, f); };
+  out.recv = [p = pair.get()](std::vector<uint8_t>& f){ return recv_from(p->s2c, f); };
+  out.close = [p = pair.get()]{ close_channel(p->c2s); };
+  out.keepAlive = pair;
+  return true;
+}
+
+// Same framing as TcpTransport (4-byte big-endian length), on an accepted socket.
+bool sendFramed(tcp::socket& s, const std::vector<uint8_t>& frame) {
+  boost::system::error_code ec;
+  uint32_t len = htonl(static_cast<uint32_t>(frame.size()));
+  std::array<boost::asio::const_buffer, 2> bufs{boost::asio::buffer(&len, sizeof(len)),
+                                                boost::asio::buffer(frame)};
+  boost::asio::write(s, bufs, ec);
+  return !ec;
+}
+
+bool recvFramed(tcp::socket& s, std::vector<uint8_t>& frame) {
+  boost::system::error_code ec;
+  uint32_t len = 0;
+  boost::asio::read(s, boost::asio::buffer(&len, sizeof(len)), ec);
+  if (ec) return false;
+  len = ntohl(len);
+  if (len > protocol::kMaxFrameSize) return false;
+  frame.resize(len);
+  boost::asio::read(s, boost::asio::buffer(frame), ec);
+  return !ec;
+}
+
+// Accepts on 127.0.0.1:<ephemeral> and feeds the host pool until stopped.
+class TcpHost {
+public:
+  explicit TcpHost(AcceptQueue& accepts)
+      : accepts_(accepts), acceptor_(io_, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)) {
+    acceptor_.listen(boost::asio::socket_base::max_listen_connections);
+    port_ = acceptor_.local_endpoint().port();
+    thread_ = std::thread([this]{ run(); });
+  }
+  ~TcpHost() {
+    stop_ = true;
+    boost::system::error_code ec;
+    TcpTransport wake;  // unblock accept()
+    wake.connect("127.0.0.1", port_);
+    thread_.join();
+    acceptor_.close(ec);
+  }
+  uint16_t port() const { return port_; }
+
+private:
+  void run() {
+    while (!stop_) {
+      auto sock = std::make_shared<tcp::socket>(io_);
+      boost::system::error_code ec;
+      acceptor_.accept(*sock, ec);
+      if (ec || stop_) continue;
+      sock->set_option(tcp::no_delay(true), ec);
+      auto host = std::make_unique<HostConn>();
+      host->send = [s = sock.get()](const std::vector<uint8_t>& f){ return sendFramed(*s, f); };
+      host->recv = [s = sock.get()](std::vector<uint8_t>& f){ return recvFramed(*s, f); };
+      host->close = [s = sock.get()]{ boost::system::error_code e; s->shutdown(tcp::socket::shutdown_both, e); s->close(e); };
+      host->keepAlive = sock;
+      accepts_.push(std::move(host));
+    }
+  }
+
+  AcceptQueue& accepts_;
+  boost::asio::io_context io_;
+  tcp::acceptor acceptor_;
+  uint16_t port_ = 0;
+  std::atomic<bool> stop_{false};
+  std::thread thread_;
+};
+
+bool connectTcp(uint16_t port, ClientConn& out) {
+  auto t = std::make_shared<TcpTransport>();
+  if (!t->connect("127.0.0.1", port)) return false;
+  out.send = [p = t.get()](const std::vector<uint8_t>& f){ return p->send(f); };
+  out.recv = [p = t.get()](std::vector<uint8_t>& f){ return p->recv(f); };
+  out.close = [p = t.get()]{ p->close(); };
+  out.keepAlive = t;
+  return true;
+}
+
+std::string roomUrl(const std::string& relay, const std::string& room) {
+  std::string url = relay;
+  if (url.find('/', url.find("://") + 3) == std::string::npos) url += "/ws";
+  return url + (url.find('?') == std::string::npos ? "?" : "&") + "room=" + room;
+}
+
+std::shared_ptr<BeastWebSocketTransport> joinRoom(const std::string& url) {
+  auto t = std::make_shared<BeastWebSocketTransport>();
+  try {
+    if (!t->connect_url(url)) return nullptr;
+  } catch (...) {
+    return nullptr;
+  }
+  return t;
+}
+
+// Host end joins first so the relay has somewhere to deliver the client's hello.
+bool connectWs(AcceptQueue& accepts, const std::string& relay, uint64_t n, ClientConn& out) {
+  const std::string url = roomUrl(relay, "hsbench-" + std::to_string(::getpid()) + "-" + std::to_string(n));
+  auto hostT = joinRoom(url);
+  if (!hostT) return false;
+  auto clientT = joinRoom(url);
+  if (!clientT) { hostT->close(); return false; }
+  auto host = std::make_unique<HostConn>();
+  host->send = [p = hostT.get()](const std::vector<uint8_t>& f){ return p->send(f); };
+  host->recv = [p = hostT.get()](std::vector<uint8_t>& f){ return p->recv(f); };
+  host->close = [p = hostT.get()]{ p->close(); };
+  host->keepAlive = hostT;
+  accepts.push(std::move(host));
+  out.send = [p = clientT.get()](const std::vector<uint8_t>& f){ return p->send(f); };
+  out.recv = [p = clientT.get()](std::vector<uint8_t>& f){ return p->recv(f); };
+  out.close = [p = clientT.get()]{ p->close(); };
+  out.keepAlive = clientT;
+  return true;
+}
+
+// Resident set size from /proc/self/statm; 0 where that is unavailable.
+uint64_t residentBytes() {
+  std::ifstream statm("/proc/self/statm");
+  uint64_t pages = 0, resident = 0;
+  if (!(statm >> pages >> resident)) return 0;
+  return resident * static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+}
+
+double us(uint64_t ns) { return ns / 1e3; }
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+  std::string mode = "memory", relay = "ws://127.0.0.1:8080", jsonPath;
+  int clients = 64, hostThreads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+  long count = 2000;
+  double duration = 0, reportEvery = 0;
+  kem::Alg kemAlg = kem::preferred(kem::supportedMask());
+  bool hybrid = true, guarded = false;
+  HandshakeGuard::Config guardConfig;
+  int flood = 0;
+  for (int i = 1; i < argc; ++i) {
+    std::string a = argv[i];
+    if (a == "--mode" && i + 1 < argc) mode = argv[++i];
+    else if (a == "--relay" && i + 1 < argc) relay = argv[++i];
+    else if (a == "--clients" && i + 1 < argc) clients = std::atoi(argv[++i]);
+    else if (a == "--host-threads" && i + 1 < argc) hostThreads = std::atoi(argv[++i]);
+    else if (a == "--count" && i + 1 < argc) count = std::atol(argv[++i]);
+    else if (a == "--duration" && i + 1 < argc) duration = std::atof(argv[++i]);
+    else if (a == "--report-every" && i + 1 < argc) reportEvery = std::atof(argv[++i]);
+    else if (a == "--json" && i + 1 < argc) jsonPath = argv[++i];
+    else if (a == "--kem" && i + 1 < argc && kem::parse(argv[i + 1], kemAlg)) ++i;
+    else if (a == "--no-hybrid") hybrid = false;
+    else if (a == "--guard") guarded = true;
+    else if (a == "--guard-rate" && i + 1 < argc) guardConfig.freeHellosPerSecond = std::atof(argv[++i]);
+    else if (a == "--puzzle-bits" && i + 1 < argc) guardConfig.puzzleBits = static_cast<uint32_t>(std::atoi(argv[++i]));
+    else if (a == "--flood" && i + 1 < argc) flood = std::atoi(argv[++i]);
+    else {
+      std::cerr << "Usage: " << argv[0] << " [--mode memory|tcp|ws] [--relay ws://host:port] [--clients C]"
+                   " [--host-threads H] [--count N | --duration S] [--report-every S] [--kem <set>] [--no-hybrid]"
+                   " [--guard] [--guard-rate R] [--puzzle-bits B] [--flood F] [--json <file|->]\n";
+      return 1;
+    }
+  }
+  if (mode != "memory" && mode != "tcp" && mode != "ws") { std::cerr << "unknown mode " << mode << "\n"; return 1; }
+  if (clients < 1 || hostThreads < 1 || flood < 0 || (duration <= 0 && count < 1)) { std::cerr << "counts must be positive\n"; return 1; }
+  if (duration > 0 && reportEvery <= 0) reportEvery = 10;
+
+  std::filesystem::create_directories("build/bench_id");
+  ConnectionEngine loader;
+  std::string fp, err;
+  Identity clientId, serverId;
+  if (!loader.loadOrCreateIdentity("build/bench_id/client.id", "pw", fp, err)) { std::cerr << err << "\n"; return 1; }
+  clientId = loader.identity();
+  if (!loader.loadOrCreateIdentity("build/bench_id/server.id", "pw", fp, err)) { std::cerr << err << "\n"; return 1; }
+  serverId = loader.identity();
+
+  AcceptQueue accepts;
+  std::unique_ptr<TcpHost> tcpHost;
+  if (mode == "tcp") tcpHost = std::make_unique<TcpHost>(accepts);
+
+  trace::EngineTrace hostTrace;
+  HandshakeGuard guard(guardConfig);
+  trace::LatencyHistogram latency;
+  std::atomic<uint64_t> started{0}, completed{0}, clientFailures{0}, hostFailures{0};
+  std::atomic<bool> stop{false};
+  std::mutex errMtx;
+  std::string firstError;
+  auto noteError = [&](const std::string& e) {
+    std::lock_guard<std::mutex> lk(errMtx);
+    if (firstError.empty()) firstError = e;
+  };
+
+  std::vector<std::thread> hosts;
+  for (int h = 0; h < hostThreads; ++h) {
+    hosts.emplace_back([&]{
+      while (auto conn = accepts.pop()) {
+        ConnectionEngine server;
+        server.setIdentity(serverId);
+        server.setTrace(&hostTrace);
+        if (guarded) server.setHandshakeGuard(&guard);
+        std::string peer, e;
+        if (!server.runServerHandshake(conn->send, conn->recv, peer, e)) {
+          ++hostFailures;
+          if (!flood) noteError("host: " + e);  // flood connections hang up mid-handshake
+        }
+        conn->close();
+      }
+    });
+  }
+
+  auto connect = [&](uint64_t n, ClientConn& conn) {
+    return mode == "memory" ? connectMemory(accepts, conn)
+         : mode == "tcp"    ? connectTcp(tcpHost->port(), conn)
+                            : connectWs(accepts, relay, n, conn);
+  };
+
+  // One valid hello, captured from a client whose send never delivers it.
+  std::vector<uint8_t> floodHello;
+  if (flood) {
+    ConnectionEngine capture;
+    capture.setIdentity(clientId);
+    capture.setKemAlgorithms(1u << kemAlg);
+    capture.setHybrid(hybrid);
+    std::string peer, e;
+    capture.runClientHandshake([&](const std::vector<uint8_t>& f){ floodHello = f; return false; },
+                               [](std::vector<uint8_t>&){ return false; }, peer, e);
+  }
+  std::atomic<uint64_t> floodHellos{0};
+  std::atomic<bool> floodStop{false};
+  std::vector<std::thread> flooders;
+  for (int f = 0; f < flood; ++f) {
+    flooders.emplace_back([&, f]{
+      for (uint64_t n = 0; !floodStop; ++n) {
+        ClientConn conn;
+        if (!connect((uint64_t(f + 1) << 40) | n, conn)) continue;
+        std::vector<uint8_t> reply;
+        if (conn.send(floodHello)) ++floodHellos;
+        conn.recv(reply);
+        conn.close();
+      }
+    });
+  }
+
+  const auto t0 = Clock::now();
+  const auto deadline = t0 + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(duration));
+  std::vector<std::thread> workers;
+  for (int c = 0; c < clients; ++c) {
+    workers.emplace_back([&]{
+      for (;;) {
+        if (stop) return;
+        const uint64_t n = started++;
+        if (duration > 0 ? Clock::now() >= deadline : n >= static_cast<uint64_t>(count)) return;
+        const auto begin = Clock::now();
+        ClientConn conn;
+        bool connected = connect(n, conn);
+        if (!connected) {
+          ++clientFailures;
+          noteError("connect failed (" + mode + ")");
+          continue;
+        }
+        ConnectionEngine client;
+        client.setIdentity(clientId);
+        client.setKemAlgorithms(1u << kemAlg);
+        client.setHybrid(hybrid);
+        std::string peer, e;
+        if (client.runClientHandshake(conn.send, conn.recv, peer, e)) {
+          latency.record(static_cast<uint64_t>(
+              std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - begin).count()));
+          ++completed;
+        } else {
+          ++clientFailures;
+          noteError("client: " + e);
+        }
+        conn.close();
+      }
+    });
+  }
+
+  // Progress / soak reporting on the main thread.
+  uint64_t rssFirst = 0, lastDone = 0;
+  auto lastTick = t0;
+  if (reportEvery > 0) {
+    std::thread reporter;
+    std::atomic<bool> workersDone{false};
+    reporter = std::thread([&]{
+      while (!workersDone) {
+        const auto next = lastTick + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(reportEvery));
+        while (!workersDone && Clock::now() < next) std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        if (workersDone) break;
+        const auto now = Clock::now();
+        const uint64_t done = completed.load();
+        const uint64_t rss = residentBytes();
+        if (!rssFirst) rssFirst = rss;
+        std::cout << std::fixed << std::setprecision(1)
+                  << "[" << std::chrono::duration<double>(now - t0).count() << "s] "
+                  << "hs/s=" << std::setprecision(0) << (done - lastDone) / std::chrono::duration<double>(now - lastTick).count()
+                  << " total=" << done << " failed=" << clientFailures.load() + (flood ? 0 : hostFailures.load())
+                  << std::setprecision(1) << " p99_ms=" << latency.percentile(99) / 1e6
+                  << " rss_mb=" << rss / 1048576.0 << std::endl;
+        lastDone = done;
+        lastTick = now;
+      }
+    });
+    for (auto& w : workers) w.join();
+    workersDone = true;
+    reporter.join();
+  } else {
+    for (auto& w : workers) w.join();
+  }
+  const double seconds = std::chrono::duration<double>(Clock::now() - t0).count();
+  floodStop = true;
+  for (auto& f : flooders) f.join();
+  accepts.close();
+  for (auto& h : hosts) h.join();
+  tcpHost.reset();
+
+  const uint64_t done = completed.load();
+  // Under a flood the host's failures are mostly the flood hanging up.
+  const uint64_t failed = clientFailures.load() + (flood ? 0 : hostFailures.load());
+  const double rate = done / seconds;
+  const uint64_t rssEnd = residentBytes();
+  std::cout << "mode=" << mode << " clients=" << clients << " host_threads=" << hostThreads
+            << " kem=" << kem::name(kemAlg) << (hybrid ? "+x25519" : "") << " flood=" << flood
+            << " guard=" << (guarded ? "on" : "off") << "\n"
+            << std::fixed << std::setprecision(0)
+            << "handshakes  " << done << " (" << failed << " failed)\n"
+            << "hs/s        " << rate << "\n"
+            << std::setprecision(1)
+            << "hs/s/thread " << rate / hostThreads << "\n"
+            << "p50 us      " << us(latency.percentile(50)) << "\n"
+            << "p99 us      " << us(latency.percentile(99)) << "\n"
+            << "p99.9 us    " << us(latency.percentile(99.9)) << "\n"
+            << "max us      " << us(latency.max()) << "\n"
+            << "rss MB      " << rssEnd / 1048576.0;
+  if (rssFirst) std::cout << " (" << std::showpos << (double(rssEnd) - double(rssFirst)) / 1048576.0 << std::noshowpos << " since first report)";
+  std::cout << "\n";
+  if (flood) std::cout << "flood hellos " << floodHellos.load() << " (host aborted " << hostFailures.load() << ")\n";
+  if (guarded) std::cout << "guard       " << guard.challenged() << " challenged, " << guard.rejected() << " rejected\n";
+  std::cout << "host stages:\n" << hostTrace.dump();
+  if (!firstError.empty()) std::cerr << "first error: " << firstError << "\n";
+
+  if (!jsonPath.empty()) {
+    bench::JsonRows json;
+    json.row()
+        .field("name", "handshake")
+        .field("mode", mode)
+        .field("kem", kem::name(kemAlg))
+        .field("hybrid", hybrid ? "x25519" : "none")
+        .field("guard", guarded ? "on" : "off")
+        .field("puzzle_bits", guarded ? double(guard.puzzleBits()) : 0.0)
+        .field("flood", flood).field("flood_hellos", double(floodHellos.load()))
+        .field("clients", clients).field("host_threads", hostThreads)
+        .field("handshakes", double(done)).field("failed", double(failed))
+        .field("hs_per_sec", rate)
+        .field("p50_ns", double(latency.percentile(50))).field("p99_ns", double(latency.percentile(99)))
+        .field("p999_ns", double(latency.percentile(99.9)))
+        .field("rss_bytes", double(rssEnd))
+        .field("rss_growth_bytes", rssFirst ? double(rssEnd) - double(rssFirst) : 0.0);
+    if (!json.write(jsonPath)) { std::cerr << "cannot write " << jsonPath << "\n"; return 1; }
+  }
+  google::protobuf::ShutdownProtobufLibrary();
+  return failed && !done ? 1 : 0;
+}
@@ -0,0 +1,63 @@
+// In-memory frame channel used by the loopback test and benchmarks in place of a socket.
+
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "connection_engine.h"
+
+struct Channel {
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::queue<std::vector<uint8_t>> q;
+  bool closed = false;
+};
+
+inline bool send_to(Channel& ch, const std::vector<uint8_t>& frame) {
+  std::lock_guard<std::mutex> lk(ch.mtx);
+  if (ch.closed) return false;
+  ch.q.push(frame);
+  ch.cv.notify_one();
+  return true;
+}
+
+inline bool recv_from(Channel& ch, std::vector<uint8_t>& out) {
+  std::unique_lock<std::mutex> lk(ch.mtx);
+  ch.cv.wait(lk, [&]{ return !ch.q.empty() || ch.closed; });
+  if (ch.q.empty()) return false;
+  out = std::move(ch.q.front());
+  ch.q.pop();
+  return true;
+}
+
+inline void close_channel(Channel& ch) {
+  std::lock_guard<std::mutex> lk(ch.mtx);
+  ch.closed = true;
+  ch.cv.notify_all();
+}
+
+// Runs the client and server handshakes against each other over a fresh pair of
+// channels (server on a helper thread). False with err set if either side fails.
+inline bool handshake_in_memory(ConnectionEngine& client, ConnectionEngine& server, std::string& err) {
+  Channel c2s, s2c;
+  std::string peer, server_err;
+  bool server_ok = false;
+  std::thread th([&]{
+    server_ok = server.runServerHandshake(
+        [&](const std::vector<uint8_t>& f){ return send_to(s2c, f); },
+        [&](std::vector<uint8_t>& f){ return recv_from(c2s, f); }, peer, server_err);
+    if (!server_ok) close_channel(s2c);
+  });
+  bool ok = client.runClientHandshake(
+      [&](const std::vector<uint8_t>& f){ return send_to(c2s, f); },
+      [&](std::vector<uint8_t>& f){ return recv_from(s2c, f); }, peer, err);
+  if (!ok) close_channel(c2s);
+  th.join();
+  if (!server_ok) err = server_err;
+  return ok && server_ok;
+}
@@ -0,0 +1,231 @@
+// End-to-end message pipeline benchmark: N handshaken engine pairs driven by M
+// threads over in-memory channels (mem_channel.h), so the numbers are engine
+// cost only: encrypt -> serialize -> channel -> parse -> decrypt.
+//
+// Each thread owns pairs i % M == t and keeps up to --depth messages in flight
+// per pair. Latency is measured per message from the start of encryption to the
+// end of decryption; allocations cover both ends.
+//
+// --fanout instead sends each message to every pair from one thread, once with
+// an encryptAndSerializeMessage per session and once with encryptForRecipients
+// (one bulk encryption, one wrapped key per session), and compares the two.
+//
+// Usage: pipeline_bench [--pairs N] [--threads M] [--size bytes] [--messages per-pair]
+//                       [--depth D] [--wire 1|2] [--no-compress] [--fanout] [--json <file|->]
+
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <google/protobuf/stubs/common.h>
+
+#include "bench_util.h"
+#include "connection_engine.h"
+#include "mem_channel.h"
+
+namespace {
+struct Pair {
+  ConnectionEngine client;
+  ConnectionEngine server;
+  Channel c2s;
+  std::deque<std::chrono::steady_clock::time_point> inflight;  // send times, FIFO
+};
+
+using Clock = std::chrono::steady_clock;
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  bench::countOpenSslAllocations();
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+  int pairs = 8, threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+  size_t size = 256;
+  long messages = 20000;
+  int depth = 1;
+  uint32_t wire = protocol::kVersionCompact;
+  bool compress = true;
+  bool fanout = false;
+  std::string jsonPath;
+  for (int i = 1; i < argc; ++i) {
+    std::string a = argv[i];
+    if (a == "--pairs" && i + 1 < argc) pairs = std::atoi(argv[++i]);
+    else if (a == "--threads" && i + 1 < argc) threads = std::atoi(argv[++i]);
+    else if (a == "--size" && i + 1 < argc) size = std::strtoul(argv[++i], nullptr, 10);
+    else if (a == "--messages" && i + 1 < argc) messages = std::atol(argv[++i]);
+    else if (a == "--depth" && i + 1 < argc) depth = std::atoi(argv[++i]);
+    else if (a == "--wire" && i + 1 < argc) wire = static_cast<uint32_t>(std::atoi(argv[++i]));
+    else if (a == "--no-compress") compress = false;
+    else if (a == "--fanout") fanout = true;
+    else if (a == "--json" && i + 1 < argc) jsonPath = argv[++i];
+    else {
+      std::cerr << "Usage: " << argv[0] << " [--pairs N] [--threads M] [--size bytes] [--messages per-pair]"
+                   " [--depth D] [--wire 1|2] [--no-compress] [--fanout] [--json <file|->]\n";
+      return 1;
+    }
+  }
+  if (pairs < 1 || threads < 1 || depth < 1 || messages < 1) { std::cerr << "counts must be positive\n"; return 1; }
+  threads = std::min(threads, pairs);
+
+  // One unlock per role; every pair shares the identities.
+  std::filesystem::create_directories("build/bench_id");
+  ConnectionEngine loader;
+  std::string fp, err;
+  Identity clientId, serverId;
+  if (!loader.loadOrCreateIdentity("build/bench_id/client.id", "pw", fp, err)) { std::cerr << err << "\n"; return 1; }
+  clientId = loader.identity();
+  if (!loader.loadOrCreateIdentity("build/bench_id/server.id", "pw", fp, err)) { std::cerr << err << "\n"; return 1; }
+  serverId = loader.identity();
+
+  std::vector<std::unique_ptr<Pair>> all;
+  for (int i = 0; i < pairs; ++i) {
+    auto p = std::make_unique<Pair>();
+    p->client.setIdentity(clientId);
+    p->server.setIdentity(serverId);
+    if (!compress) p->client.setCompressionCodecs(0);
+    if (!handshake_in_memory(p->client, p->server, err)) { std::cerr << "handshake failed: " << err << "\n"; return 1; }
+    p->client.setWireVersion(wire);
+    all.push_back(std::move(p));
+  }
+
+  // Random alphanumerics: compressible about as much as prose, unlike a repeated byte.
+  std::string msg(size, ' ');
+  const char kAlnum[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+  for (auto& c : msg) c = kAlnum[std::rand() % (sizeof(kAlnum) - 1)];
+
+  if (fanout) {
+    std::vector<const ConnectionEngine*> senders;
+    for (const auto& p : all) senders.push_back(&p->client);
+    std::vector<uint8_t> frame;
+    size_t perSessionBytes = 0, onceBytes = 0;
+    auto timeIt = [&](auto&& sendOne) {
+      const uint64_t a0 = bench::allocations();
+      const auto start = Clock::now();
+      for (long n = 0; n < messages; ++n) {
+        if (!sendOne()) return std::make_pair(-1.0, 0.0);
+      }
+      return std::make_pair(std::chrono::duration<double>(Clock::now() - start).count(),
+                            double(bench::allocations() - a0) / messages);
+    };
+    const auto perSession = timeIt([&]{
+      perSessionBytes = 0;
+      for (const auto* c : senders) {
+        if (!c->encryptAndSerializeMessage(msg, "bench", "peer", frame, err)) return false;
+        perSessionBytes += frame.size();
+      }
+      return true;
+    });
+    const auto once = timeIt([&]{
+      if (!ConnectionEngine::encryptForRecipients(senders, msg, "bench", frame, err)) return false;
+      onceBytes = frame.size();
+      return true;
+    });
+    std::string plain;
+    if (perSession.first < 0 || once.first < 0 ||
+        !all.back()->server.parseAndDecryptMessage(frame, plain, err) || plain != msg) {
+      std::cerr << "fanout: " << err << "\n";
+      return 1;
+    }
+    std::cout << "fanout to " << pairs << " sessions, size=" << size << "\n"
+              << std::fixed << std::setprecision(1)
+              << "per-session     " << perSession.first * 1e6 / messages << " us/msg  "
+              << perSessionBytes << " bytes  " << std::setprecision(0) << perSession.second << " allocs\n"
+              << std::setprecision(1)
+              << "encrypt-once    " << once.first * 1e6 / messages << " us/msg  "
+              << onceBytes << " bytes  " << std::setprecision(0) << once.second << " allocs\n"
+              << std::setprecision(2) << "speedup         " << perSession.first / once.first << "x\n";
+    if (!jsonPath.empty()) {
+      bench::JsonRows json;
+      json.row().field("name", "fanout.per_session").field("sessions", pairs).field("size", double(size))
+          .field("us_per_msg", perSession.first * 1e6 / messages).field("bytes", double(perSessionBytes));
+      json.row().field("name", "fanout.encrypt_once").field("sessions", pairs).field("size", double(size))
+          .field("us_per_msg", once.first * 1e6 / messages).field("bytes", double(onceBytes));
+      if (!json.write(jsonPath)) { std::cerr << "cannot write " << jsonPath << "\n"; return 1; }
+    }
+    google::protobuf::ShutdownProtobufLibrary();
+    return 0;
+  }
+
+  std::vector<bench::Samples> latencies(threads);
+  std::vector<std::string> errors(threads);
+  const uint64_t allocs0 = bench::allocations();
+  const auto t0 = Clock::now();
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t]{
+      std::vector<Pair*> mine;
+      for (int i = t; i < pairs; i += threads) mine.push_back(all[i].get());
+      auto& lat = latencies[t];
+      lat.reserve(mine.size() * messages);
+      std::vector<uint8_t> frame, inbound;
+      std::string plain, e;
+      auto receiveOne = [&](Pair& p) {
+        if (!recv_from(p.c2s, inbound) || !p.server.parseAndDecryptMessage(inbound, plain, e)) return false;
+        lat.add(std::chrono::duration<double, std::nano>(Clock::now() - p.inflight.front()).count());
+        p.inflight.pop_front();
+        return plain.size() == size;
+      };
+      for (long n = 0; n < messages; ++n) {
+        for (Pair* p : mine) {
+          p->inflight.push_back(Clock::now());
+          if (!p->client.encryptAndSerializeMessage(msg, "bench", "peer", frame, e) || !send_to(p->c2s, frame)) {
+            errors[t] = "send: " + e;
+            return;
+          }
+          if (p->inflight.size() >= static_cast<size_t>(depth) && !receiveOne(*p)) {
+            errors[t] = "receive: " + e;
+            return;
+          }
+        }
+      }
+      for (Pair* p : mine) {
+        while (!p->inflight.empty()) {
+          if (!receiveOne(*p)) { errors[t] = "receive: " + e; return; }
+        }
+      }
+    });
+  }
+  for (auto& w : workers) w.join();
+  const double seconds = std::chrono::duration<double>(Clock::now() - t0).count();
+  const uint64_t allocs = bench::allocations() - allocs0;
+  for (const auto& e : errors) {
+    if (!e.empty()) { std::cerr << e << "\n"; return 1; }
+  }
+
+  bench::Samples lat;
+  for (const auto& l : latencies) lat.merge(l);
+  const double total = static_cast<double>(pairs) * messages;
+  const double msgsPerSec = total / seconds;
+  std::cout << "pairs=" << pairs << " threads=" << threads << " size=" << size << " depth=" << depth
+            << " wire=" << (wire >= protocol::kVersionCompact ? "compact" : "protobuf")
+            << " codec=" << compression::name(all.front()->client.compressionCodec()) << "\n"
+            << std::fixed << std::setprecision(0)
+            << "msgs/s      " << msgsPerSec << "\n"
+            << std::setprecision(1)
+            << "MB/s        " << msgsPerSec * size / 1e6 << "\n"
+            << "p50 us      " << lat.percentile(50) / 1e3 << "\n"
+            << "p99 us      " << lat.percentile(99) / 1e3 << "\n"
+            << "p99.9 us    " << lat.percentile(99.9) / 1e3 << "\n"
+            << std::setprecision(2)
+            << "allocs/msg  " << allocs / total << "\n";
+
+  if (!jsonPath.empty()) {
+    bench::JsonRows json;
+    json.row()
+        .field("name", "pipeline")
+        .field("pairs", pairs).field("threads", threads).field("size", double(size))
+        .field("depth", depth).field("wire", wire)
+        .field("msgs_per_sec", msgsPerSec)
+        .field("p50_ns", lat.percentile(50)).field("p99_ns", lat.percentile(99))
+        .field("p999_ns", lat.percentile(99.9))
+        .field("allocs_per_msg", allocs / total);
+    if (!json.write(jsonPath)) { std::cerr << "cannot write " << jsonPath << "\n"; return 1; }
+  }
+  google::protobuf::ShutdownProtobufLibrary();
+  return 0;
+}
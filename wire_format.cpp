@@ -0,0 +1,78 @@
+#include "wire_format.h"
+
+#include "crypto.h"
+#include "protocol.h"
+
+namespace {
+void put_be(uint8_t* out, uint64_t v, size_t n) {
+  for (size_t i = 0; i < n; ++i) out[i] = static_cast<uint8_t>(v >> (8 * (n - 1 - i)));
+}
+
+uint64_t get_be(const uint8_t* in, size_t n) {
+  uint64_t v = 0;
+  for (size_t i = 0; i < n; ++i) v = (v << 8) | in[i];
+  return v;
+}
+}  // namespace
+
+namespace wire {
+
+void encodeCompactHeader(const CompactHeader& h, uint8_t* out) {
+  out[0] = h.version;
+  out[1] = h.flags;
+  put_be(out + 2, h.counter, 8);
+  put_be(out + 10, h.length, 4);
+}
+
+bool decodeCompactRecord(const uint8_t* data, size_t size,
+                         CompactHeader& h, const uint8_t*& body, size_t& consumed) {
+  if (size < kCompactHeaderSize) return false;
+  h.version = data[0];
+  h.flags = data[1];
+  h.counter = get_be(data + 2, 8);
+  h.length = static_cast<uint32_t>(get_be(data + 10, 4));
+  if (h.version != protocol::kVersionCompact) return false;
+  if (h.length < AESGCMCrypto::TAG_SIZE || h.length > size - kCompactHeaderSize) return false;
+  body = data + kCompactHeaderSize;
+  consumed = kCompactHeaderSize + h.length;
+  return true;
+}
+
+bool isCompactFrame(const uint8_t* data, size_t size) {
+  return size >= kCompactHeaderSize && data[0] == protocol::kVersionCompact;
+}
+
+void compactNonce(uint32_t direction, uint64_t counter, uint8_t out[12]) {
+  put_be(out, direction, 4);
+  put_be(out + 4, counter, 8);
+}
+
+void encodeFileChunkHeader(const FileChunkHeader& h, uint8_t* out) {
+  out[0] = kFileChunkTag;
+  out[1] = h.flags;
+  put_be(out + 2, h.transfer_id, 8);
+  put_be(out + 10, h.index, 4);
+  put_be(out + 14, h.length, 4);
+}
+
+bool decodeFileChunk(const uint8_t* data, size_t size, FileChunkHeader& h, const uint8_t*& body) {
+  if (!isFileChunkFrame(data, size)) return false;
+  h.flags = data[1];
+  h.transfer_id = get_be(data + 2, 8);
+  h.index = static_cast<uint32_t>(get_be(data + 10, 4));
+  h.length = static_cast<uint32_t>(get_be(data + 14, 4));
+  if (h.length < AESGCMCrypto::TAG_SIZE || h.length != size - kFileChunkHeaderSize) return false;
+  body = data + kFileChunkHeaderSize;
+  return true;
+}
+
+bool isFileChunkFrame(const uint8_t* data, size_t size) {
+  return size >= kFileChunkHeaderSize && data[0] == kFileChunkTag;
+}
+
+void fileChunkNonce(uint32_t index, uint8_t out[12]) {
+  put_be(out, 0, 8);
+  put_be(out + 8, index, 4);
+}
+
+} // namespace wire
@@ -0,0 +1,82 @@
+// Compact fixed-layout framing (protocol v2), used instead of ChatMessage+Envelope
+// once both peers negotiate it. The relay never looks inside either format.
+//
+// Record layout (big-endian):
+//   u8  version   = protocol::kVersionCompact
+//   u8  flags     kFlagCompressed | kFlagFileControl | kFlagKeyPhase, other bits reserved (0)
+//   u64 counter   record index within the sender's key epoch; selects the
+//                 message key (Session) and forms the GCM nonce
+//   u32 length    bytes of ciphertext||tag that follow
+//   ... ciphertext || 16-byte tag   (the 14-byte header is authenticated as AAD)
+//
+// A frame holds one or more records back to back (a bundled burst).
+// Nothing here allocates; callers own every buffer.
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace wire {
+
+constexpr size_t kCompactHeaderSize = 14;
+
+// Plaintext was compressed with the session's negotiated codec before encryption.
+constexpr uint8_t kFlagCompressed = 0x01;
+// Plaintext is a serialized FileControl (file_transfer.h), not chat text.
+constexpr uint8_t kFlagFileControl = 0x02;
+// Low bit of the sender's key epoch; it flips on every key update.
+constexpr uint8_t kFlagKeyPhase = 0x04;
+
+struct CompactHeader {
+  uint8_t version = 0;
+  uint8_t flags = 0;
+  uint64_t counter = 0;
+  uint32_t length = 0;
+};
+
+// Writes kCompactHeaderSize bytes to out.
+void encodeCompactHeader(const CompactHeader& h, uint8_t* out);
+
+// Parses the record at data[0..size). On success fills h, points body at the
+// ciphertext||tag and sets consumed to the full record size.
+bool decodeCompactRecord(const uint8_t* data, size_t size,
+                         CompactHeader& h, const uint8_t*& body, size_t& consumed);
+
+// True when the frame starts with a compact record. Protobuf Envelopes can never
+// start with this byte (field number 0 is invalid), so the check is unambiguous.
+bool isCompactFrame(const uint8_t* data, size_t size);
+
+// 12-byte GCM nonce: 4-byte direction prefix || counter. Each direction of a
+// session uses its own prefix so the two counters never share a nonce.
+void compactNonce(uint32_t direction, uint64_t counter, uint8_t out[12]);
+
+// File chunk record (one per frame), encrypted under a per-transfer key:
+//   u8  tag         = kFileChunkTag
+//   u8  flags       kFlagLastChunk
+//   u64 transfer_id
+//   u32 index       chunk number; the nonce is 8 zero bytes || index
+//   u32 length      bytes of ciphertext||tag that follow
+//   ... ciphertext || 16-byte tag   (the 18-byte header is authenticated as AAD)
+constexpr uint8_t kFileChunkTag = 0x03;
+constexpr uint8_t kFlagLastChunk = 0x01;
+constexpr size_t kFileChunkHeaderSize = 18;
+
+struct FileChunkHeader {
+  uint8_t flags = 0;
+  uint64_t transfer_id = 0;
+  uint32_t index = 0;
+  uint32_t length = 0;
+};
+
+// Writes kFileChunkHeaderSize bytes to out.
+void encodeFileChunkHeader(const FileChunkHeader& h, uint8_t* out);
+
+// Parses a whole chunk frame; body points at ciphertext||tag.
+bool decodeFileChunk(const uint8_t* data, size_t size, FileChunkHeader& h, const uint8_t*& body);
+
+bool isFileChunkFrame(const uint8_t* data, size_t size);
+
+// 12-byte chunk nonce: 8 zero bytes || index.
+void fileChunkNonce(uint32_t index, uint8_t out[12]);
+
+} // namespace wire
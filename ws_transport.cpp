@@ -1,9 +1,11 @@
 #include "ws_transport.h"
+#include "protocol.h"
 #include <QEventLoop>
 #include <QTimer>
 
 WebSocketTransport::WebSocketTransport() {
   socket_.setParent(nullptr); // lives in current thread (EngineWorker's thread)
+  socket_.setMaxAllowedIncomingMessageSize(protocol::kMaxFrameSize);
   QObject::connect(&socket_, &QWebSocket::connected, [this]{
     connected_ = true;
   });
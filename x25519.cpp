@@ -0,0 +1,44 @@
+#include "x25519.h"
+#include <stdexcept>
+
+#include <openssl/evp.h>
+
+namespace x25519 {
+
+void keypair(std::vector<uint8_t>& pub, std::vector<uint8_t>& priv) {
+  EVP_PKEY_CTX* kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, nullptr);
+  if (!kctx) throw std::runtime_error("EVP_PKEY_CTX_new_id X25519 failed");
+  EVP_PKEY* pkey = nullptr;
+  if (EVP_PKEY_keygen_init(kctx) <= 0 || EVP_PKEY_keygen(kctx, &pkey) <= 0) {
+    EVP_PKEY_CTX_free(kctx);
+    throw std::runtime_error("X25519 keygen failed");
+  }
+  EVP_PKEY_CTX_free(kctx);
+
+  size_t pub_len = kKeySize, priv_len = kKeySize;
+  pub.resize(kKeySize);
+  priv.resize(kKeySize);
+  const bool ok = EVP_PKEY_get_raw_public_key(pkey, pub.data(), &pub_len) > 0 &&
+                  EVP_PKEY_get_raw_private_key(pkey, priv.data(), &priv_len) > 0;
+  EVP_PKEY_free(pkey);
+  if (!ok || pub_len != kKeySize || priv_len != kKeySize) throw std::runtime_error("X25519 key export failed");
+}
+
+std::vector<uint8_t> derive(const std::vector<uint8_t>& priv, const std::vector<uint8_t>& peer_pub) {
+  if (priv.size() != kKeySize || peer_pub.size() != kKeySize) throw std::runtime_error("X25519 key size mismatch");
+  EVP_PKEY* sk = EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519, nullptr, priv.data(), priv.size());
+  EVP_PKEY* pk = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, nullptr, peer_pub.data(), peer_pub.size());
+  EVP_PKEY_CTX* ctx = sk ? EVP_PKEY_CTX_new(sk, nullptr) : nullptr;
+  std::vector<uint8_t> ss(kKeySize);
+  size_t len = ss.size();
+  // OpenSSL rejects an all-zero shared secret in derive.
+  const bool ok = ctx && pk && EVP_PKEY_derive_init(ctx) > 0 && EVP_PKEY_derive_set_peer(ctx, pk) > 0 &&
+                  EVP_PKEY_derive(ctx, ss.data(), &len) > 0 && len == kKeySize;
+  EVP_PKEY_CTX_free(ctx);
+  EVP_PKEY_free(pk);
+  EVP_PKEY_free(sk);
+  if (!ok) throw std::runtime_error("X25519 derive failed");
+  return ss;
+}
+
+} // namespace x25519
@@ -0,0 +1,21 @@
+// Ephemeral X25519 (RFC 7748) for the hybrid handshake: the classical half
+// of the session secret next to the KEM's, so the session stays secure if
+// either one is broken.
+
+#pragma once
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace x25519 {
+
+constexpr size_t kKeySize = 32;  // public keys, private keys and shared secrets
+
+// Fresh raw keypair.
+void keypair(std::vector<uint8_t>& pub, std::vector<uint8_t>& priv);
+
+// Shared secret of priv and the peer's raw public key; throws on a malformed
+// key or an all-zero result (a low-order peer point).
+std::vector<uint8_t> derive(const std::vector<uint8_t>& priv, const std::vector<uint8_t>& peer_pub);
+
+} // namespace x25519